@@ -0,0 +1,67 @@
+proc print_to_bench {text} {
+	global bench_result
+	buffer eval $bench_result {
+		m $:$
+		c $text
+	}
+}
+
+proc bench_init {} {
+	global bench_result
+	set bench_result [buffer make +bench-result+]
+	print_to_bench "Benchmarks initialized\n"
+}
+
+# Returns roughly size lines of C-like text
+proc bench_text {size} {
+	set chunk "static int function_name(buffer_t *buffer, int start) {\n\tint r = 0; // comment\n\tfor (int i = start; i < 100; ++i) r += i;\n\treturn r;\n}\n\n"
+	return [string repeat $chunk [expr $size / 6]]
+}
+
+proc regexp_bench {} {
+	set text [bench_text 600000]
+	buffer eval temp {
+		c $text
+		foreach re {{[a-zA-Z_][a-zA-Z0-9_]*} {[0-9]+} {//.*$}} {
+			print_to_bench "regexp $re: [teddy_intl::rebench $re]\n"
+		}
+	}
+}
+
+# Replacing every number: a command that is a single call to c is applied in one change, adding another command forces a change per match.
+# The text is about 1.3M characters long, matches are spread well past the first regexp window
+proc replace_bench {} {
+	set text [bench_text 60000]
+	foreach {name cmd} {batch {c "<$::g1>"} per-match {set x 0; c "<$::g1>"}} {
+		buffer eval temp {
+			c $text
+			m nil 1:1
+			set t [time {s {([0-9]+)} $cmd}]
+		}
+		print_to_bench "replace $name: $t\n"
+	}
+}
+
+# Opening files of 10, 100 and 500 MB
+proc load_bench {} {
+	set text [bench_text 60000]
+	foreach mb {10 100 500} {
+		set path "/tmp/teddy-load-bench-$mb.txt"
+		set f [open $path w]
+		for {set n 0} {$n < $mb * 1024 * 1024} {incr n [string length $text]} {
+			puts -nonewline $f $text
+		}
+		close $f
+
+		set t [time {set b [buffer open $path]}]
+		buffer force-close $b
+		file delete $path
+		print_to_bench "load $mb MB: $t\n"
+	}
+}
+
+# MAIN
+bench_init
+regexp_bench
+replace_bench
+load_bench
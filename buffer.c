@@ -3,6 +3,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <unicode/uchar.h>
 
@@ -10,16 +17,27 @@
 #include "foundry.h"
 #include "interp.h"
 #include "lexy.h"
+#include "searchidx.h"
+#include "trigram.h"
 #include "undo.h"
+#include "journal.h"
 #include "compl.h"
 #include "top.h"
 #include "ipc.h"
 
 #define SLOP 32
 
+// lookups less than this many characters past the end of the layout window extend it instead of going to the scratch line
+#define LAYOUT_SLACK 4096
+// layout windows larger than this are moved instead of extended
+#define LAYOUT_MAX (256 * 1024)
+
 #define MINIMUM_WORDCOMPL_WORD_LEN 3
 #define MAX_BUFFER_EVENT_WATCHERS 10
 
+// files are decoded by one thread for every this many bytes (up to the number of processors)
+#define LOAD_SHARD_MIN (1024 * 1024)
+
 static int phisical(buffer_t *encl, int point) {
 	return (point < encl->gap) ? point : point + encl->gapsz;
 }
@@ -61,18 +79,98 @@ static void regap(buffer_t *buffer, bool twice) {
 	buffer->gapsz = slop;
 	buffer->size += slop;
 
-	free(buffer->buf);
+	free(buffer->buf - buffer->head);
 	buffer->buf = newbuf;
+	buffer->head = 0;
 
 	/*printf("after regap: ");
 	gb_debug_print(buffer);*/
 }
 
+static void lines_regap(line_index_t *li) {
+	int slop = MAX(li->size, SLOP);
+
+	int *newv = malloc(sizeof(int) * (li->size+slop));
+	alloc_assert(newv);
+	uint16_t *newstate = malloc(sizeof(uint16_t) * (li->size+slop));
+	alloc_assert(newstate);
+
+	memmove(newv, li->v, sizeof(int) * li->gap);
+	memmove(newv+li->gap+slop, li->v + li->gap, sizeof(int) * (li->size - li->gap));
+	memmove(newstate, li->state, sizeof(uint16_t) * li->gap);
+	memmove(newstate+li->gap+slop, li->state + li->gap, sizeof(uint16_t) * (li->size - li->gap));
+
+	li->gapsz = slop;
+	li->size += slop;
+
+	free(li->v - li->head);
+	li->v = newv;
+	free(li->state - li->head);
+	li->state = newstate;
+	li->head = 0;
+}
+
+// position of the i-th newline of the buffer
+static int lines_at(buffer_t *buffer, int i) {
+	line_index_t *li = &(buffer->lines);
+	return (i < li->gap) ? (li->v[i] - li->base) : (BSIZE(buffer) - li->v[i + li->gapsz]);
+}
+
+// number of newlines before point
+static int lines_before(buffer_t *buffer, int point) {
+	int lo = 0, hi = LSIZE(buffer);
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (lines_at(buffer, mid) < point) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// moves the gap of the line index so that all newlines before point are in front of it, must be called before the text changes
+static void lines_movegap(buffer_t *buffer, int point) {
+	line_index_t *li = &(buffer->lines);
+	int k = lines_before(buffer, point);
+
+	while (li->gap > k) {
+		--(li->gap);
+		li->v[li->gap + li->gapsz] = BSIZE(buffer) - (li->v[li->gap] - li->base);
+		li->state[li->gap + li->gapsz] = li->state[li->gap];
+	}
+
+	while (li->gap < k) {
+		li->v[li->gap] = BSIZE(buffer) - li->v[li->gap + li->gapsz] + li->base;
+		li->state[li->gap] = li->state[li->gap + li->gapsz];
+		++(li->gap);
+	}
+}
+
+// start of the n-th line (0 based)
+static int buffer_aux_line_nth(buffer_t *buffer, int n) {
+	if (n <= 0) return 0;
+	if (n > LSIZE(buffer)) return BSIZE(buffer);
+	return lines_at(buffer, n-1) + 1;
+}
+
+// start of the line containing point
+static int buffer_aux_line_start(buffer_t *buffer, int point) {
+	return buffer_aux_line_nth(buffer, lines_before(buffer, point));
+}
+
+// start of the line after the one containing point (or the end of the buffer)
+static int buffer_aux_line_next(buffer_t *buffer, int point) {
+	return buffer_aux_line_nth(buffer, lines_before(buffer, point) + 1);
+}
+
 static void buffer_init_font_extents(buffer_t *buffer) {
 	cairo_text_extents_t extents;
 	cairo_font_extents_t font_extents;
 
-	teddy_fontset_t *font = foundry_lookup(config_strval(&(buffer->config), CFG_MAIN_FONT), true);
+	buffer->fontset = foundry_lookup(config_strval(&(buffer->config), CFG_MAIN_FONT));
+	teddy_fontset_t *font = buffer->fontset;
 
 	cairo_scaled_font_text_extents(fontset_get_cairofont(font, 0), "M", &extents);
 	buffer->em_advance = extents.x_advance;
@@ -99,7 +197,7 @@ buffer_t *buffer_create(void) {
 	config_init(&(buffer->config), &global_config);
 
 	pthread_rwlock_init(&(buffer->rwlock), NULL);
-	buffer->release_read_lock = false;
+	buffer->release_read_lock = 0;
 
 	buffer->editable = 1;
 	buffer->job = NULL;
@@ -108,7 +206,8 @@ buffer_t *buffer_create(void) {
 	buffer->mtime = 0;
 	buffer->stale = false;
 	buffer->single_line = false;
-	buffer->lexy_running = 0;
+	buffer->lexy_running = LEXY_IDLE;
+	buffer->lexy_next = NULL;
 	buffer->wd = NULL;
 
 	buffer->invalid = buffer->total = 0;
@@ -119,6 +218,7 @@ buffer_t *buffer_create(void) {
 	buffer->select_type = BST_NORMAL;
 
 	undo_init(&(buffer->undo));
+	buffer->journaled = false;
 
 	buffer_init_font_extents(buffer);
 
@@ -129,6 +229,23 @@ buffer_t *buffer_create(void) {
 	buffer->mark = -1;
 	buffer->gap = 0;
 	buffer->gapsz = SLOP;
+	buffer->head = 0;
+	buffer->revision = 0;
+	buffer->trigrams = NULL;
+	buffer->lines.v = malloc(sizeof(int) * SLOP);
+	alloc_assert(buffer->lines.v);
+	buffer->lines.state = malloc(sizeof(uint16_t) * SLOP);
+	alloc_assert(buffer->lines.state);
+	buffer->lines.size = SLOP;
+	buffer->lines.gap = 0;
+	buffer->lines.gapsz = SLOP;
+	buffer->lines.head = 0;
+	buffer->lines.base = 0;
+
+	memset(&(buffer->layout), 0, sizeof(layout_window_t));
+	memset(&(buffer->scratch), 0, sizeof(layout_window_t));
+	buffer->layout_valid = false;
+	buffer->layout_goal = 0;
 
 	buffer->rendered_height = 0.0;
 	buffer->rendered_width = 0.0;
@@ -161,31 +278,34 @@ buffer_t *buffer_create(void) {
 	return buffer;
 }
 
+/* Acquires the write lock, asking lexy to release its read lock */
+static void buffer_wrlock(buffer_t *buffer) {
+	__atomic_store_n(&(buffer->release_read_lock), 1, __ATOMIC_SEQ_CST);
+	pthread_rwlock_wrlock(&(buffer->rwlock));
+	__atomic_store_n(&(buffer->release_read_lock), 0, __ATOMIC_SEQ_CST);
+}
+
 static int to_closed_buffers_critbit(const char *entry, void *p) {
 	critbit0_insert(&closed_buffers_critbit, entry);
 	return 1;
 }
 
 void buffer_free(buffer_t *buffer, bool save_critbit) {
-	/* We ask the lexy thread to release the lock and wait for this to happen, then we acquire the write lock and destroy the object */
-	buffer->release_read_lock = true;
-	for (int count = 0; buffer->lexy_running == 1; ++count) {
-		if (count > 5) {
-			quick_message("Internal error", "Failed to destroy buffer");
-			return;
-		}
-		struct timespec s;
-		s.tv_sec = 0;
-		s.tv_nsec = 10000000;
-		nanosleep(&s, NULL);
-	}
-	pthread_rwlock_wrlock(&(buffer->rwlock));
+	/* We remove the buffer from the lexy queue and the search index (waiting for them to be released if a worker is using it), then we acquire the write lock and destroy the object */
+	lexy_forget(buffer);
+	searchidx_forget(buffer);
+	buffer_wrlock(buffer);
 
 	if (!mq_dismiss(&buffer->watchers, "q\n")) {
 		quick_message("Internal error", "Event queue for filesystem interface is stuck - expect future breakage");
 	}
 
-	free(buffer->buf);
+	free(buffer->buf - buffer->head);
+	free(buffer->lines.v - buffer->lines.head);
+	free(buffer->lines.state - buffer->lines.head);
+	free(buffer->layout.glyphs);
+	free(buffer->scratch.glyphs);
+	trigram_free(buffer);
 
 	g_hash_table_destroy(buffer->props);
 
@@ -206,7 +326,8 @@ static void buffer_setup_hook(buffer_t *buffer) {
 	buffer_config_changed(buffer);
 }
 
-static void code_to_glyph(teddy_fontset_t *font, uint32_t code, uint8_t *fontidx, FT_UInt *glyph_index) {
+// returns the character actually looked up in the font
+static uint32_t code_to_glyph(teddy_fontset_t *font, bool quotehack, uint32_t code, uint8_t *fontidx, FT_UInt *glyph_index) {
 	uint32_t ccode = code;
 
 	switch (code) {
@@ -223,15 +344,16 @@ static void code_to_glyph(teddy_fontset_t *font, uint32_t code, uint8_t *fontidx
 		break;
 
 	case '\'':
-		if (config_intval(&global_config, CFG_QUOTEHACK) != 0) ccode = 0x2019;
+		if (quotehack) ccode = 0x2019;
 		break;
 	case '`':
-		if (config_intval(&global_config, CFG_QUOTEHACK) != 0) ccode = 0x2018;
+		if (quotehack) ccode = 0x2018;
 		break;
 	}
 
 	*fontidx = fontset_fontidx(font, ccode);
 	*glyph_index = fontset_glyph_index(font, *fontidx, ccode);
+	return ccode;
 }
 
 static void buffer_update_jumplist(int *jumps, int len, int start, int delta) {
@@ -248,12 +370,429 @@ static void buffer_update_jumplist(int *jumps, int len, int start, int delta) {
 	}
 }
 
+static double layout_first_y(buffer_t *buffer) {
+	return buffer->single_line ? buffer->ascent : buffer->line_height;
+}
+
+/* Lays out the line starting at point with its first row at y, glyph positions are written to out (unless it's NULL).
+   Returns the number of rows used by the line, the start of the following line is returned in *next */
+static int layout_line(buffer_t *buffer, teddy_fontset_t *font, int point, double y, my_glyph_layout_t *out, int *next) {
+	const config_snapshot_t *cfg = config_snapshot(&(buffer->config));
+	bool autowrap = cfg->intval[CFG_AUTOWRAP] != 0;
+
+	if ((out == NULL) && !autowrap) {
+		// without autowrap every line is exactly one row high, no need to look at the glyphs
+		*next = buffer_aux_line_next(buffer, point);
+		return 1;
+	}
+
+	int largeindent = cfg->intval[CFG_LARGEINDENT];
+	double tab_size = cfg->intval[CFG_TAB_WIDTH] * buffer->em_advance;
+	bool quotehack = config_snapshot(&global_config)->intval[CFG_QUOTEHACK] != 0;
+
+	double x = buffer->left_margin;
+	int rows = 1;
+
+	uint32_t prev_code = '\n', prev_ccode = 0x20;
+	double prev_advance = 0.0;
+	uint8_t prev_fontidx = 0;
+	FT_UInt prev_glyph_index = 0;
+
+	int i;
+	for (i = point; i < BSIZE(buffer); ++i) {
+		my_glyph_info_t *glyph = bat(buffer, i);
+
+		uint8_t fontidx;
+		FT_UInt glyph_index;
+		uint32_t ccode = code_to_glyph(font, quotehack, glyph->code, &fontidx, &glyph_index);
+
+		double kerning_correction = ((i > point) && (prev_fontidx == fontidx)) ? fontset_get_kerning(font, fontidx, prev_ccode, prev_glyph_index, ccode, glyph_index) : 0.0;
+		double x_advance = fontset_x_advance(font, fontidx, glyph_index);
+
+		if (glyph->code == 0x20) {
+			if (!largeindent) {
+				x_advance = buffer->space_advance;
+			} else if ((prev_code == '\t') || (prev_code == '\n')) {
+				x_advance = buffer->em_advance;
+			} else if (prev_code == ' ') {
+				x_advance = prev_advance;
+			} else {
+				x_advance = buffer->space_advance;
+			}
+		} else if (glyph->code == 0x05) {
+			x_advance = buffer->space_advance / 2;
+		} else if (glyph->code == 0x09) {
+			double to_next_cell = tab_size - fmod(x - buffer->left_margin, tab_size);
+			if (to_next_cell <= buffer->space_advance/2) {
+				// if it is too small jump to next cell instead
+				to_next_cell += tab_size;
+			}
+			x_advance = to_next_cell;
+		} else if (glyph->code == '\n') {
+			x_advance = 0.0;
+		}
+
+		x += kerning_correction;
+
+		if (!autowrap) {
+			if (x + buffer->right_margin > buffer->rendered_width) buffer->rendered_width = x + buffer->right_margin;
+		} else {
+			if (x+x_advance > buffer->rendered_width - buffer->right_margin) {
+				y += buffer->line_height;
+				x = buffer->left_margin;
+				++rows;
+			}
+		}
+
+		if (out != NULL) {
+			my_glyph_layout_t *l = out + (i - point);
+			l->kerning_correction = kerning_correction;
+			l->x_advance = x_advance;
+			l->glyph_index = glyph_index;
+			l->fontidx = fontidx;
+			l->x = x;
+			l->y = y;
+		}
+
+		x += x_advance;
+
+		prev_code = glyph->code;
+		prev_ccode = ccode;
+		prev_advance = x_advance;
+		prev_fontidx = fontidx;
+		prev_glyph_index = glyph_index;
+
+		if (glyph->code == '\n') {
+			++i;
+			break;
+		}
+	}
+
+	*next = i;
+	return rows;
+}
+
+/* Calculates y coordinate of the first row and line number of the line starting at point, walking from the closest known position */
+static void layout_anchor(buffer_t *buffer, teddy_fontset_t *font, int point, double *y, int *lineno) {
+	layout_window_t *w = &(buffer->layout);
+	int p = 0, cl = 0;
+	double cy = layout_first_y(buffer);
+
+	if (config_snapshot(&(buffer->config))->intval[CFG_AUTOWRAP] == 0) {
+		*lineno = lines_before(buffer, point);
+		*y = cy + *lineno * buffer->line_height;
+		return;
+	}
+
+	if (buffer->layout_valid) {
+		if (point >= w->start + w->len) {
+			p = w->start + w->len;
+			cy = w->end_y;
+			cl = w->end_line;
+		} else {
+			p = w->start;
+			cy = w->y;
+			cl = w->line;
+		}
+	}
+
+	while (p < point) {
+		int next;
+		cy += layout_line(buffer, font, p, cy, NULL, &next) * buffer->line_height;
+		++cl;
+		p = next;
+	}
+
+	while (p > point) {
+		int q = buffer_aux_line_start(buffer, p-1);
+		int next;
+		cy -= layout_line(buffer, font, q, 0.0, NULL, &next) * buffer->line_height;
+		--cl;
+		p = q;
+	}
+
+	*y = cy;
+	*lineno = cl;
+}
+
+static void layout_window_set(buffer_t *buffer, int point, double y, int lineno) {
+	layout_window_t *w = &(buffer->layout);
+
+	if (w->cap > 2 * LAYOUT_MAX) {
+		// don't hold on to the memory used by a very long line
+		free(w->glyphs);
+		w->glyphs = NULL;
+		w->cap = 0;
+	}
+
+	w->start = point;
+	w->len = 0;
+	w->y = w->end_y = y;
+	w->line = w->end_line = lineno;
+	w->tail_len = 0;
+
+	buffer->layout_valid = true;
+}
+
+/* If the window reached the tail saved by the last edit attach it back, moving it to its new vertical position */
+static bool layout_window_join_tail(buffer_t *buffer, layout_window_t *w) {
+	if ((w->tail_len <= 0) || (w->len != w->tail)) return false;
+
+	double dy = w->end_y - w->tail_y;
+	if (fabs(dy) > 0.001) {
+		for (int i = w->tail; i < w->tail + w->tail_len; ++i) {
+			w->glyphs[i].y += dy;
+		}
+	}
+
+	w->len += w->tail_len;
+	w->end_y = w->tail_end_y + dy;
+	w->end_line += lines_before(buffer, w->start + w->len) - lines_before(buffer, w->start + w->tail);
+	w->tail_len = 0;
+
+	return true;
+}
+
+static void layout_window_append_line(buffer_t *buffer, teddy_fontset_t *font, layout_window_t *w) {
+	if (layout_window_join_tail(buffer, w)) return;
+
+	int p = w->start + w->len;
+	int next = buffer_aux_line_next(buffer, p);
+
+	if (w->len + (next - p) > w->cap) {
+		w->cap = MAX(w->len + (next - p), 2 * w->cap);
+		w->glyphs = realloc(w->glyphs, sizeof(my_glyph_layout_t) * w->cap);
+		alloc_assert(w->glyphs);
+	}
+
+	int rows = layout_line(buffer, font, p, w->end_y, w->glyphs + w->len, &next);
+
+	w->len += next - p;
+	w->end_y += rows * buffer->line_height;
+	++(w->end_line);
+}
+
+/* Extends the layout window until it contains point and reaches below y */
+static void layout_window_extend(buffer_t *buffer, teddy_fontset_t *font, int point, double y) {
+	layout_window_t *w = &(buffer->layout);
+	while (w->start + w->len < BSIZE(buffer)) {
+		if ((w->start + w->len > point) && (w->end_y - buffer->line_height > y)) break;
+		layout_window_append_line(buffer, font, w);
+	}
+	layout_window_join_tail(buffer, w);
+}
+
+/* Moves the layout window to the first line that has its last row at or below y */
+static void layout_window_seek_y(buffer_t *buffer, teddy_fontset_t *font, double y) {
+	layout_window_t *w = &(buffer->layout);
+	int p = 0, cl = 0;
+	double cy = layout_first_y(buffer);
+
+	if (config_snapshot(&(buffer->config))->intval[CFG_AUTOWRAP] == 0) {
+		int n = floor((y - cy) / buffer->line_height);
+		if (n < 0) n = 0;
+		if (n > LSIZE(buffer)) n = LSIZE(buffer);
+		layout_window_set(buffer, buffer_aux_line_nth(buffer, n), cy + n * buffer->line_height, n);
+		return;
+	}
+
+	if (buffer->layout_valid) {
+		if (y >= w->end_y) {
+			p = w->start + w->len;
+			cy = w->end_y;
+			cl = w->end_line;
+		} else {
+			p = w->start;
+			cy = w->y;
+			cl = w->line;
+		}
+	}
+
+	while (p < BSIZE(buffer)) {
+		int next;
+		int rows = layout_line(buffer, font, p, cy, NULL, &next);
+		if (cy + (rows-1) * buffer->line_height >= y) break;
+		if ((next >= BSIZE(buffer)) && (bat(buffer, next-1)->code != '\n')) break;
+		cy += rows * buffer->line_height;
+		++cl;
+		p = next;
+	}
+
+	while ((p > 0) && (cy - buffer->line_height >= y)) {
+		int q = buffer_aux_line_start(buffer, p-1);
+		int next;
+		cy -= layout_line(buffer, font, q, 0.0, NULL, &next) * buffer->line_height;
+		--cl;
+		p = q;
+	}
+
+	layout_window_set(buffer, p, cy, cl);
+}
+
+static void layout_update_rendered_height(buffer_t *buffer) {
+	if (buffer->layout_valid) {
+		// lines after the layout window are assumed to take a single row
+		buffer->rendered_height = buffer->layout.end_y + (LSIZE(buffer) - buffer->layout.end_line) * buffer->line_height;
+	} else {
+		buffer->rendered_height = layout_first_y(buffer) + LSIZE(buffer) * buffer->line_height;
+	}
+}
+
+/* Updates the layout cache after deleted characters at point were replaced by inserted characters */
+static void layout_edit(buffer_t *buffer, int point, int deleted, int inserted, int nl_delta) {
+	layout_window_t *w = &(buffer->layout);
+
+	buffer->scratch.len = 0;
+	w->tail_len = 0;
+
+	if (!buffer->layout_valid) return;
+
+	int end = w->start + w->len;
+
+	if (point < w->start) {
+		if ((point + deleted < w->start) && (config_snapshot(&(buffer->config))->intval[CFG_AUTOWRAP] == 0)) {
+			// without autowrap an edit above the window just moves it
+			double dy = nl_delta * buffer->line_height;
+			w->start += inserted - deleted;
+			w->line += nl_delta;
+			w->end_line += nl_delta;
+			w->y += dy;
+			w->end_y += dy;
+			for (int i = 0; i < w->len; ++i) {
+				w->glyphs[i].y += dy;
+			}
+			buffer->layout_goal = w->start + w->len;
+		} else {
+			buffer->layout_valid = false;
+		}
+		return;
+	}
+
+	if ((point > end) || ((point == end) && ((w->len == 0) || (bat(buffer, end-1)->code == '\n')))) {
+		// edit after the window
+		buffer->layout_goal = end;
+		return;
+	}
+
+	// edit inside the window, throw away the lines touched by the edit
+	int ls = buffer_aux_line_start(buffer, point);
+	int tail_start = buffer_aux_line_next(buffer, point + inserted);
+	int old_tail_start = tail_start - inserted + deleted;
+
+	if (old_tail_start < end) {
+		// lines after the edit are unchanged except for their y coordinate, move them where they belong and keep them
+		int len = end - old_tail_start;
+		if (tail_start - w->start + len > w->cap) {
+			w->cap = MAX(tail_start - w->start + len, 2 * w->cap);
+			w->glyphs = realloc(w->glyphs, sizeof(my_glyph_layout_t) * w->cap);
+			alloc_assert(w->glyphs);
+		}
+		w->tail_y = w->glyphs[old_tail_start - w->start].y;
+		w->tail_end_y = w->end_y;
+		memmove(w->glyphs + (tail_start - w->start), w->glyphs + (old_tail_start - w->start), sizeof(my_glyph_layout_t) * len);
+		w->tail = tail_start - w->start;
+		w->tail_len = len;
+	}
+
+	w->len = ls - w->start;
+	w->end_y = (w->len > 0) ? (w->glyphs[w->len-1].y + buffer->line_height) : w->y;
+	w->end_line = w->line + lines_before(buffer, ls) - lines_before(buffer, w->start);
+
+	buffer->layout_goal = (w->tail_len > 0) ? tail_start : MAX(end + inserted - deleted, ls);
+}
+
+my_glyph_layout_t *lat(buffer_t *encl, int point) {
+	if ((point < 0) || (point >= BSIZE(encl))) return NULL;
+
+	layout_window_t *w = &(encl->layout);
+	layout_window_t *s = &(encl->scratch);
+
+	if (encl->layout_valid) {
+		if ((point >= w->start) && (point < w->start + w->len)) return w->glyphs + (point - w->start);
+		if ((point >= s->start) && (point < s->start + s->len)) return s->glyphs + (point - s->start);
+	}
+
+	teddy_fontset_t *font = encl->fontset;
+	my_glyph_layout_t *r;
+
+	if (!encl->layout_valid || ((point >= w->start + w->len) && (point - (w->start + w->len) < LAYOUT_SLACK) && (w->len < LAYOUT_MAX))) {
+		if (!encl->layout_valid) {
+			int ls = buffer_aux_line_start(encl, point);
+			double y;
+			int lineno;
+			layout_anchor(encl, font, ls, &y, &lineno);
+			layout_window_set(encl, ls, y, lineno);
+		}
+		layout_window_extend(encl, font, point, -1.0);
+		layout_update_rendered_height(encl);
+		r = w->glyphs + (point - w->start);
+	} else {
+		// far away from the layout window, only lay out the line that contains point
+		s->start = buffer_aux_line_start(encl, point);
+		s->len = 0;
+		layout_anchor(encl, font, s->start, &(s->y), &(s->line));
+		s->end_y = s->y;
+		s->end_line = s->line;
+		layout_window_append_line(encl, font, s);
+		r = s->glyphs + (point - s->start);
+	}
+
+	foundry_release(font);
+	return r;
+}
+
+// index of the first glyph of the layout window whose y coordinate is greater than y (or equal to it if inclusive is set)
+static int layout_window_bsearch_y(layout_window_t *w, double y, bool inclusive) {
+	int lo = 0, hi = w->len;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		double gy = w->glyphs[mid].y;
+		if ((gy < y) || (!inclusive && (gy == y))) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+void buffer_layout_range(buffer_t *buffer, double starty, double endy, int *start, int *end) {
+	layout_window_t *w = &(buffer->layout);
+	teddy_fontset_t *font = buffer->fontset;
+
+	bool keep = buffer->layout_valid
+		&& ((w->start == 0) || (w->y - buffer->line_height < starty))
+		&& (starty <= w->end_y)
+		&& (w->len < LAYOUT_MAX);
+
+	if (!keep) layout_window_seek_y(buffer, font, starty);
+	layout_window_extend(buffer, font, -1, endy);
+
+	foundry_release(font);
+
+	layout_update_rendered_height(buffer);
+
+	// the window can extend well above the viewport, only return the visible glyphs
+	*start = w->start + layout_window_bsearch_y(w, starty, true);
+	*end = w->start + layout_window_bsearch_y(w, endy + buffer->line_height, false);
+}
+
 static int buffer_replace_selection_ex(buffer_t *buffer, const char *text, bool twice) {
-	teddy_fontset_t *font = foundry_lookup(config_strval(&(buffer->config), CFG_MAIN_FONT), true);
+	int deleted = 0, nl_delta = 0, nl_deleted = 0;
+
+	++(buffer->revision);
 
 	// there is a mark, delete
 	if (buffer->mark >= 0) {
 		int region_size = MAX(buffer->mark, buffer->cursor) - MIN(buffer->mark, buffer->cursor);
+		lines_movegap(buffer, MIN(buffer->mark, buffer->cursor));
+		while ((buffer->lines.gap < LSIZE(buffer)) && (lines_at(buffer, buffer->lines.gap) < MIN(buffer->mark, buffer->cursor) + region_size)) {
+			// newline inside the deleted region
+			++(buffer->lines.gapsz);
+			--nl_delta;
+			++nl_deleted;
+		}
+		deleted = region_size;
 		buffer_update_jumplist(buffer->appjumps, APPJUMP_LEN, MIN(buffer->mark, buffer->cursor), -region_size);
 		buffer_update_jumplist(buffer->jumpring, JUMPRING_LEN, MIN(buffer->mark, buffer->cursor), -region_size);
 		movegap(buffer, MIN(buffer->mark, buffer->cursor));
@@ -261,6 +800,7 @@ static int buffer_replace_selection_ex(buffer_t *buffer, const char *text, bool
 		buffer->cursor = MIN(buffer->mark, buffer->cursor);
 		buffer->mark = -1;
 	} else {
+		lines_movegap(buffer, buffer->cursor);
 		movegap(buffer, buffer->cursor);
 	}
 
@@ -276,28 +816,19 @@ static int buffer_replace_selection_ex(buffer_t *buffer, const char *text, bool
 
 		++(buffer->total);
 		if (!valid) ++(buffer->invalid);
-
-		buffer->buf[buffer->gap].code = code;
-
-		uint8_t fontidx;
-		FT_UInt glyph_index;
-		code_to_glyph(font, code, &fontidx, &glyph_index);
+		if (code == '\n') {
+			if (buffer->lines.gapsz <= 0) lines_regap(&(buffer->lines));
+			buffer->lines.v[buffer->lines.gap] = buffer->cursor + buffer->lines.base;
+			buffer->lines.state[buffer->lines.gap] = LEXY_NO_CHECKPOINT;
+			++(buffer->lines.gap);
+			--(buffer->lines.gapsz);
+			++nl_delta;
+		}
 
 		buffer->buf[buffer->gap].code = code;
 		buffer->buf[buffer->gap].color = buffer->default_color;
 		buffer->buf[buffer->gap].status = 0xffff;
 
-		if ((buffer->gap > 0) && (buffer->buf[buffer->gap-1].fontidx == fontidx)) {
-			buffer->buf[buffer->gap].kerning_correction = fontset_get_kerning(font, fontidx, buffer->buf[buffer->gap-1].glyph_index, glyph_index);
-		} else {
-			buffer->buf[buffer->gap].kerning_correction = 0.0;
-		}
-
-		buffer->buf[buffer->gap].glyph_index = glyph_index;
-		buffer->buf[buffer->gap].fontidx = fontidx;
-		buffer->buf[buffer->gap].x = buffer->buf[buffer->gap].y = 0.0;
-		buffer->buf[buffer->gap].x_advance = fontset_x_advance(font, fontidx, glyph_index);
-
 		++(buffer->cursor);
 		++(buffer->gap);
 		--(buffer->gapsz);
@@ -307,15 +838,200 @@ static int buffer_replace_selection_ex(buffer_t *buffer, const char *text, bool
 	buffer_update_jumplist(buffer->appjumps, APPJUMP_LEN, start_cursor, count);
 	buffer_update_jumplist(buffer->jumpring, JUMPRING_LEN, start_cursor, count);
 
-	my_glyph_info_t *last_char = bat(buffer, buffer->cursor);
-	my_glyph_info_t *next_char = bat(buffer, buffer->cursor+1);
-	if ((last_char != NULL) && (next_char != NULL) && (last_char->fontidx == next_char->fontidx)) {
-		next_char->kerning_correction = fontset_get_kerning(font, last_char->fontidx, last_char->glyph_index, next_char->glyph_index);
+	layout_edit(buffer, start_cursor, deleted, count, nl_delta);
+	trigram_edit(buffer, lines_before(buffer, start_cursor), nl_deleted, nl_deleted + nl_delta);
+
+	return start_cursor;
+}
+
+struct load_shard {
+	const char *text; // whole file
+	int start, end; // byte range of text decoded by this shard
+	my_glyph_info_t *dst; // first glyph of the shard, there is room for one glyph per byte
+	uint8_t color;
+
+	int count, invalid;
+	bool nul;
+	int *nl, nnl, nlcap; // positions of newlines, relative to dst
+};
+
+static void *load_shard_thread(void *arg) {
+	struct load_shard *sh = (struct load_shard *)arg;
+
+	for (int i = sh->start; i < sh->end; ) {
+		if (sh->text[i] == '\0') {
+			sh->nul = true;
+			return NULL;
+		}
+
+		bool valid = false;
+		uint32_t code = utf8_to_utf32(sh->text, &i, sh->end, &valid);
+
+		if (!valid) ++(sh->invalid);
+		if (code == '\n') {
+			if (sh->nnl >= sh->nlcap) {
+				sh->nlcap = MAX(sh->nlcap * 2, 1024);
+				sh->nl = realloc(sh->nl, sizeof(int) * sh->nlcap);
+				alloc_assert(sh->nl);
+			}
+			sh->nl[(sh->nnl)++] = sh->count;
+		}
+
+		my_glyph_info_t *g = sh->dst + sh->count;
+		g->code = code;
+		g->color = sh->color;
+		g->status = 0xffff;
+		++(sh->count);
 	}
 
-	foundry_release(font);
+	return NULL;
+}
 
-	return start_cursor;
+static char *load_map(int fd, size_t size) {
+	char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) return NULL;
+	madvise(map, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+	return map;
+}
+
+/* Reads fd until its end, for files whose size isn't known in advance (files in /proc, pipes and other special files).
+   Returns the text (allocated) and its size in *size, or NULL on error or if it's 2GB or more */
+static char *load_read(int fd, int *size) {
+	int cap = 64 * 1024, len = 0;
+	char *text = malloc(cap);
+	alloc_assert(text);
+
+	for (;;) {
+		if (len >= cap) {
+			if (cap >= INT_MAX / 2) {
+				free(text);
+				return NULL;
+			}
+			cap *= 2;
+			text = realloc(text, cap);
+			alloc_assert(text);
+		}
+
+		ssize_t r = read(fd, text + len, cap - len);
+		if (r == 0) break;
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			free(text);
+			return NULL;
+		}
+		len += r;
+	}
+
+	*size = len;
+	return text;
+}
+
+/* Decodes the file in shards, one per thread, straight into a new gap buffer. Shards start on a byte that isn't a continuation byte, there the decoding of the previous character always stops, so the result is the same as decoding the whole file at once */
+static bool load_decode(buffer_t *buffer, const char *text, int size) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nshards = (int)MAX(MIN(ncpu, size / LOAD_SHARD_MIN), 1);
+
+	struct load_shard *shards = malloc(sizeof(struct load_shard) * nshards);
+	alloc_assert(shards);
+	pthread_t *threads = malloc(sizeof(pthread_t) * nshards);
+	alloc_assert(threads);
+	bool *started = malloc(sizeof(bool) * nshards);
+	alloc_assert(started);
+
+	my_glyph_info_t *buf = malloc(sizeof(my_glyph_info_t) * (size + SLOP));
+	alloc_assert(buf);
+
+	int start = 0;
+	for (int s = 0; s < nshards; ++s) {
+		struct load_shard *sh = shards + s;
+		int end = (s == nshards-1) ? size : (int)((long)size * (s+1) / nshards);
+		while ((end < size) && (((uint8_t)text[end] & 0xC0) == 0x80)) ++end;
+		sh->text = text;
+		sh->start = start;
+		sh->end = MAX(end, start);
+		sh->dst = buf + start;
+		sh->color = buffer->default_color;
+		sh->count = sh->invalid = 0;
+		sh->nul = false;
+		sh->nl = NULL;
+		sh->nnl = sh->nlcap = 0;
+		start = sh->end;
+	}
+
+	// the first shard is done by this thread
+	for (int s = 1; s < nshards; ++s) {
+		started[s] = (pthread_create(threads + s, NULL, load_shard_thread, shards + s) == 0);
+		if (!started[s]) load_shard_thread(shards + s);
+	}
+	load_shard_thread(shards);
+
+	int total = 0, invalid = 0, nl = 0;
+	bool nul = false;
+	for (int s = 0; s < nshards; ++s) {
+		if ((s > 0) && started[s]) pthread_join(threads[s], NULL);
+		// shards are moved down to close the space left by multibyte characters
+		if (total != shards[s].start) memmove(buf + total, shards[s].dst, sizeof(my_glyph_info_t) * shards[s].count);
+		shards[s].dst = buf + total;
+		total += shards[s].count;
+		invalid += shards[s].invalid;
+		nl += shards[s].nnl;
+		nul = nul || shards[s].nul;
+	}
+
+	if (!nul) {
+		int alloc = size + SLOP;
+		if (alloc - total > total / 4) {
+			alloc = total + SLOP;
+			buf = realloc(buf, sizeof(my_glyph_info_t) * alloc);
+			alloc_assert(buf);
+		}
+
+		free(buffer->buf - buffer->head);
+		buffer->buf = buf;
+		buffer->size = alloc;
+		buffer->gap = total;
+		buffer->gapsz = alloc - total;
+		buffer->head = 0;
+
+		line_index_t *li = &(buffer->lines);
+		free(li->v - li->head);
+		free(li->state - li->head);
+		li->v = malloc(sizeof(int) * (nl + SLOP));
+		alloc_assert(li->v);
+		li->state = malloc(sizeof(uint16_t) * (nl + SLOP));
+		alloc_assert(li->state);
+		li->size = nl + SLOP;
+		li->gap = nl;
+		li->gapsz = SLOP;
+		li->head = 0;
+
+		int k = 0;
+		for (int s = 0; s < nshards; ++s) {
+			int offset = shards[s].dst - buf;
+			for (int j = 0; j < shards[s].nnl; ++j, ++k) {
+				li->v[k] = offset + shards[s].nl[j] + li->base;
+				li->state[k] = LEXY_NO_CHECKPOINT;
+			}
+		}
+
+		++(buffer->revision);
+		buffer->total += total;
+		buffer->invalid += invalid;
+
+		layout_edit(buffer, 0, 0, total, nl);
+		trigram_edit(buffer, 0, 0, nl);
+	} else {
+		free(buf);
+	}
+
+	for (int s = 0; s < nshards; ++s) {
+		free(shards[s].nl);
+	}
+	free(started);
+	free(threads);
+	free(shards);
+
+	return !nul;
 }
 
 int load_text_file(buffer_t *buffer, const char *filename) {
@@ -325,8 +1041,14 @@ int load_text_file(buffer_t *buffer, const char *filename) {
 		return -1;
 	}
 
-	FILE *fin = fopen(filename, "r");
-	if (!fin) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	struct stat s;
+	if ((fstat(fd, &s) != 0) || (s.st_size >= INT_MAX)) {
+		close(fd);
 		return -1;
 	}
 
@@ -336,40 +1058,41 @@ int load_text_file(buffer_t *buffer, const char *filename) {
 
 	bool forced_invalid = false;
 
-#define BUFSIZE 1024
-	char text[BUFSIZE + 12];
-	while (!feof(fin)) {
-		int n = fread(text, sizeof(char), BUFSIZE, fin);
-		if (n == 0) continue;
-
-		int k = utf8_excision(text, n);
-		int charlen = utf8_first_byte_processing(text[k]);
-
-		if ((charlen > 0) && (charlen < 8)) {
-			for (; n < k+charlen+1; ++n) {
-				text[n] = fgetc(fin);
-			}
+	// only regular files can be trusted to have as many bytes as their size says
+	if (S_ISREG(s.st_mode) && (s.st_size > 0)) {
+		char *map = load_map(fd, s.st_size);
+		if (map == NULL) {
+			close(fd);
+			return -1;
 		}
 
-		text[n] = '\0';
+		forced_invalid = !load_decode(buffer, map, (int)s.st_size);
 
-		for (int i = 0; i < n; ++i) {
-			if (text[i] == '\0') forced_invalid = true;
+		munmap(map, s.st_size);
+	} else {
+		int size;
+		char *text = load_read(fd, &size);
+		if (text == NULL) {
+			close(fd);
+			return -1;
 		}
 
-		buffer_replace_selection_ex(buffer, text, true);
+		if (size > 0) forced_invalid = !load_decode(buffer, text, size);
+
+		free(text);
 	}
 
-	buffer->cursor = 0;
+	close(fd);
 
-	fclose(fin);
+	buffer->cursor = 0;
 
 	if (forced_invalid || (buffer->invalid * 1.0 / buffer->total >= 0.3)) return -2;
 
 	buffer_wordcompl_update(buffer, &(buffer->cbt), WORDCOMPL_UPDATE_RADIUS);
-	lexy_update_starting_at(buffer, 0, false);
+	lexy_update_starting_at(buffer, 0, BSIZE(buffer), false);
 
 	buffer_setup_hook(buffer);
+	journal_load(buffer);
 
 	return 0;
 }
@@ -443,6 +1166,7 @@ void save_to_text_file(buffer_t *buffer) {
 	free(r);
 
 	undo_saved(&(buffer->undo));
+	journal_saved(buffer);
 	buffer->mtime = time(NULL)+10;
 }
 
@@ -451,91 +1175,84 @@ void buffer_change_select_type(buffer_t *buffer, enum select_type select_type) {
 	buffer_extend_selection_by_select_type(buffer);
 }
 
-static void freeze_selection(buffer_t *buffer, selection_t *selection, int start, int end) {
-	selection->start = start;
-	selection->end = end;
-	if (selection->start < 0) selection->start = end;
-	selection->text = buffer_lines_to_text(buffer, start, end);
-	if (selection->text == NULL) {
-		selection->text = strdup("");
-		alloc_assert(selection->text);
+/* Creates the undo node for the replacement of the selection of buffer with new_text. The points at the start and at the end of the selection that new_text leaves as they are aren't stored */
+static undo_node_t *buffer_undo_node(buffer_t *buffer, const char *new_text) {
+	int start = (buffer->mark < 0) ? buffer->cursor : MIN(buffer->mark, buffer->cursor);
+	int end = (buffer->mark < 0) ? buffer->cursor : MAX(buffer->mark, buffer->cursor);
+	int len = strlen(new_text);
+
+	// new_text is decoded the same way buffer_replace_selection_ex will
+	int n = 0, prefix = 0, prefix_bytes = 0;
+	bool all_valid = true;
+	for (int i = 0; i < len; ++n) {
+		bool valid = false;
+		uint32_t code = utf8_to_utf32(new_text, &i, len, &valid);
+		if (!valid) all_valid = false;
+		if ((prefix == n) && (start + n < end) && (bat(buffer, start + n)->code == code)) {
+			prefix = n + 1;
+			prefix_bytes = i;
+		}
 	}
-}
 
-static void buffer_typeset_from(buffer_t *buffer, int point) {
-	int largeindent = config_intval(&(buffer->config), CFG_LARGEINDENT);
-	my_glyph_info_t *glyph = bat(buffer, point);
+	// characters can only be decoded backwards if new_text is valid utf8
+	int suffix = 0, suffix_start = len;
+	while (all_valid && (suffix < n - prefix) && (suffix < end - start - prefix)) {
+		int j = suffix_start - 1;
+		while ((j > prefix_bytes) && (((uint8_t)new_text[j] & 0xc0) == 0x80)) --j;
+		int k = j;
+		bool valid = false;
+		if (utf8_to_utf32(new_text, &k, len, &valid) != bat(buffer, end - suffix - 1)->code) break;
+		++suffix;
+		suffix_start = j;
+	}
 
-	double y, x;
-	if (glyph != NULL) {
-		y = glyph->y;
-		x = glyph->x + glyph->x_advance;
-		if (glyph->code == '\n') {
-			y += buffer->line_height;
-			x = buffer->left_margin;
-		}
-	} else {
-		y = buffer->single_line ? buffer->ascent : buffer->line_height;
-		x = buffer->left_margin;
+	size_t deleted = 0;
+	for (int i = start + prefix; i < end - suffix; ++i) {
+		deleted += utf32_to_utf8_buf(bat(buffer, i)->code, NULL);
 	}
 
+	undo_node_t *node = undo_node_new(&(buffer->undo), deleted, suffix_start - prefix_bytes);
+	node->start = start;
+	node->before_end = end;
+	node->prefix = prefix;
+	node->suffix = suffix;
 
-	for (int i = point+1; i < BSIZE(buffer); ++i) {
-		glyph = bat(buffer, i);
-		if (glyph->code == 0x20) {
-			if (!largeindent) {
-				glyph->x_advance = buffer->space_advance;
-			} else if (i == 0) {
-				glyph->x_advance = buffer->em_advance;
-			} else {
-				my_glyph_info_t *prev = bat(buffer, i - 1);
-				if (prev == NULL) {
-					glyph->x_advance = buffer->space_advance;
-				} else if (prev->code == '\t') {
-					glyph->x_advance = buffer->em_advance;
-				} else if (prev->code == '\n') {
-					glyph->x_advance = buffer->em_advance;
-				} else if (prev->code == ' ') {
-					glyph->x_advance = prev->x_advance;
-				} else {
-					glyph->x_advance = buffer->space_advance;
-				}
-			}
-		} else if (glyph->code == 0x05) {
-			glyph->x_advance = buffer->space_advance / 2;
-		} else if (glyph->code == 0x09) {
-			double size = config_intval(&(buffer->config), CFG_TAB_WIDTH) * buffer->em_advance;
-			double to_next_cell = size - fmod(x - buffer->left_margin, size);
-			if (to_next_cell <= buffer->space_advance/2) {
-				// if it is too small jump to next cell instead
-				to_next_cell += size;
-			}
-			glyph->x_advance = to_next_cell;
-		} else if (glyph->code == '\n') {
-			glyph->x_advance = 0.0;
-		}
+	char *d = undo_node_deleted(node);
+	for (int i = start + prefix; i < end - suffix; ++i) {
+		d += utf32_to_utf8_buf(bat(buffer, i)->code, d);
+	}
+	memcpy(undo_node_inserted(node), new_text + prefix_bytes, suffix_start - prefix_bytes);
 
-		x += glyph->kerning_correction;
+	return node;
+}
 
-		if (!config_intval(&(buffer->config), CFG_AUTOWRAP)) {
-			if (x + buffer->right_margin > buffer->rendered_width) buffer->rendered_width = x + buffer->right_margin;
-		} else {
-			if (x+glyph->x_advance > buffer->rendered_width - buffer->right_margin) {
-				y += buffer->line_height;
-				x = buffer->left_margin;
-			}
-		}
-		glyph->x = x;
-		glyph->y = y;
-		x += glyph->x_advance;
+char *buffer_undo_text(buffer_t *buffer, undo_node_t *node, bool before) {
+	if (!before) return buffer_lines_to_text(buffer, node->start, node->after_end);
 
-		if (glyph->code == '\n') {
-			y += buffer->line_height;
-			x = buffer->left_margin;
-		}
+	char *head = buffer_lines_to_text(buffer, node->start, node->start + node->prefix);
+	char *tail = buffer_lines_to_text(buffer, node->after_end - node->suffix, node->after_end);
+	char *r;
+	asprintf(&r, "%s%s%s", head, undo_node_deleted(node), tail);
+	alloc_assert(r);
+	free(head);
+	free(tail);
+	return r;
+}
+
+/* Lays out again the part of the layout window that was changed by an edit, if point is negative everything changed */
+static void buffer_typeset_from(buffer_t *buffer, int point) {
+	if (point < 0) {
+		buffer->layout_valid = false;
+		buffer->scratch.len = 0;
+	}
 
-		buffer->rendered_height = y;
+	if (buffer->layout_valid) {
+		teddy_fontset_t *font = buffer->fontset;
+		layout_window_extend(buffer, font, buffer->layout_goal-1, -1.0);
+		foundry_release(font);
 	}
+
+	layout_update_rendered_height(buffer);
 }
 
 void buffer_undo(buffer_t *buffer, bool redo) {
@@ -544,37 +1261,30 @@ void buffer_undo(buffer_t *buffer, bool redo) {
 
 	undo_node_t *undo_node = redo ? undo_redo_pop(&(buffer->undo)) : undo_pop(&(buffer->undo));
 	if (undo_node == NULL) return;
+	journal_move(buffer, redo);
 
 	char *msg;
 	asprintf(&msg, "u\n");
 	mq_broadcast(&buffer->watchers, msg);
 	free(msg);
 
-	buffer->release_read_lock = true;
-	pthread_rwlock_wrlock(&(buffer->rwlock));
-	buffer->release_read_lock = false;
+	buffer_wrlock(buffer);
 
 	buffer->mark = buffer->savedmark = -1;
 
-	int start, end;
-
-	if (redo) {
-		start = undo_node->before_selection.start;
-		end = undo_node->before_selection.end;
-	} else {
-		start = undo_node->after_selection.start;
-		end = undo_node->after_selection.end;
-	}
+	int start = undo_node->start + undo_node->prefix;
+	int end = (redo ? undo_node->before_end : undo_node->after_end) - undo_node->suffix;
 
 	buffer->mark = start;
 	buffer->cursor = end;
-	int selbefore = MAX(start, end) - MIN(start, end);
-	const char *new_text = redo ? undo_node->after_selection.text : undo_node->before_selection.text;
+	int selbefore = end - start;
+	const char *new_text = redo ? undo_node_inserted(undo_node) : undo_node_deleted(undo_node);
 	int start_cursor = buffer_replace_selection_ex(buffer, new_text, false);
+	buffer->cursor = redo ? undo_node->after_end : undo_node->before_end;
 
 	buffer_typeset_from(buffer, start_cursor-1);
 	buffer->savedmark = buffer->mark = -1;
-	lexy_update_starting_at(buffer, start_cursor-1, (strlen(new_text) < 5) && (selbefore < 5));
+	lexy_update_starting_at(buffer, start_cursor-1, buffer->cursor, (strlen(new_text) < 5) && (selbefore < 5));
 
 	pthread_rwlock_unlock(&(buffer->rwlock));
 
@@ -589,16 +1299,12 @@ void buffer_replace_selection(buffer_t *buffer, const char *new_text) {
 	mq_broadcast(&buffer->watchers, msg);
 	free(msg);
 
-	buffer->release_read_lock = true;
-	pthread_rwlock_wrlock(&(buffer->rwlock));
-	buffer->release_read_lock = false;
+	buffer_wrlock(buffer);
 
 	undo_node_t *undo_node = NULL;
 
 	if (buffer->job == NULL) {
-		undo_node = malloc(sizeof(undo_node_t));
-		undo_node->tag = NULL;
-		freeze_selection(buffer, &(undo_node->before_selection), MIN(buffer->mark, buffer->cursor), MAX(buffer->mark, buffer->cursor));
+		undo_node = buffer_undo_node(buffer, new_text);
 	}
 
 	bool twice = false;
@@ -612,14 +1318,17 @@ void buffer_replace_selection(buffer_t *buffer, const char *new_text) {
 	int start_cursor = buffer_replace_selection_ex(buffer, new_text, twice);
 
 	if (buffer->job == NULL) {
-		freeze_selection(buffer, &(undo_node->after_selection), start_cursor, buffer->cursor);
-		undo_push(&(buffer->undo), undo_node);
+		undo_node->after_end = buffer->cursor;
+		buffer->undo.budget = (size_t)config_intval(&(buffer->config), CFG_UNDO_MEMORY) * 1024 * 1024;
+		bool fuse = undo_fusable(&(buffer->undo), undo_node);
+		journal_push(buffer, undo_node, fuse);
+		undo_push(&(buffer->undo), undo_node, fuse);
 	}
 
 	buffer_typeset_from(buffer, start_cursor-1);
 	buffer->savedmark = buffer->mark = -1;
 
-	lexy_update_starting_at(buffer, start_cursor-1, (strlen(new_text) < 5) && (selbefore < 5));
+	lexy_update_starting_at(buffer, start_cursor-1, buffer->cursor, (strlen(new_text) < 5) && (selbefore < 5));
 
 	if (buffer->onchange != NULL) buffer->onchange(buffer);
 
@@ -737,14 +1446,14 @@ char *buffer_lines_to_text(buffer_t *buffer, int start, int end) {
 }
 
 void line_get_glyph_coordinates(buffer_t *buffer, int point, double *x, double *y) {
-	my_glyph_info_t *glyph = bat(buffer, point);
+	my_glyph_layout_t *glyph = lat(buffer, point);
 	if (glyph == NULL) {
-		glyph = bat(buffer, point-1);
+		glyph = lat(buffer, point-1);
 		if (glyph == NULL) { // either the point is corrupted or there is nothing in this buffer
 			*y = buffer->single_line ? buffer->ascent : (buffer->line_height + (buffer->ex_height/2.0));
 			*x = buffer->left_margin;
 		} else { // after the last character of the buffer
-			if (glyph->code == '\n') {
+			if (bat(buffer, point-1)->code == '\n') {
 				*y = glyph->y + buffer->line_height;
 				*x = buffer->left_margin;
 			} else {
@@ -877,12 +1586,12 @@ bool buffer_move_point_line(buffer_t *buffer, int *p, enum movement_type_t type,
 		break;
 
 	case MT_ABS:
-		*p = 0;
-		for (; r && (arg > 1); --arg) {
-			r = buffer_aux_findchar(buffer, p, '\n', +1);
-			++(*p);
+		if (arg-1 > LSIZE(buffer)) {
+			*p = BSIZE(buffer);
+			r = false;
+		} else {
+			*p = buffer_aux_line_nth(buffer, arg-1);
 		}
-		if (!r) *p = BSIZE(buffer);
 		break;
 
 	default:
@@ -958,11 +1667,7 @@ void sort_mark_cursor(buffer_t *buffer) {
 
 static bool buffer_aux_go_first_nonws(buffer_t *buffer, int *p, bool alternate) {
 	int startp = *p;
-	--(*p);
-	if (!buffer_aux_findchar(buffer, p, '\n', -1)) {
-		*p = -1;
-	}
-	++(*p);
+	*p = buffer_aux_line_start(buffer, *p);
 	int beginning = *p;
 	while (*p < BSIZE(buffer) && u_isspace(bat(buffer, *p)->code) && (bat(buffer, *p)->code != '\n')) { ++(*p); }
 
@@ -1016,9 +1721,7 @@ bool buffer_move_point_glyph(buffer_t *buffer, int *p, enum movement_type_t type
 
 	case MT_ABS:
 		if (arg >= 1) {
-			--(*p);
-			if (!buffer_aux_findchar(buffer, p, '\n', -1)) *p = -1;
-			*p += arg;
+			*p = buffer_aux_line_start(buffer, *p) - 1 + arg;
 		}
 		break;
 
@@ -1049,7 +1752,7 @@ int buffer_point_from_position(buffer_t *buffer, int start, double x, double y)
 	if (start < 0) start = 0;
 
 	for (int i = start; i < BSIZE(buffer); ++i) {
-		my_glyph_info_t *g = bat(buffer, i);
+		my_glyph_layout_t *g = lat(buffer, i);
 
 		if (g->y < y) continue;
 		if (g->y - buffer->line_height > y) {
@@ -1065,7 +1768,7 @@ int buffer_point_from_position(buffer_t *buffer, int start, double x, double y)
 			break;
 		}
 
-		if (g->code == '\n') {
+		if (bat(buffer, i)->code == '\n') {
 			p = i;
 			break;
 		}
@@ -1182,39 +1885,75 @@ void buffer_aux_clear(buffer_t *buffer) {
 	buffer_replace_selection(buffer, "");
 }
 
-static void buffer_reload_glyph_info(buffer_t *buffer) {
-	teddy_fontset_t *font = foundry_lookup(config_strval(&(buffer->config), CFG_MAIN_FONT), true);
-	FT_UInt previous = 0;
-	uint8_t previous_fontidx = 0;
-	for (int i = 0; i < BSIZE(buffer); ++i) {
-		my_glyph_info_t *g = bat(buffer, i);
+void buffer_trim_head(buffer_t *buffer, int n) {
+	n = MIN(n, BSIZE(buffer));
+	if (n <= 0) return;
 
-		uint8_t fontidx;
-		code_to_glyph(font, g->code, &fontidx, (FT_UInt *)&(g->glyph_index));
-		g->kerning_correction = (previous_fontidx == fontidx) ? fontset_get_kerning(font, fontidx, previous, g->glyph_index) : 0.0;
+	// watchers see the same change event as when the text was removed with buffer_replace_selection
+	mq_broadcast(&buffer->watchers, "c 0 0\n");
+
+	buffer_wrlock(buffer);
+
+	line_index_t *li = &(buffer->lines);
+	int k = lines_before(buffer, n);
+
+	// the first k newlines and the first n characters must be in front of their gaps, then they are dropped by moving the start of the arrays forward
+	if (li->gap < k) lines_movegap(buffer, n);
+	if (buffer->gap < n) movegap(buffer, n);
 
-		previous = g->glyph_index;
-		previous_fontidx = g->fontidx = fontidx;
+	++(buffer->revision);
+	buffer->buf += n;
+	buffer->head += n;
+	buffer->gap -= n;
+	buffer->size -= n;
 
-		g->x = 0.0;
-		g->y = 0.0;
+	li->v += k;
+	li->state += k;
+	li->head += k;
+	li->gap -= k;
+	li->size -= k;
+	li->base += n;
 
-		g->x_advance = fontset_x_advance(font, fontidx, g->glyph_index);
-		g->color = CFG_LEXY_NOTHING - CFG_LEXY_NOTHING;
+	if (li->base > INT_MAX/2) {
+		for (int i = 0; i < li->gap; ++i) li->v[i] -= li->base;
+		li->base = 0;
+	}
+
+	buffer_update_jumplist(buffer->appjumps, APPJUMP_LEN, 0, -n);
+	buffer_update_jumplist(buffer->jumpring, JUMPRING_LEN, 0, -n);
+	buffer->cursor = MAX(buffer->cursor - n, 0);
+	if (buffer->mark >= 0) buffer->mark = MAX(buffer->mark - n, 0);
+	if (buffer->savedmark >= 0) buffer->savedmark = MAX(buffer->savedmark - n, 0);
+
+	// the undo history refers to the removed text
+	if (undo_peek(&(buffer->undo)) != NULL) {
+		undo_free(&(buffer->undo));
+		undo_init(&(buffer->undo));
+	}
+
+	layout_edit(buffer, 0, n, 0, -k);
+	trigram_edit(buffer, 0, k, 0);
+	buffer_typeset_from(buffer, 0);
+
+	lexy_update_starting_at(buffer, 0, 0, false);
+
+	pthread_rwlock_unlock(&(buffer->rwlock));
+}
+
+static void buffer_reload_glyph_info(buffer_t *buffer) {
+	for (int i = 0; i < BSIZE(buffer); ++i) {
+		bat(buffer, i)->color = CFG_LEXY_NOTHING - CFG_LEXY_NOTHING;
 	}
-	foundry_release(font);
 }
 
 void buffer_config_changed(buffer_t *buffer) {
-	buffer->release_read_lock = true;
-	pthread_rwlock_wrlock(&(buffer->rwlock));
-	buffer->release_read_lock = false;
+	buffer_wrlock(buffer);
 
 	buffer_init_font_extents(buffer);
 	buffer_reload_glyph_info(buffer);
 	buffer_typeset_maybe(buffer, 0.0, true);
 
-	lexy_update_starting_at(buffer, -1, false);
+	lexy_update_starting_at(buffer, -1, -1, false);
 
 	pthread_rwlock_unlock(&(buffer->rwlock));
 }
@@ -1248,17 +1987,26 @@ void buffer_set_onchange(buffer_t *buffer, void (*fn)(buffer_t *buffer)) {
 	buffer->onchange = fn;
 }
 
-int buffer_line_of(buffer_t *buffer, int p, bool fastbail) {
-	int line = 1;
-	for (int c = 0; c < p; ++c) {
-		my_glyph_info_t *g = bat(buffer, c);
-		if (g == NULL) return line;
-		if (g->code == '\n') ++line;
-		if (fastbail && (line > 2000)) {
-			return -1;
-		}
-	}
-	return line;
+int buffer_line_of(buffer_t *buffer, int p) {
+	return lines_before(buffer, p) + 1;
+}
+
+int buffer_newline_position(buffer_t *buffer, int n) {
+	return lines_at(buffer, n);
+}
+
+int buffer_newlines_before(buffer_t *buffer, int point) {
+	return lines_before(buffer, point);
+}
+
+uint16_t *buffer_line_checkpoint(buffer_t *buffer, int n) {
+	line_index_t *li = &(buffer->lines);
+	return li->state + ((n < li->gap) ? n : (n + li->gapsz));
+}
+
+int buffer_line_start(buffer_t *buffer, int line) {
+	if ((line < 1) || (line-1 > LSIZE(buffer))) return -1;
+	return buffer_aux_line_nth(buffer, line-1);
 }
 
 int buffer_column_of(buffer_t *buffer, int p) {
@@ -13,11 +13,15 @@
 
 #define JUMPRING_LEN 16
 
+/* Text of the buffer, one of these per character, kept small since it is stored for every character of the buffer */
 typedef struct _my_glyph_info_t {
 	uint32_t code;
 	uint8_t color;
 	uint16_t status;
+} my_glyph_info_t;
 
+/* Shaping and position of a character, only calculated for the characters inside the layout window (see lat) */
+typedef struct _my_glyph_layout_t {
 	double kerning_correction;
 	double x_advance;
 
@@ -25,12 +29,34 @@ typedef struct _my_glyph_info_t {
 	uint8_t fontidx;
 	double x;
 	double y;
-} my_glyph_info_t;
+} my_glyph_layout_t;
+
+/* Positions of the newline characters in the buffer, organized like the text: entries before the gap are absolute positions (plus base), entries after the gap are distances from the end of the buffer, so that editing at the gap doesn't change any of them.
+   For every newline state holds the lexy status at the beginning of the following line (or LEXY_NO_CHECKPOINT).
+   head entries in front of v and state were dropped by buffer_trim_head, base is the number of characters it removed */
+typedef struct _line_index_t {
+	int *v; uint16_t *state; int size; int gap; int gapsz;
+	int head; int base;
+} line_index_t;
+
+#define LEXY_NO_CHECKPOINT 0xffff
+
+typedef struct _layout_window_t {
+	my_glyph_layout_t *glyphs;
+	int cap;
+	int start, len; // covers points [start, start+len), start is always the beginning of a line and start+len the beginning of a line or the end of the buffer
+	double y, end_y; // y coordinate of the first row of the line at start and of the line at start+len
+	int line, end_line; // line number (0 based) of the line at start and of the line at start+len
+	int tail, tail_len; // glyphs [tail, tail+tail_len) were laid out before the last edit, they are rejoined to the window (shifted vertically) when it reaches them
+	double tail_y, tail_end_y; // old y coordinate of the first row of the tail and of the line after it
+} layout_window_t;
 
 enum appjumps { APPJUMP_INPUT = 0, APPJUMP_LEN };
 
 enum select_type { BST_NORMAL = 0, BST_WORDS, BST_LINES };
 
+enum lexy_running { LEXY_IDLE = 0, LEXY_QUEUED, LEXY_RUNNING, LEXY_SUSPENDED };
+
 typedef struct _buffer_t {
 	char *path;
 	char *wd;
@@ -44,17 +70,21 @@ typedef struct _buffer_t {
 	int invalid, total; // count of characters
 
 	pthread_rwlock_t rwlock;
-	volatile bool release_read_lock;
+	int release_read_lock; // only accessed atomically, set while the write lock is being acquired
 
-	volatile int lexy_running;
-	volatile int lexy_start;
-	volatile int lexy_quick_exit;
+	/* Syntax highlighting requests, protected by the mutex of the lexy queue (see lexy.c) */
+	enum lexy_running lexy_running;
+	int lexy_start;
+	int lexy_dirty_tail; // distance from the end of the buffer of the end of the text changed since it was last highlighted
+	int lexy_quick_exit;
+	struct _buffer_t *lexy_next;
 
 	job_t *job;
 
 	config_t config;
 
-	/* Font secondary metrics of main font */
+	/* Main font (looked up again by buffer_config_changed) and its secondary metrics */
+	struct _teddy_fontset_t *fontset;
 	double em_advance;
 	double space_advance;
 	double ex_height;
@@ -62,8 +92,17 @@ typedef struct _buffer_t {
 	double ascent, descent;
 	double underline_position, underline_thickness;
 
-	/* Buffer's text and glyphs */
+	/* Buffer's text */
 	my_glyph_info_t *buf; size_t size; int cursor; int mark; int gap; size_t gapsz;
+	int head; // glyphs in front of buf dropped by buffer_trim_head, their memory is reclaimed by the next regap
+	unsigned long revision; // incremented every time the text changes
+	line_index_t lines;
+	struct trigram_index *trigrams; // created the first time iopen searches the buffer, only used by iopen's buffer thread (see trigram.h)
+
+	/* Layout cache: the layout window covers the visible part of the buffer, scratch holds a single line outside of it */
+	layout_window_t layout, scratch;
+	bool layout_valid;
+	int layout_goal;
 
 	/* Buffer's secondary properties (calculated) */
 	double rendered_height;
@@ -75,6 +114,7 @@ typedef struct _buffer_t {
 
 	/* Undo information */
 	undo_t undo;
+	bool journaled; // changes to undo are written to the undo journal (see journal.h)
 
 	/* User options */
 	double left_margin;
@@ -129,6 +169,10 @@ bool buffer_modified(buffer_t *buffer);
 void save_to_text_file(buffer_t *buffer);
 
 my_glyph_info_t *bat(buffer_t *encl, int point);
+/* layout of the glyph at point, the returned pointer is only valid until the next call to lat or to a function that changes the buffer */
+my_glyph_layout_t *lat(buffer_t *encl, int point);
+/* lays out the part of the buffer between starty and endy, returns the range of points visible between them */
+void buffer_layout_range(buffer_t *buffer, double starty, double endy, int *start, int *end);
 
 void buffer_change_select_type(buffer_t *buffer, enum select_type select_type);
 void buffer_extend_selection_by_select_type(buffer_t *buffer);
@@ -138,6 +182,8 @@ void buffer_replace_selection(buffer_t *buffer, const char *new_text);
 
 // undo
 void buffer_undo(buffer_t *buffer, bool redo);
+// text of the region changed by node, before or after the change, node must be the last change applied to buffer
+char *buffer_undo_text(buffer_t *buffer, undo_node_t *node, bool before);
 
 // returns current selection
 void buffer_get_selection(buffer_t *buffer, int *start, int *end);
@@ -175,6 +221,9 @@ char *buffer_historycompl_word_at_cursor(buffer_t *buffer);
 
 // removes all text from a buffer
 void buffer_aux_clear(buffer_t *buffer);
+/* removes the first n characters of the buffer in constant time (plus the size of the layout window), used to bound the output of jobs.
+   Positions in the buffer move back by n, the undo history is discarded */
+void buffer_trim_head(buffer_t *buffer, int n);
 
 void buffer_get_extremes(buffer_t *buffer, int *start, int *end);
 char *buffer_all_lines_to_text(buffer_t *buffer);
@@ -185,8 +234,15 @@ char *buffer_get_selection_text(buffer_t *buffer);
 int parmatch_find(buffer_t *buffer, int cursor, int nlines, bool forward_only);
 my_glyph_info_t *buffer_next_glyph(buffer_t *buffer, my_glyph_info_t *glyph);
 
-int buffer_line_of(buffer_t *buffer, int p, bool fastbail);
+int buffer_line_of(buffer_t *buffer, int p);
 int buffer_column_of(buffer_t *buffer, int p);
+// returns the position of the first character of line (lines start at 1), or -1 if the buffer doesn't have that many lines
+int buffer_line_start(buffer_t *buffer, int line);
+// position of the n-th newline (0 based) and number of newlines before point
+int buffer_newline_position(buffer_t *buffer, int n);
+int buffer_newlines_before(buffer_t *buffer, int point);
+// lexy status at the beginning of the line following the n-th newline
+uint16_t *buffer_line_checkpoint(buffer_t *buffer, int n);
 
 /* Jump ring management functions */
 void buffer_record_jump(buffer_t *buffer);
@@ -194,6 +250,7 @@ void buffer_jump_to(buffer_t *buffer, int dir);
 double round_to_line(buffer_t *buffer, double v);
 
 #define BSIZE(x) ((x)->size - (x)->gapsz)
+#define LSIZE(x) ((x)->lines.size - (x)->lines.gapsz)
 
 #define WORDCOMPL_UPDATE_RADIUS 50000
 
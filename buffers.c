@@ -10,6 +10,7 @@
 #include "ipc.h"
 
 #include "critbit.h"
+#include "fileidx.h"
 
 #include <gdk/gdkkeysyms.h>
 #include <glib-object.h>
@@ -30,7 +31,7 @@ int tags_wd = -1;
 
 int process_buffers_counter = 0;
 
-#define MAXIMUM_FILE_SIZE (32 * 1024 * 1024)
+#define MAXIMUM_FILE_SIZE (1024 * 1024 * 1024)
 
 buffer_t *null_buffer(void) {
 	return buffers[0];
@@ -59,7 +60,7 @@ void buffer_to_buffer_id(buffer_t *buffer, char *bufferid) {
 	}
 }
 
-static buffer_t *buffers_make(const char *name) {
+buffer_t *buffers_make(const char *name) {
 	buffer_t *buffer = buffers_find_buffer_with_name(name);
 	if (buffer == NULL) {
 		buffer = buffers_create_with_name(strdup(name));
@@ -117,7 +118,7 @@ static void buffer_close_real(buffer_t *buffer, bool save_critbit) {
 			if (buffers[i] == NULL) continue;
 			if (buffers[i]->inotify_wd == buffer->inotify_wd) ++count;
 		}
-		if (count == 0)
+		if ((count == 0) && !fileidx_watch_in_use(buffer->inotify_wd))
 			inotify_rm_watch(inotify_fd, buffer->inotify_wd);
 	}
 
@@ -294,6 +295,7 @@ static gboolean inotify_input_watch_function(GIOChannel *source, GIOCondition co
 			tags_load(top_working_directory());
 		}
 
+		fileidx_inotify_event(event);
 		maybe_stale_buffer(event->wd);
 
 		i += INOTIFY_EVENT_SIZE + event->len;
@@ -360,7 +362,7 @@ void buffers_add(buffer_t *b) {
 	}
 
 	if ((b->path[0] != '+') && (inotify_fd >= 0)) {
-		b->inotify_wd = inotify_add_watch(inotify_fd, b->path, IN_CLOSE_WRITE);
+		b->inotify_wd = inotify_add_watch(inotify_fd, b->path, IN_CLOSE_WRITE | IN_MASK_ADD);
 	}
 
 	word_completer_full_update();
@@ -498,8 +500,10 @@ int teddy_buffer_command(ClientData client_data, Tcl_Interp *interp, int argc, c
 		Tcl_SetResult(interp, bufferid, TCL_VOLATILE);
 	} else if (strcmp(argv[1], "dbg") == 0) {
 		SINGLE_ARGUMENT_BUFFER_SUBCOMMAND("buffer dbg");
+		long requests, coalesced;
+		lexy_stats(&requests, &coalesced);
 		char *msg;
-		asprintf(&msg, "lexy_running = %d, lexy_start = %d", buffer->lexy_running, buffer->lexy_start);
+		asprintf(&msg, "lexy_running = %d, lexy_start = %d\nlexy requests = %ld, coalesced = %ld", buffer->lexy_running, buffer->lexy_start, requests, coalesced);
 		alloc_assert(msg);
 		quick_message("DBG", msg);
 		free(msg);
@@ -515,7 +519,7 @@ int teddy_buffer_command(ClientData client_data, Tcl_Interp *interp, int argc, c
 		ARGNUM((argc != 2), "buffer lexy");
 		for (int i = 0; i < buffers_allocated; ++i) {
 			if (buffers[i] == NULL) continue;
-			lexy_update_starting_at(buffers[i], -1, false);
+			lexy_update_starting_at(buffers[i], -1, -1, false);
 		}
 	} else if (strcmp(argv[1], "save") == 0) {
 		SINGLE_ARGUMENT_BUFFER_SUBCOMMAND("buffer save");
@@ -768,6 +772,46 @@ int teddy_buffer_command(ClientData client_data, Tcl_Interp *interp, int argc, c
 			Tcl_AddErrorInfo(interp, "Unknown appjump");
 			return TCL_ERROR;
 		}
+	} else if (strcmp(argv[1], "linecount") == 0) {
+		HASBUF("buffer linecount");
+		ARGNUM((argc != 2), "buffer linecount");
+
+		char *r;
+		asprintf(&r, "%d", LSIZE(interp_context_buffer()) + 1);
+		Tcl_SetResult(interp, r, TCL_VOLATILE);
+		free(r);
+		return TCL_OK;
+	} else if (strcmp(argv[1], "lineof") == 0) {
+		HASBUF("buffer lineof");
+		ARGNUM((argc != 3), "buffer lineof");
+
+		buffer_t *buffer = interp_context_buffer();
+		int p = atoi(argv[2]);
+		if ((p < 0) || (p > BSIZE(buffer))) {
+			Tcl_AddErrorInfo(interp, "Position out of range");
+			return TCL_ERROR;
+		}
+
+		char *r;
+		asprintf(&r, "%d", buffer_line_of(buffer, p));
+		Tcl_SetResult(interp, r, TCL_VOLATILE);
+		free(r);
+		return TCL_OK;
+	} else if (strcmp(argv[1], "linestart") == 0) {
+		HASBUF("buffer linestart");
+		ARGNUM((argc != 3), "buffer linestart");
+
+		int p = buffer_line_start(interp_context_buffer(), atoi(argv[2]));
+		if (p < 0) {
+			Tcl_AddErrorInfo(interp, "Line out of range");
+			return TCL_ERROR;
+		}
+
+		char *r;
+		asprintf(&r, "=%d", p);
+		Tcl_SetResult(interp, r, TCL_VOLATILE);
+		free(r);
+		return TCL_OK;
 	} else if (strcmp(argv[1], "jumpring") == 0) {
 		HASBUF("buffer appjumps");
 		ARGNUM((argc != 3), "buffer appjumps");
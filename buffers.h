@@ -21,6 +21,8 @@ buffer_t *buffers_find_buffer_from_path(const char *path);
 
 buffer_t *buffers_get_buffer_for_process(bool create);
 buffer_t *buffers_create_with_name(char *name);
+// returns the buffer called name, creating it (and showing it) if it doesn't exist
+buffer_t *buffers_make(const char *name);
 
 int teddy_buffer_command(ClientData client_data, Tcl_Interp *interp, int argc, const char *argv[]);
 
@@ -33,6 +35,7 @@ void buffers_register_tags(const char *tags_file);
 
 extern buffer_t **buffers;
 extern int buffers_allocated;
+extern int inotify_fd;
 
 enum go_file_failure_reason {
 	GFFR_OTHER = 0,
@@ -522,7 +522,11 @@ namespace eval teddy_intl {\n\
 \n\
 		set b [buffer open [lindex $r 1]]\n\
 \n\
-		if {[lindex $r 2] ne \"\"} {\n\
+		if {[string index [lindex $r 2] 0] eq \":\"} {\n\
+			buffer eval $b {\n\
+				m nil [string range [lindex $r 2] 1 end]\n\
+			}\n\
+		} elseif {[lindex $r 2] ne \"\"} {\n\
 			buffer eval $b {\n\
 				m nil 1:1\n\
 				m {*}[s -literal [lindex $r 2]]\n\
@@ -755,6 +759,7 @@ lexy::def filesearch 0 {\n\
 	}\n\
 \n\
 lexy::assoc filesearch/0 {^\\+bg}\n\
+lexy::assoc filesearch/0 {^\\+grep}\n\
 lexy::assoc filesearch/0 {/$}\n\
 lexy::assoc filesearch/0 {^\\+guide}\n\
 lexy::assoc filesearch/0 {/guide$}\n\
@@ -768,6 +773,7 @@ lexy::assoc mansearch/0 {^\\+man}\n\
 \n\
 lexy::def tagsearch 0 {\n\
 		matchspace {(\\S+)\\t/(.+)/} link,1,2\n\
+		matchspace {(\\S+)\\t(:[0-9]+)} link,1,2\n\
 		any \".\" nothing\n\
 	}\n\
 \n\
@@ -519,7 +519,11 @@ namespace eval teddy_intl {
 
 		set b [buffer open [lindex $r 1]]
 
-		if {[lindex $r 2] ne ""} {
+		if {[string index [lindex $r 2] 0] eq ":"} {
+			buffer eval $b {
+				m nil [string range [lindex $r 2] 1 end]
+			}
+		} elseif {[lindex $r 2] ne ""} {
 			buffer eval $b {
 				m nil 1:1
 				m {*}[s -literal [lindex $r 2]]
@@ -752,6 +756,7 @@ lexy::def filesearch 0 {
 	}
 
 lexy::assoc filesearch/0 {^\+bg}
+lexy::assoc filesearch/0 {^\+grep}
 lexy::assoc filesearch/0 {/$}
 lexy::assoc filesearch/0 {^\+guide}
 lexy::assoc filesearch/0 {/guide$}
@@ -765,6 +770,7 @@ lexy::assoc mansearch/0 {^\+man}
 
 lexy::def tagsearch 0 {
 		matchspace {(\S+)\t/(.+)/} link,1,2
+		matchspace {(\S+)\t(:[0-9]+)} link,1,2
 		any "." nothing
 	}
 
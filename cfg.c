@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "global.h"
 
@@ -10,6 +11,8 @@ config_t global_config;
 void config_init(config_t *config, config_t *parent) {
 	config->parent = parent;
 	for (int i = 0; i < CONFIG_NUM; ++i) config->cfg[i] = NULL;
+	config->version = 0;
+	config->snapshot.version = ULONG_MAX;
 }
 
 static config_item_t *config_get(config_t *config, int idx) {
@@ -35,6 +38,8 @@ int config_intval(config_t *config, int idx) {
 }
 
 void config_set(config_t *config, int idx, char *val) {
+	++(config->version);
+
 	if (config->cfg[idx] == NULL) {
 		config->cfg[idx] = malloc(sizeof(config_item_t));
 		alloc_assert(config->cfg[idx]);
@@ -58,3 +63,22 @@ void config_set(config_t *config, int idx, char *val) {
 		config->cfg[idx]->intval = atoi(val);
 	}
 }
+
+const config_snapshot_t *config_snapshot(config_t *config) {
+	unsigned long version = 0;
+	for (config_t *c = config; c != NULL; c = c->parent) {
+		version += c->version;
+	}
+
+	config_snapshot_t *s = &(config->snapshot);
+	if (s->version == version) return s;
+
+	for (int i = 0; i < CONFIG_NUM; ++i) {
+		config_item_t *cit = config_get(config, i);
+		s->intval[i] = (cit != NULL) ? cit->intval : 0;
+		s->strval[i] = (cit != NULL) ? cit->strval : NULL;
+	}
+	s->version = version;
+
+	return s;
+}
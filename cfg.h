@@ -8,9 +8,18 @@ typedef struct _config_item_t {
 	int intval;
 } config_item_t;
 
+/* Effective value of every option of a config, for code that reads them in a loop */
+typedef struct _config_snapshot_t {
+	unsigned long version; // sum of the versions of the config and its parents when the snapshot was taken
+	int intval[CONFIG_NUM];
+	char *strval[CONFIG_NUM];
+} config_snapshot_t;
+
 typedef struct _config_t {
 	struct _config_t *parent;
 	config_item_t *cfg[CONFIG_NUM];
+	unsigned long version; // incremented by config_set
+	config_snapshot_t snapshot;
 } config_t;
 
 extern config_t global_config;
@@ -23,4 +32,7 @@ char *config_strval(config_t *config, int idx);
 int config_intval(config_t *config, int idx);
 void config_set(config_t *config, int idx, char *val);
 
+/* Returns the values of config, taken again only if config or one of its parents changed since the last call */
+const config_snapshot_t *config_snapshot(config_t *config);
+
 #endif
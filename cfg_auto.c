@@ -44,8 +44,11 @@ const char *config_names[] = {
 	"tags_discard_lineno",
 	"autoreload",
 	"autocompl_popup",
+	"iopen_index_cache",
 	"jobs_scrollback",
+	"jobs_output_limit",
 	"oldscrollbar",
+	"undo_memory",
 };
 
 void config_init_auto_defaults(void) {
@@ -90,6 +93,9 @@ void config_init_auto_defaults(void) {
 	config_set(&global_config, CFG_TAGS_DISCARD_LINENO, "1");
 	config_set(&global_config, CFG_AUTORELOAD, "1");
 	config_set(&global_config, CFG_AUTOCOMPL_POPUP, "1");
+	config_set(&global_config, CFG_IOPEN_INDEX_CACHE, "0");
 	config_set(&global_config, CFG_JOBS_SCROLLBACK, "0");
+	config_set(&global_config, CFG_JOBS_OUTPUT_LIMIT, "4000000");
 	config_set(&global_config, CFG_OLDSCROLLBAR, "0");
+	config_set(&global_config, CFG_UNDO_MEMORY, "64");
 }
@@ -1,7 +1,7 @@
 #ifndef __CFG_AUTO__
 #define __CFG_AUTO__
 
-#define CONFIG_NUM 42
+#define CONFIG_NUM 45
 
 #define CFG_MAIN_FONT 0
 #define CFG_MAIN_FONT_HEIGHT_REDUCTION 1
@@ -43,7 +43,10 @@
 #define CFG_TAGS_DISCARD_LINENO 37
 #define CFG_AUTORELOAD 38
 #define CFG_AUTOCOMPL_POPUP 39
-#define CFG_JOBS_SCROLLBACK 40
-#define CFG_OLDSCROLLBAR 41
+#define CFG_IOPEN_INDEX_CACHE 40
+#define CFG_JOBS_SCROLLBACK 41
+#define CFG_JOBS_OUTPUT_LIMIT 42
+#define CFG_OLDSCROLLBAR 43
+#define CFG_UNDO_MEMORY 44
 
 #endif
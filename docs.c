@@ -155,6 +155,7 @@ column-specifier ::= <i>column-number</i> | +<i>relative-movement</i> | -<i>rela
 \n\
 			<p>Search for a <i>regexp</i> in the file. If <i>code</i> is specified executes it for every match.\n\
 			<p>When executed on the command line search and execution of <i>code</i> is performed interactively, unless there's an active selection.\n\
+			<p>When <i>code</i> is a single call to <tt>c</tt> its argument is evaluated for every match first and all the replacements are then applied to the buffer at once, as a single change.\n\
 \n\
 			<p>Available options:\n\
 			<ul>\n\
@@ -201,12 +202,13 @@ column-specifier ::= <i>column-number</i> | +<i>relative-movement</i> | -<i>rela
 \n\
 		<h3>undo</h3>\n\
 		<div class=\"ind\">\n\
-			<p><b>Syntax:</b> <tt>undo <b>[</b> fusenext <b>|</b> tag <b>[</b> <i>tagname</i> <b>]</b> <b>|</b> <b>(</b> get <b>|</b> region <b>)</b> <b>(</b> before <b>|</b> after <b>)</b> <b>]</b></tt>\n\
+			<p><b>Syntax:</b> <tt>undo <b>[</b> fusenext <b>|</b> memory <b>|</b> tag <b>[</b> <i>tagname</i> <b>]</b> <b>|</b> <b>(</b> get <b>|</b> region <b>)</b> <b>(</b> before <b>|</b> after <b>)</b> <b>]</b></tt>\n\
 			<p>Without arguments undoes last action.\n\
 			<p>With <tt>get</tt> as an argument returns the very last action executed, <tt>undo get before</tt> gets the text that was replaced, <tt>undo get after</tt> returns the text after the replacement (for insertion the text before is empty, for deletions the text after is empty).\n\
 			<p><tt>region</tt> is like <tt>get</tt> but returns selections as mark/cursor pairs (that can be handed to 'm') instead of text.\n\
 			<p>With <tt>fusenext</tt> teddy will attempt to fuse the very next action performed with the last performed action.\n\
 			<p>With <tt>tag</tt> without any other argument it returns the tag for the last undo action (by default: the empty string). When <tt>tag</tt> and a <i>tagname</i> is specified the last undo action is marked with <i>tagname</i>.\n\
+			<p>With <tt>memory</tt> returns the memory used by the undo history of the current buffer, as a list of keys and values: <tt>bytes</tt>, <tt>nodes</tt> (number of undo actions) and <tt>budget</tt>. When <tt>bytes</tt> exceeds the budget (configuration option <tt>undo_memory</tt>, in megabytes, 0 for no limit) the oldest actions are forgotten.\n\
 			<p>Most of this is used to implement the kill_line builtin, see builtin.tcl for details.\n\
 		</div>\n\
 \n\
@@ -254,6 +256,9 @@ column-specifier ::= <i>column-number</i> | +<i>relative-movement</i> | -<i>rela
 				<li><tt>buffer force-close <b>[</b> <i>buffer-id</i> <b>]</b></tt> closes buffer, discards changes and kills associated processes\n\
 				<li><tt>buffer closeall</tt> closes all buffers and columns, do not use this command\n\
 				<li><tt>buffer column-setup</tt> internal command\n\
+				<li><tt>buffer linecount</tt> returns the number of lines of the current buffer\n\
+				<li><tt>buffer lineof <i>position</i></tt> returns the line number (starting at 1) of a position of the current buffer\n\
+				<li><tt>buffer linestart <i>line</i></tt> returns the position of the first character of <i>line</i> in the current buffer\n\
 			</ul>\n\
 		</div>\n\
 \n\
@@ -276,6 +281,13 @@ column-specifier ::= <i>column-number</i> | +<i>relative-movement</i> | -<i>rela
 			<p><b>Syntax:</b> <tt>wander <i>body</i></tt>\n\
 			<p>Executes <i>body</i>, restores mark and cursor position at the end.\n\
 		</div>\n\
+\n\
+		<h3>teddy::grep</h3>\n\
+		<div class=\"ind\">\n\
+			<p><b>Syntax:</b> <tt>teddy::grep ?-literal? ?-nocase? <i>pattern</i> ?<i>directory</i>?</tt>\n\
+			<p>Searches <i>pattern</i> in all open buffers or, if <i>directory</i> is specified, in all the files contained in it and its subdirectories (hidden and binary files are skipped). Matching lines are written to the <tt>+grep+</tt> buffer as <tt>file:line:col</tt> links. The search is split between one thread per processor, searches of a directory continue in the background and starting a new one cancels them.\n\
+			<p>With <tt>-literal</tt> <i>pattern</i> is a string instead of a regular expression, <tt>-nocase</tt> makes the search case insensitive.\n\
+		</div>\n\
 \n\
 		<h2>Configuration commands</h2>\n\
 \n\
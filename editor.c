@@ -18,6 +18,7 @@
 #include "top.h"
 #include "oldscroll.h"
 #include "plumb.h"
+#include "searchidx.h"
 
 static GtkTargetEntry selection_clipboard_target_entry = { "UTF8_STRING", 0, 0 };
 
@@ -123,7 +124,7 @@ static void editor_replace_selection(editor_t *editor, const char *new_text) {
 	}
 
 	editor_include_cursor(editor, ICM_TOP, ICM_BOT);
-	editor->lineno = buffer_line_of(editor->buffer, editor->buffer->cursor, true);
+	editor->lineno = buffer_line_of(editor->buffer, editor->buffer->cursor);
 	editor->colno = buffer_column_of(editor->buffer, editor->buffer->cursor);
 }
 
@@ -239,7 +240,7 @@ void editor_complete_move(editor_t *editor, gboolean should_move_origin) {
 	if (should_move_origin) {
 		editor_include_cursor(editor, ICM_MID, ICM_MID);
 	}
-	editor->lineno = buffer_line_of(editor->buffer, editor->buffer->cursor, true);
+	editor->lineno = buffer_line_of(editor->buffer, editor->buffer->cursor);
 	editor->colno = buffer_column_of(editor->buffer, editor->buffer->cursor);
 }
 
@@ -277,7 +278,7 @@ void editor_switch_buffer(editor_t *editor, buffer_t *buffer) {
 		buffer_typeset_maybe(editor->buffer, allocation.width, false);
 	}
 
-	editor->lineno = buffer_line_of(buffer, buffer->cursor, true);
+	editor->lineno = buffer_line_of(buffer, buffer->cursor);
 	editor->colno = buffer_column_of(buffer, buffer->cursor);
 	editor->center_on_cursor_after_next_expose = TRUE;
 	gtk_widget_queue_draw(GTK_WIDGET(editor));
@@ -1172,19 +1173,13 @@ static gboolean motion_callback(GtkWidget *widget, GdkEventMotion *event, editor
 	return TRUE;
 }
 
-static void draw_selection(editor_t *editor, double width, cairo_t *cr, int sel_invert) {
-	int start, end;
+// fills the area of the text between start and end with the current color
+static void draw_region(editor_t *editor, double width, cairo_t *cr, int start, int end) {
 	double selstart_y, selend_y;
 	double selstart_x, selend_x;
 
 	double margins = editor->buffer->left_margin + editor->buffer->right_margin;
 
-	if (editor->buffer->mark < 0) return;
-
-	buffer_get_selection(editor->buffer, &start, &end);
-
-	if (start == end) return;
-
 	line_get_glyph_coordinates(editor->buffer, start, &selstart_x, &selstart_y);
 	line_get_glyph_coordinates(editor->buffer, end, &selend_x, &selend_y);
 
@@ -1193,9 +1188,6 @@ static void draw_selection(editor_t *editor, double width, cairo_t *cr, int sel_
 		selend_y -= editor->buffer->line_height;
 	}
 
-	set_color_cfg(cr, config_intval(&(editor->buffer->config), CFG_EDITOR_SEL_COLOR));
-
-	cairo_set_operator(cr, sel_invert ? CAIRO_OPERATOR_DIFFERENCE : CAIRO_OPERATOR_OVER);
 	if (fabs(selstart_y - selend_y) < 0.001) {
 		cairo_rectangle(cr, selstart_x, selstart_y-editor->buffer->ascent, selend_x - selstart_x, editor->buffer->ascent + editor->buffer->descent);
 		cairo_fill(cr);
@@ -1212,6 +1204,21 @@ static void draw_selection(editor_t *editor, double width, cairo_t *cr, int sel_
 		cairo_rectangle(cr, editor->buffer->left_margin, selend_y-editor->buffer->ascent, selend_x, editor->buffer->ascent + editor->buffer->descent);
 		cairo_fill(cr);
 	}
+}
+
+static void draw_selection(editor_t *editor, double width, cairo_t *cr, int sel_invert) {
+	int start, end;
+
+	if (editor->buffer->mark < 0) return;
+
+	buffer_get_selection(editor->buffer, &start, &end);
+
+	if (start == end) return;
+
+	set_color_cfg(cr, config_intval(&(editor->buffer->config), CFG_EDITOR_SEL_COLOR));
+
+	cairo_set_operator(cr, sel_invert ? CAIRO_OPERATOR_DIFFERENCE : CAIRO_OPERATOR_OVER);
+	draw_region(editor, width, cr, start, end);
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
 	set_color_cfg(cr, config_intval(&(editor->buffer->config), CFG_EDITOR_FG_COLOR));
@@ -1229,7 +1236,7 @@ static void draw_parmatch(editor_t *editor, GtkAllocation *allocation, cairo_t *
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_DIFFERENCE);
 
-	cairo_rectangle(cr, x, y - editor->buffer->ascent, bat(editor->buffer, match)->x_advance, editor->buffer->ascent + editor->buffer->descent);
+	cairo_rectangle(cr, x, y - editor->buffer->ascent, lat(editor->buffer, match)->x_advance, editor->buffer->ascent + editor->buffer->descent);
 	cairo_fill(cr);
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
@@ -1300,31 +1307,37 @@ static void growable_glyph_array_append_underline(struct growable_glyph_array *g
 static void draw_lines(editor_t *editor, GtkAllocation *allocation, cairo_t *cr, GHashTable *ht, double starty, double endy) {
 	struct growable_glyph_array *gga_current = NULL;
 
-	my_glyph_info_t *glyph = bat(editor->buffer, 0);
+	int start, end;
+	buffer_layout_range(editor->buffer, starty, endy, &start, &end);
+
+	// start is the first visible glyph, the state of the autowrap indicators is picked up from the glyph before it
+	my_glyph_info_t *prev = (start > 0) ? bat(editor->buffer, start-1) : NULL;
+	bool newline = (prev == NULL) || (prev->code == '\n');
+	my_glyph_layout_t *first = lat(editor->buffer, newline ? start : start-1);
 
-	double cury = (glyph != NULL) ? glyph->y : 0.0;
+	double cury = (first != NULL) ? first->y : 0.0;
 
 	double filey, filex_start, filex_end;
 	bool onfile = false;
 
-	bool do_underline = config_intval(&(editor->buffer->config), CFG_UNDERLINE_LINKS) != 0;
-	bool newline = false;
+	bool do_underline = config_snapshot(&(editor->buffer->config))->intval[CFG_UNDERLINE_LINKS] != 0;
 
 	editor->first_exposed = -1;
 
-	for  (int i = 0; i < BSIZE(editor->buffer); ++i) {
+	for  (int i = start; i < end; ++i) {
 		my_glyph_info_t *glyph = bat(editor->buffer, i);
+		my_glyph_layout_t *layout = lat(editor->buffer, i);
 
-		if (glyph->y < starty) {
+		if (layout->y < starty) {
 			newline = (glyph->code == '\n'); // next loop iteration don't draw autowrap indicators
 			continue;
 		}
-		if (glyph->y - editor->buffer->line_height > endy) break;
+		if (layout->y - editor->buffer->line_height > endy) break;
 
 		if (editor->first_exposed < 0) editor->first_exposed = i;
 
 		// draws soft wrapping indicators
-		if (glyph->y - cury > 0.001) {
+		if (layout->y - cury > 0.001) {
 			if (!newline) {
 				/* draw ending tract */
 				cairo_set_line_width(cr, AUTOWRAP_INDICATOR_WIDTH);
@@ -1334,7 +1347,7 @@ static void draw_lines(editor_t *editor, GtkAllocation *allocation, cairo_t *cr,
 				cairo_stroke(cr);
 			}
 
-			cury = glyph->y;
+			cury = layout->y;
 
 			if (!newline) {
 				/* draw initial tract */
@@ -1350,15 +1363,15 @@ static void draw_lines(editor_t *editor, GtkAllocation *allocation, cairo_t *cr,
 
 		newline = (glyph->code == '\n'); // next loop iteration don't draw autowrap indicators
 
-		uint16_t type = (uint16_t)(glyph->color) + ((uint16_t)(glyph->fontidx) << 8);
+		uint16_t type = (uint16_t)(glyph->color) + ((uint16_t)(layout->fontidx) << 8);
 
 		bool thisfile = glyph->color == (CFG_LEXY_FILE - CFG_LEXY_NOTHING);
 		if (!do_underline) thisfile = false;
 
 		if (thisfile) {
-			if (onfile && (abs(filey - glyph->y) < 0.001)) {
+			if (onfile && (abs(filey - layout->y) < 0.001)) {
 				// we are still on the same line and still on a file, extend underline
-				filex_end = glyph->x + glyph->x_advance;
+				filex_end = layout->x + layout->x_advance;
 			} else {
 				// either we weren't on a file or we moved to a different line,
 				// start a new set of underline information
@@ -1369,9 +1382,9 @@ static void draw_lines(editor_t *editor, GtkAllocation *allocation, cairo_t *cr,
 					growable_glyph_array_append_underline(gga_current, filey, filex_start, filex_end);
 				}
 
-				filey = glyph->y;
-				filex_start = glyph->x;
-				filex_end = glyph->x + glyph->x_advance;
+				filey = layout->y;
+				filex_start = layout->x;
+				filex_end = layout->x + layout->x_advance;
 				onfile = true;
 			}
 		} else {
@@ -1392,9 +1405,9 @@ static void draw_lines(editor_t *editor, GtkAllocation *allocation, cairo_t *cr,
 		}
 
 		cairo_glyph_t g;
-		g.index = glyph->glyph_index;
-		g.x = glyph->x;
-		g.y = glyph->y;
+		g.index = layout->glyph_index;
+		g.x = layout->x;
+		g.y = layout->y;
 
 		growable_glyph_array_append(gga_current, g);
 	}
@@ -1456,8 +1469,10 @@ static void draw_posbox(cairo_t *cr, editor_t *editor, GtkAllocation *allocation
 	cairo_text_extents_t posbox_ext;
 	double x, y;
 
-	if (editor->lineno < 0) {
-		asprintf(&posbox_text, "=%d ???:%d %0.0f%%", editor->buffer->cursor, editor->colno, (100.0 * editor->buffer->cursor / BSIZE(editor->buffer)));
+	int k, n;
+	bool complete;
+	if ((editor->research.mode == SM_LITERAL) && (editor->buffer->mark >= 0) && searchidx_position(editor->buffer, MIN(editor->buffer->mark, editor->buffer->cursor), &k, &n, &complete) && (k > 0)) {
+		asprintf(&posbox_text, "match %d of %d%s =%d %d:%d", k, n, complete ? "" : "+", editor->buffer->cursor, editor->lineno, editor->colno);
 	} else {
 		asprintf(&posbox_text, "=%d %d:%d %0.0f%%", editor->buffer->cursor, editor->lineno, editor->colno, (100.0 * editor->buffer->cursor / BSIZE(editor->buffer)));
 	}
@@ -1533,24 +1548,48 @@ static int make_halfway_color(int fgcolor, int bgcolor) {
 	return (int)dka + (((int)dkb) << 8) + (((int)dkc) << 16);
 }
 
+#define SEARCH_MATCHES_MAX_DRAWN 1024
+
+// highlights every occurrence of the literal search between starty and endy
+static void draw_search_matches(editor_t *editor, double width, cairo_t *cr, double starty, double endy) {
+	if (editor->research.mode != SM_LITERAL) return;
+
+	research_update_index(editor);
+
+	int start, end;
+	buffer_layout_range(editor->buffer, starty, endy, &start, &end);
+
+	int v[SEARCH_MATCHES_MAX_DRAWN], len;
+	int n = searchidx_range(editor->buffer, start, end, v, SEARCH_MATCHES_MAX_DRAWN, &len);
+	if (n == 0) return;
+
+	set_color_cfg(cr, make_halfway_color(config_intval(&(editor->buffer->config), CFG_EDITOR_SEL_COLOR), config_intval(&(editor->buffer->config), CFG_EDITOR_BG_COLOR)));
+	for (int i = 0; i < n; ++i) {
+		draw_region(editor, width, cr, v[i], v[i] + len);
+	}
+	set_color_cfg(cr, config_intval(&(editor->buffer->config), CFG_EDITOR_FG_COLOR));
+}
+
 static gboolean expose_event_callback(GtkWidget *widget, GdkEventExpose *event, editor_t *editor) {
 	cairo_t *cr = gdk_cairo_create(widget->window);
 	bool darkened = editor->darken && !(editor->cursor_visible);
+	const config_snapshot_t *cfg = config_snapshot(&(editor->buffer->config));
 
 	GtkAllocation allocation;
 	gtk_widget_get_allocation(widget, &allocation);
 
-	set_color_cfg(cr, config_intval(&(editor->buffer->config), CFG_EDITOR_BG_COLOR));
+	set_color_cfg(cr, cfg->intval[CFG_EDITOR_BG_COLOR]);
 	cairo_rectangle(cr, 0, 0, allocation.width, allocation.height);
 	cairo_fill(cr);
 
 	buffer_typeset_maybe(editor->buffer, allocation.width, false);
-	int sel_invert = config_intval(&(editor->buffer->config), CFG_EDITOR_SEL_INVERT);
+	int sel_invert = cfg->intval[CFG_EDITOR_SEL_INVERT];
 
 	/********** TRANSLATED STUFF STARTS HERE  ***************************/
 	cairo_translate(cr, -gtk_adjustment_get_value(GTK_ADJUSTMENT(editor->hadjustment)), -gtk_adjustment_get_value(GTK_ADJUSTMENT(editor->adjustment)));
 
 	draw_cursorline(cr, editor);
+	if (!darkened) draw_search_matches(editor, allocation.width, cr, gtk_adjustment_get_value(GTK_ADJUSTMENT(editor->adjustment)), gtk_adjustment_get_value(GTK_ADJUSTMENT(editor->adjustment)) + allocation.height);
 	if (!darkened && !sel_invert) draw_selection(editor, allocation.width, cr, sel_invert);
 
 	//editor->buffer->rendered_height = 0.0;
@@ -1558,11 +1597,11 @@ static gboolean expose_event_callback(GtkWidget *widget, GdkEventExpose *event,
 	GHashTable *ht = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-	set_color_cfg(cr, config_intval(&(editor->buffer->config), CFG_EDITOR_FG_COLOR));
+	set_color_cfg(cr, cfg->intval[CFG_EDITOR_FG_COLOR]);
 
 	draw_lines(editor, &allocation, cr, ht, gtk_adjustment_get_value(GTK_ADJUSTMENT(editor->adjustment)), gtk_adjustment_get_value(GTK_ADJUSTMENT(editor->adjustment)) + allocation.height);
 
-	int darkened_color = darkened ? make_halfway_color(config_intval(&(editor->buffer->config), CFG_LEXY_NOTHING), config_intval(&(editor->buffer->config), CFG_EDITOR_BG_COLOR)) : 0;
+	int darkened_color = darkened ? make_halfway_color(cfg->intval[CFG_LEXY_NOTHING], cfg->intval[CFG_EDITOR_BG_COLOR]) : 0;
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 	GHashTableIter it;
@@ -1573,9 +1612,9 @@ static gboolean expose_event_callback(GtkWidget *widget, GdkEventExpose *event,
 		struct growable_glyph_array *gga = (struct growable_glyph_array *)(value);
 		uint8_t color = (uint8_t)type;
 		uint8_t fontidx = (uint8_t)(type >> 8);
-		cairo_set_scaled_font(cr, fontset_get_cairofont_by_name(config_strval(&(editor->buffer->config), CFG_MAIN_FONT), fontidx));
+		cairo_set_scaled_font(cr, fontset_get_cairofont(editor->buffer->fontset, fontidx));
 
-		set_color_cfg(cr, darkened ? darkened_color : config_intval(&(editor->buffer->config), CFG_LEXY_NOTHING+color));
+		set_color_cfg(cr, darkened ? darkened_color : cfg->intval[CFG_LEXY_NOTHING+color]);
 
 		cairo_show_glyphs(cr, gga->glyphs, gga->n);
 		//set_color_cfg(cr, config_intval(&(editor->buffer->config), CFG_LEXY_FILE));
@@ -1609,7 +1648,7 @@ static gboolean expose_event_callback(GtkWidget *widget, GdkEventExpose *event,
 			allocation.height // page size
 			);
 
-		if ((editor->buffer->rendered_width > allocation.width) && (config_intval(&(editor->buffer->config), CFG_AUTOWRAP) == 0)) {
+		if ((editor->buffer->rendered_width > allocation.width) && (cfg->intval[CFG_AUTOWRAP] == 0)) {
 			gtk_adjustment_configure(GTK_ADJUSTMENT(editor->hadjustment),
 				gtk_adjustment_get_value(GTK_ADJUSTMENT(editor->hadjustment)),
 				0.0, // lower
@@ -1719,7 +1758,7 @@ editor_t *new_editor(buffer_t *buffer, bool single_line) {
 	r->mouse_sequence_str[0] = '\0';
 
 	if (buffer != NULL) {
-		r->lineno = buffer_line_of(buffer, buffer->cursor, true);
+		r->lineno = buffer_line_of(buffer, buffer->cursor);
 		r->colno = buffer_column_of(buffer, buffer->cursor);
 	} else {
 		r->lineno = 1; r->colno = 1;
@@ -0,0 +1,525 @@
+#include "fileidx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "global.h"
+#include "buffers.h"
+#include "cfg.h"
+
+#define FILEIDX_DEPTH_LIMIT 128
+/* Past this many directories changes are not followed, the index is rebuilt every time iopen is opened instead.
+   The limit is also lowered to a fraction of the inotify watches allowed to the user, the rest is left to the buffers and to other programs */
+#define FILEIDX_MAX_WATCHES 16384
+#define FILEIDX_WATCHES_FRACTION 4
+#define FILEIDX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_MASK_ADD)
+
+struct fileidx_t {
+	char *dir;
+	char **entries;
+	int n;
+	unsigned long generation; // incremented every time entries changes
+	bool building;
+};
+
+/* fileidx is only modified by the main thread (builds are published through g_idle_add), fileidx_mutex is held while doing it so that iopen's threads can take snapshots.
+   Entries removed while some snapshot is still in use are retired instead of freed, they are freed when the last snapshot is released */
+static struct fileidx_t fileidx;
+static int fileidx_cap;
+static GHashTable *fileidx_positions; // entry -> its index in fileidx.entries + 1
+static GHashTable *fileidx_watches; // inotify watch descriptor -> directory it watches, relative to fileidx.dir
+static bool fileidx_stale = true; // some change could not be followed
+static unsigned long fileidx_build_id; // the build that will be published, accessed atomically
+static int fileidx_max_watches = -1; // set before the first build is started
+
+static pthread_mutex_t fileidx_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fileidx_snapshot *fileidx_current; // snapshot of the current generation, if one was taken
+static int fileidx_readers; // snapshots not yet released
+static GPtrArray *fileidx_retired; // entries waiting for fileidx_readers to drop to zero
+
+struct fileidx_build {
+	unsigned long id;
+	char *dir;
+	bool use_cache;
+
+	char **entries;
+	int n, cap;
+	GHashTable *watches;
+	bool complete; // the index can be kept up to date with watches
+	bool last; // no more results will come from this build
+};
+
+static void snapshot_free(struct fileidx_snapshot *snapshot) {
+	free(snapshot->entries);
+	free(snapshot);
+}
+
+struct fileidx_snapshot *fileidx_snapshot(bool *building) {
+	pthread_mutex_lock(&fileidx_mutex);
+
+	if ((fileidx_current == NULL) || (fileidx_current->generation != fileidx.generation)) {
+		if ((fileidx_current != NULL) && (fileidx_current->refcount == 0)) snapshot_free(fileidx_current);
+
+		struct fileidx_snapshot *snapshot = malloc(sizeof(struct fileidx_snapshot));
+		alloc_assert(snapshot);
+		snapshot->refcount = 0;
+		snapshot->n = fileidx.n;
+		snapshot->generation = fileidx.generation;
+		snapshot->entries = malloc(sizeof(char *) * MAX(fileidx.n, 1));
+		alloc_assert(snapshot->entries);
+		if (fileidx.n > 0) memcpy(snapshot->entries, fileidx.entries, sizeof(char *) * fileidx.n);
+
+		fileidx_current = snapshot;
+	}
+
+	struct fileidx_snapshot *r = fileidx_current;
+	++(r->refcount);
+	++fileidx_readers;
+	*building = fileidx.building;
+
+	pthread_mutex_unlock(&fileidx_mutex);
+	return r;
+}
+
+void fileidx_snapshot_release(struct fileidx_snapshot *snapshot) {
+	pthread_mutex_lock(&fileidx_mutex);
+
+	--(snapshot->refcount);
+	--fileidx_readers;
+	if ((snapshot->refcount == 0) && (snapshot != fileidx_current)) snapshot_free(snapshot);
+
+	if ((fileidx_readers == 0) && (fileidx_retired != NULL)) {
+		for (guint i = 0; i < fileidx_retired->len; ++i) {
+			free(g_ptr_array_index(fileidx_retired, i));
+		}
+		g_ptr_array_set_size(fileidx_retired, 0);
+	}
+
+	pthread_mutex_unlock(&fileidx_mutex);
+}
+
+// frees an entry that was removed from the index, or keeps it until the snapshots that could contain it are released. Called with fileidx_mutex held
+static void fileidx_retire(char *entry) {
+	if (fileidx_readers == 0) {
+		free(entry);
+		return;
+	}
+	if (fileidx_retired == NULL) fileidx_retired = g_ptr_array_new();
+	g_ptr_array_add(fileidx_retired, entry);
+}
+
+static char *fileidx_cache_path(void) {
+	char *xdg_config_home = getenv("XDG_CONFIG_HOME");
+	char *r;
+
+	if (xdg_config_home != NULL) {
+		asprintf(&r, "%s/teddy/iopen_index", xdg_config_home);
+	} else {
+		asprintf(&r, "%s/.config/teddy/iopen_index", getenv("HOME"));
+	}
+	alloc_assert(r);
+
+	return r;
+}
+
+static void build_add(struct fileidx_build *b, char *entry) {
+	if (b->n >= b->cap) {
+		b->cap = MAX(2 * b->cap, 1024);
+		b->entries = realloc(b->entries, sizeof(char *) * b->cap);
+		alloc_assert(b->entries);
+	}
+	b->entries[b->n++] = entry;
+}
+
+static void build_watch(struct fileidx_build *b, const char *rel) {
+	if (inotify_fd < 0) {
+		b->complete = false;
+		return;
+	}
+
+	if ((int)g_hash_table_size(b->watches) >= fileidx_max_watches) {
+		b->complete = false;
+		return;
+	}
+
+	char *path;
+	asprintf(&path, "%s/%s", b->dir, rel);
+	alloc_assert(path);
+	int wd = inotify_add_watch(inotify_fd, path, FILEIDX_WATCH_MASK);
+	free(path);
+
+	if (wd < 0) {
+		b->complete = false;
+		return;
+	}
+
+	g_hash_table_insert(b->watches, GINT_TO_POINTER(wd), strdup(rel));
+}
+
+static bool build_superseded(struct fileidx_build *b) {
+	return __atomic_load_n(&fileidx_build_id, __ATOMIC_SEQ_CST) != b->id;
+}
+
+// reads the index saved for b->dir by a previous session, if any
+static bool build_load_cache(struct fileidx_build *b) {
+	char *path = fileidx_cache_path();
+	FILE *in = fopen(path, "r");
+	free(path);
+	if (in == NULL) return false;
+
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+	bool r = false;
+
+	if ((len = getline(&line, &linecap, in)) > 0) {
+		if (line[len-1] == '\n') line[len-1] = '\0';
+		if (strcmp(line, b->dir) == 0) {
+			r = true;
+			while ((len = getline(&line, &linecap, in)) > 0) {
+				if (line[len-1] == '\n') line[--len] = '\0';
+				if (len == 0) continue;
+				build_add(b, strdup(line));
+			}
+		}
+	}
+
+	free(line);
+	fclose(in);
+	return r;
+}
+
+static void build_save_cache(struct fileidx_build *b) {
+	char *path = fileidx_cache_path();
+	char *tmppath;
+	asprintf(&tmppath, "%s~", path);
+	alloc_assert(tmppath);
+
+	FILE *out = fopen(tmppath, "w");
+	if (out == NULL) {
+		perror("Can't save iopen index");
+	} else {
+		fprintf(out, "%s\n", b->dir);
+		for (int i = 0; i < b->n; ++i) {
+			fprintf(out, "%s\n", b->entries[i]);
+		}
+		if (fclose(out) == 0) rename(tmppath, path);
+	}
+
+	free(tmppath);
+	free(path);
+}
+
+static void build_walk(struct fileidx_build *b) {
+	struct {
+		DIR *dir;
+		char *rel;
+	} tovisit[FILEIDX_DEPTH_LIMIT];
+	int top = 0;
+
+	tovisit[0].dir = opendir(b->dir);
+	if (tovisit[0].dir == NULL) return;
+	tovisit[0].rel = strdup("");
+	alloc_assert(tovisit[0].rel);
+	build_watch(b, "");
+	top = 1;
+
+	while (top > 0) {
+		if (build_superseded(b)) break;
+
+		DIR *dir = tovisit[top-1].dir;
+		const char *rel = tovisit[top-1].rel;
+		struct dirent *cur = readdir(dir);
+
+		if (cur == NULL) {
+			closedir(dir);
+			free(tovisit[top-1].rel);
+			--top;
+			continue;
+		}
+
+		if (cur->d_name[0] == '.') continue;
+
+		bool isdir = (cur->d_type == DT_DIR);
+		if (cur->d_type == DT_UNKNOWN) {
+			struct stat s;
+			isdir = (fstatat(dirfd(dir), cur->d_name, &s, AT_SYMLINK_NOFOLLOW) == 0) && S_ISDIR(s.st_mode);
+		}
+
+		char *entry;
+		asprintf(&entry, "%s%s%s", rel, cur->d_name, isdir ? "/" : "");
+		alloc_assert(entry);
+		build_add(b, entry);
+
+		if (!isdir) continue;
+
+		if (top >= FILEIDX_DEPTH_LIMIT) {
+			b->complete = false;
+			continue;
+		}
+
+		int newfd = openat(dirfd(dir), cur->d_name, O_RDONLY | O_DIRECTORY);
+		if (newfd < 0) continue;
+		tovisit[top].dir = fdopendir(newfd);
+		if (tovisit[top].dir == NULL) {
+			close(newfd);
+			continue;
+		}
+		tovisit[top].rel = strdup(entry);
+		alloc_assert(tovisit[top].rel);
+		build_watch(b, entry);
+		++top;
+	}
+
+	for (int i = 0; i < top; ++i) {
+		closedir(tovisit[i].dir);
+		free(tovisit[i].rel);
+	}
+}
+
+bool fileidx_watch_in_use(int wd) {
+	return (fileidx_watches != NULL) && (g_hash_table_lookup(fileidx_watches, GINT_TO_POINTER(wd)) != NULL);
+}
+
+static bool watch_in_use(int wd) {
+	if (fileidx_watch_in_use(wd)) return true;
+	for (int i = 0; i < buffers_allocated; ++i) {
+		if ((buffers[i] != NULL) && (buffers[i]->inotify_wd == wd)) return true;
+	}
+	return false;
+}
+
+// removes the watches in watches that nothing else is using and frees watches
+static void fileidx_drop_watches(GHashTable *watches) {
+	if (watches == NULL) return;
+
+	GHashTableIter it;
+	gpointer key, value;
+	g_hash_table_iter_init(&it, watches);
+	while (g_hash_table_iter_next(&it, &key, &value)) {
+		if (!watch_in_use(GPOINTER_TO_INT(key))) inotify_rm_watch(inotify_fd, GPOINTER_TO_INT(key));
+	}
+
+	g_hash_table_destroy(watches);
+}
+
+static void fileidx_free_entries(void) {
+	for (int i = 0; i < fileidx.n; ++i) {
+		fileidx_retire(fileidx.entries[i]);
+	}
+	free(fileidx.entries);
+	fileidx.entries = NULL;
+	fileidx.n = fileidx_cap = 0;
+	if (fileidx_positions != NULL) g_hash_table_destroy(fileidx_positions);
+	fileidx_positions = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static void build_free(struct fileidx_build *b) {
+	if (b->entries != NULL) {
+		for (int i = 0; i < b->n; ++i) {
+			free(b->entries[i]);
+		}
+		free(b->entries);
+	}
+	fileidx_drop_watches(b->watches);
+	free(b->dir);
+	free(b);
+}
+
+// replaces the index with the results of b, in the main thread
+static gboolean fileidx_publish(struct fileidx_build *b) {
+	if (b->id != fileidx_build_id) {
+		build_free(b);
+		return FALSE;
+	}
+
+	GHashTable *old_watches = fileidx_watches;
+
+	pthread_mutex_lock(&fileidx_mutex);
+	fileidx_free_entries();
+	fileidx.entries = b->entries;
+	fileidx.n = fileidx_cap = b->n;
+	for (int i = 0; i < fileidx.n; ++i) {
+		g_hash_table_insert(fileidx_positions, fileidx.entries[i], GINT_TO_POINTER(i+1));
+	}
+	++(fileidx.generation);
+	fileidx.building = !b->last;
+	fileidx_watches = b->watches;
+	pthread_mutex_unlock(&fileidx_mutex);
+
+	if (b->last) fileidx_stale = !b->complete;
+
+	b->entries = NULL;
+	b->watches = NULL;
+	b->n = 0;
+
+	fileidx_drop_watches(old_watches);
+
+	build_free(b);
+	return FALSE;
+}
+
+static struct fileidx_build *build_new(unsigned long id, const char *dir) {
+	struct fileidx_build *b = malloc(sizeof(struct fileidx_build));
+	alloc_assert(b);
+	memset(b, 0, sizeof(struct fileidx_build));
+	b->id = id;
+	b->dir = strdup(dir);
+	alloc_assert(b->dir);
+	b->watches = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+	b->complete = true;
+	return b;
+}
+
+static void *fileidx_build_thread(void *varg) {
+	struct fileidx_build *b = (struct fileidx_build *)varg;
+
+	// what was saved by the previous session is used while the directory is walked
+	if (b->use_cache) {
+		struct fileidx_build *cached = build_new(b->id, b->dir);
+		if (build_load_cache(cached)) {
+			g_idle_add((GSourceFunc)fileidx_publish, cached);
+		} else {
+			build_free(cached);
+		}
+	}
+
+	build_walk(b);
+
+	if (build_superseded(b)) {
+		g_idle_add((GSourceFunc)fileidx_publish, b);
+		return NULL;
+	}
+
+	if (b->use_cache) build_save_cache(b);
+
+	b->last = true;
+	g_idle_add((GSourceFunc)fileidx_publish, b);
+	return NULL;
+}
+
+static int fileidx_watches_limit(void) {
+	int max_user_watches = 8192; // the default of older kernels
+	FILE *f = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%d", &max_user_watches) != 1) max_user_watches = 8192;
+		fclose(f);
+	}
+	return MIN(FILEIDX_MAX_WATCHES, max_user_watches / FILEIDX_WATCHES_FRACTION);
+}
+
+void fileidx_update(const char *dir) {
+	bool same_dir = (fileidx.dir != NULL) && (strcmp(fileidx.dir, dir) == 0);
+	if (same_dir && (fileidx.building || !fileidx_stale)) return;
+
+	if (fileidx_max_watches < 0) fileidx_max_watches = fileidx_watches_limit();
+
+	unsigned long id = __atomic_add_fetch(&fileidx_build_id, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&fileidx_mutex);
+	if (!same_dir) {
+		fileidx_free_entries();
+		free(fileidx.dir);
+		fileidx.dir = strdup(dir);
+		alloc_assert(fileidx.dir);
+		++(fileidx.generation);
+	}
+	fileidx.building = true;
+	pthread_mutex_unlock(&fileidx_mutex);
+
+	struct fileidx_build *b = build_new(id, dir);
+	// the cache is only useful if there isn't anything better
+	b->use_cache = (fileidx.n == 0) && config_intval(&global_config, CFG_IOPEN_INDEX_CACHE);
+
+	pthread_attr_t attrs;
+	pthread_attr_init(&attrs);
+	pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
+
+	pthread_t thread;
+	if (pthread_create(&thread, &attrs, fileidx_build_thread, b) != 0) {
+		perror("Can not start file index thread");
+		fileidx.building = false;
+		build_free(b);
+	}
+
+	pthread_attr_destroy(&attrs);
+}
+
+// adds entry to the index, takes ownership of it
+static void fileidx_add(char *entry) {
+	if (g_hash_table_lookup(fileidx_positions, entry) != NULL) {
+		free(entry);
+		return;
+	}
+
+	if (fileidx.n >= fileidx_cap) {
+		fileidx_cap = MAX(2 * fileidx_cap, 1024);
+		fileidx.entries = realloc(fileidx.entries, sizeof(char *) * fileidx_cap);
+		alloc_assert(fileidx.entries);
+	}
+
+	fileidx.entries[fileidx.n++] = entry;
+	g_hash_table_insert(fileidx_positions, entry, GINT_TO_POINTER(fileidx.n));
+	++(fileidx.generation);
+}
+
+static void fileidx_remove(const char *entry) {
+	int i = GPOINTER_TO_INT(g_hash_table_lookup(fileidx_positions, entry)) - 1;
+	if (i < 0) return;
+
+	g_hash_table_remove(fileidx_positions, entry);
+	fileidx_retire(fileidx.entries[i]);
+
+	// the last entry takes its place
+	--(fileidx.n);
+	if (i != fileidx.n) {
+		fileidx.entries[i] = fileidx.entries[fileidx.n];
+		g_hash_table_insert(fileidx_positions, fileidx.entries[i], GINT_TO_POINTER(i+1));
+	}
+	++(fileidx.generation);
+}
+
+void fileidx_inotify_event(struct inotify_event *event) {
+	if (event->mask & IN_Q_OVERFLOW) {
+		fileidx_stale = true;
+		return;
+	}
+
+	if (fileidx_watches == NULL) return;
+	const char *rel = g_hash_table_lookup(fileidx_watches, GINT_TO_POINTER(event->wd));
+	if (rel == NULL) return;
+
+	if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		fileidx_stale = true;
+		if (event->mask & IN_IGNORED) g_hash_table_remove(fileidx_watches, GINT_TO_POINTER(event->wd));
+		return;
+	}
+
+	if ((event->len == 0) || (event->name[0] == '.')) return;
+
+	bool isdir = (event->mask & IN_ISDIR) != 0;
+	char *entry;
+	asprintf(&entry, "%s%s%s", rel, event->name, isdir ? "/" : "");
+	alloc_assert(entry);
+
+	pthread_mutex_lock(&fileidx_mutex);
+	if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+		fileidx_add(entry);
+		entry = NULL;
+	} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		fileidx_remove(entry);
+	}
+	pthread_mutex_unlock(&fileidx_mutex);
+
+	// the contents of the directory need to be walked (or removed)
+	if (isdir) fileidx_stale = true;
+
+	free(entry);
+}
@@ -0,0 +1,31 @@
+#ifndef __FILEIDX_H__
+#define __FILEIDX_H__
+
+#include <stdbool.h>
+#include <sys/inotify.h>
+
+/* Index of the names of the files under a directory, used by iopen.
+   It's built by a background thread, kept up to date through the inotify events received by buffers.c and optionally saved between sessions.
+   Entries are paths relative to the directory, hidden files are skipped and the names of directories end with '/' */
+
+/* A copy of the entries of the index, taken from any thread.
+   It's never modified and its strings stay valid until it is released, so it can be searched without blocking the main thread */
+struct fileidx_snapshot {
+	int refcount; // protected by the mutex in fileidx.c
+	char **entries;
+	int n;
+	unsigned long generation; // of the index when the snapshot was taken
+};
+
+// makes the index be for dir, rebuilding it if it is for another directory or if some change could not be followed
+void fileidx_update(const char *dir);
+// called by buffers.c for every inotify event
+void fileidx_inotify_event(struct inotify_event *event);
+// returns true if the index uses the inotify watch wd, buffers.c must not remove it
+bool fileidx_watch_in_use(int wd);
+
+// returns a snapshot of the current entries, in *building whether the index is still being built, release it with fileidx_snapshot_release
+struct fileidx_snapshot *fileidx_snapshot(bool *building);
+void fileidx_snapshot_release(struct fileidx_snapshot *snapshot);
+
+#endif
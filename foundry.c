@@ -1,6 +1,12 @@
 #include "foundry.h"
 
 #include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <cairo-ft.h>
 #include <glib.h>
 
@@ -14,23 +20,51 @@ typedef struct _teddy_font_t {
 	cairo_scaled_font_t *cairofont;
 	cairo_matrix_t font_size_matrix, font_ctm;
 	cairo_font_options_t *font_options;
-	FT_Face scaled_face;
+	FT_Face scaled_face; // only valid while the face is locked (see font_face)
+
+	// caches, allocated on first use
+	double *advances; // advance of every glyph, NAN if not known yet
+	double *kerning; // kerning of pairs of ASCII characters, NAN if not known yet
 } teddy_font_t;
 
+// kerning between characters below this is cached
+#define KERNING_CACHE_SIZE 128
+// glyph_index entries of characters that haven't been looked up yet
+#define GLYPH_UNKNOWN ((FT_UInt)-1)
+// characters of the BMP
+#define FONTSET_MAP_SIZE (0xffff+1)
+
 typedef struct _teddy_fontset_t {
 	teddy_font_t fonts[0xff];
-	uint8_t map[0xfffff+1];
+	uint8_t *map; // font of every character of the BMP, either allocated or part of the mapped cache file
+	char *cache;
+	size_t cache_len;
+	FT_UInt glyph_index[0xffff+1]; // glyph of every character in the font map says
 	int count;
+
+	uint8_t locked[0xff]; // fonts whose face is locked, they are unlocked by foundry_release
+	int nlocked;
 } teddy_fontset_t;
 
 GHashTable *fontset_table;
 
+static void teddy_font_free(teddy_font_t *font) {
+	cairo_font_face_destroy(font->cairoface);
+	cairo_scaled_font_destroy(font->cairofont);
+	cairo_font_options_destroy(font->font_options);
+	FT_Done_Face(font->face);
+	free(font->advances);
+	free(font->kerning);
+}
+
 static void fontset_free(teddy_fontset_t *fontset) {
 	for (int i = 0; i < fontset->count; ++i) {
-		cairo_font_face_destroy(fontset->fonts[i].cairoface);
-		cairo_scaled_font_destroy(fontset->fonts[i].cairofont);
-		cairo_font_options_destroy(fontset->fonts[i].font_options);
-		FT_Done_Face(fontset->fonts[i].face);
+		teddy_font_free(fontset->fonts + i);
+	}
+	if (fontset->cache != NULL) {
+		munmap(fontset->cache, fontset->cache_len);
+	} else {
+		free(fontset->map);
 	}
 	free(fontset);
 }
@@ -69,6 +103,9 @@ static bool teddy_finish_init_font(teddy_font_t *font, double size, bool set_ft_
 
 	font->cairofont = cairo_scaled_font_create(font->cairoface, &(font->font_size_matrix), &(font->font_ctm), font->font_options);
 
+	font->advances = NULL;
+	font->kerning = NULL;
+
 	return true;
 }
 
@@ -83,45 +120,252 @@ static bool teddy_font_init_ex(teddy_font_t *font,  const char *fontfile, double
 	return teddy_finish_init_font(font, size, true);
 }
 
-static bool fontconfig_init_from_pattern(FcPattern *match, teddy_font_t *font, double default_size) {
-	FcChar8 *fontfile;
-	if (FcPatternGetString(match, FC_FILE, 0, &fontfile) != FcResultMatch) {
+// font file, size and face index of match
+static void fontconfig_pattern_file(FcPattern *match, double default_size, char **fontfile, double *size, int *index) {
+	if (FcPatternGetString(match, FC_FILE, 0, (FcChar8 **)fontfile) != FcResultMatch) {
 		printf("Font file not found\n");
 		exit(EXIT_FAILURE);
 	}
 
-	double size;
-	if (FcPatternGetDouble(match, FC_SIZE, 0, &size) != FcResultMatch) {
-		size = default_size;
+	if (FcPatternGetDouble(match, FC_SIZE, 0, size) != FcResultMatch) {
+		*size = default_size;
 	}
 
-	int index;
-	if (FcPatternGetInteger(match, FC_INDEX, 0, &index) != FcResultMatch) {
-		index = 0;
+	if (FcPatternGetInteger(match, FC_INDEX, 0, index) != FcResultMatch) {
+		*index = 0;
 	}
 
-	//printf("\t%s %g %d\n", fontfile, size, index);
-	return teddy_font_init_ex(font, (const char *)fontfile, size, index);
+	//printf("\t%s %g %d\n", *fontfile, *size, *index);
 }
 
-static void match_write_coverage(teddy_fontset_t *fontset, int idx, FcCharSet *cset, FcCharSet *accumulator) {
-	FcChar32 ucs4;
-	FcChar32 map[FC_CHARSET_MAP_SIZE];
-	FcChar32 next;
-
-	FcCharSet *charnews = FcCharSetSubtract(cset, accumulator);
-
-	for (ucs4 = FcCharSetFirstPage(charnews, map, &next); ucs4 != FC_CHARSET_DONE; ucs4 = FcCharSetNextPage(charnews, map, &next)) {
-		for (int i = 0; i < FC_CHARSET_MAP_SIZE; i++) {
-			if (!map[i]) continue;
-			for (int j = 0; j < 32; j++) {
-				if (!(map[i] & (1 << j))) continue;
-				uint32_t cur = ucs4 + i * 32 + j;
-				if (cur > 0xffff) continue;
-				fontset->map[cur] = idx;
+/* Fills the part of the map between the characters lo and hi: every character goes to the first font that has it */
+struct coverage_shard {
+	teddy_fontset_t *fontset;
+	FcCharSet **csets;
+	uint32_t lo, hi;
+};
+
+static void *coverage_shard_thread(void *arg) {
+	struct coverage_shard *sh = (struct coverage_shard *)arg;
+	uint8_t *map = sh->fontset->map;
+
+	for (int idx = 0; idx < sh->fontset->count; ++idx) {
+		FcChar32 ucs4;
+		FcChar32 page[FC_CHARSET_MAP_SIZE];
+		FcChar32 next;
+
+		for (ucs4 = FcCharSetFirstPage(sh->csets[idx], page, &next); ucs4 != FC_CHARSET_DONE; ucs4 = FcCharSetNextPage(sh->csets[idx], page, &next)) {
+			if (ucs4 >= sh->hi) break;
+			if (ucs4 < sh->lo) continue;
+			for (int i = 0; i < FC_CHARSET_MAP_SIZE; i++) {
+				if (!page[i]) continue;
+				for (int j = 0; j < 32; j++) {
+					if (!(page[i] & (1U << j))) continue;
+					uint32_t cur = ucs4 + i * 32 + j;
+					if (map[cur] == 0xff) map[cur] = idx;
+				}
 			}
 		}
 	}
+
+	return NULL;
+}
+
+static void fontset_coverage(teddy_fontset_t *fontset, FcCharSet **csets) {
+	fontset->map = malloc(sizeof(uint8_t) * FONTSET_MAP_SIZE);
+	alloc_assert(fontset->map);
+	memset(fontset->map, 0xff, sizeof(uint8_t) * FONTSET_MAP_SIZE);
+
+	// fontconfig pages are 256 characters long
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int npages = FONTSET_MAP_SIZE / 256;
+	int nshards = (int)MAX(MIN(ncpu, npages), 1);
+
+	struct coverage_shard *shards = malloc(sizeof(struct coverage_shard) * nshards);
+	alloc_assert(shards);
+	pthread_t *threads = malloc(sizeof(pthread_t) * nshards);
+	alloc_assert(threads);
+	bool *started = malloc(sizeof(bool) * nshards);
+	alloc_assert(started);
+
+	for (int s = 0; s < nshards; ++s) {
+		shards[s].fontset = fontset;
+		shards[s].csets = csets;
+		shards[s].lo = 256 * (npages * s / nshards);
+		shards[s].hi = 256 * (npages * (s+1) / nshards);
+	}
+
+	// the first shard is done by this thread
+	for (int s = 1; s < nshards; ++s) {
+		started[s] = (pthread_create(threads + s, NULL, coverage_shard_thread, shards + s) == 0);
+		if (!started[s]) coverage_shard_thread(shards + s);
+	}
+	coverage_shard_thread(shards);
+
+	for (int s = 1; s < nshards; ++s) {
+		if (started[s]) pthread_join(threads[s], NULL);
+	}
+
+	free(started);
+	free(threads);
+	free(shards);
+}
+
+/* Fontset cache file: the header, the map, then for every font its size, face index and the length of its path followed by the path (with its terminating '\0') */
+#define FONTSET_CACHE_MAGIC "teddyfs1"
+
+struct fontset_cache_header {
+	char magic[8];
+	uint64_t config_hash;
+	uint32_t count;
+	uint32_t fonts_size; // bytes used by fonts after the map
+};
+
+struct fontset_cache_font {
+	double size;
+	int32_t index;
+	uint32_t pathlen;
+};
+
+static uint64_t fnv1a(uint64_t h, const void *p, size_t len) {
+	const uint8_t *b = p;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= b[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+static uint64_t fnv1a_files(uint64_t h, FcStrList *list) {
+	FcChar8 *path;
+	while ((path = FcStrListNext(list)) != NULL) {
+		h = fnv1a(h, path, strlen((const char *)path) + 1);
+		struct stat s;
+		if (stat((const char *)path, &s) == 0) {
+			h = fnv1a(h, &(s.st_mtime), sizeof(s.st_mtime));
+			h = fnv1a(h, &(s.st_size), sizeof(s.st_size));
+		}
+	}
+	FcStrListDone(list);
+	return h;
+}
+
+// hash of fontname and of the state of the fontconfig configuration: its version, configuration files and font directories
+static uint64_t fontset_config_hash(const char *fontname) {
+	uint64_t h = fnv1a(FNV1A_INIT, fontname, strlen(fontname) + 1);
+	int version = FcGetVersion();
+	h = fnv1a(h, &version, sizeof(int));
+	h = fnv1a_files(h, FcConfigGetConfigFiles(NULL));
+	h = fnv1a_files(h, FcConfigGetFontDirs(NULL));
+	return h;
+}
+
+static char *fontset_cache_path(const char *fontname) {
+	char *xdg_config_home = getenv("XDG_CONFIG_HOME");
+	uint64_t key = fnv1a(FNV1A_INIT, fontname, strlen(fontname));
+	char *r;
+
+	if (xdg_config_home != NULL) {
+		asprintf(&r, "%s/teddy/fontset-%016llx", xdg_config_home, (unsigned long long)key);
+	} else {
+		asprintf(&r, "%s/.config/teddy/fontset-%016llx", getenv("HOME"), (unsigned long long)key);
+	}
+	alloc_assert(r);
+
+	return r;
+}
+
+// maps the cache file of fontname and loads the fonts it lists, fails if it was written with a different configuration
+static bool fontset_cache_load(teddy_fontset_t *fontset, const char *fontname, uint64_t config_hash) {
+	char *path = fontset_cache_path(fontname);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0) return false;
+
+	struct stat s;
+	if ((fstat(fd, &s) != 0) || (s.st_size < sizeof(struct fontset_cache_header) + FONTSET_MAP_SIZE)) {
+		close(fd);
+		return false;
+	}
+
+	char *cache = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache == MAP_FAILED) return false;
+
+	struct fontset_cache_header *header = (struct fontset_cache_header *)cache;
+	size_t fonts_start = sizeof(struct fontset_cache_header) + FONTSET_MAP_SIZE;
+
+	if ((memcmp(header->magic, FONTSET_CACHE_MAGIC, sizeof(header->magic)) != 0) || (header->config_hash != config_hash) || (header->count >= 0xff) || (fonts_start + header->fonts_size != s.st_size)) {
+		munmap(cache, s.st_size);
+		return false;
+	}
+
+	size_t p = fonts_start;
+	for (int i = 0; i < header->count; ++i) {
+		struct fontset_cache_font f;
+		if (p + sizeof(f) > s.st_size) break;
+		memcpy(&f, cache + p, sizeof(f));
+		p += sizeof(f);
+
+		if ((p + f.pathlen > s.st_size) || (f.pathlen == 0) || (cache[p + f.pathlen - 1] != '\0')) break;
+		if (!teddy_font_init_ex(fontset->fonts + fontset->count, cache + p, f.size, f.index)) break;
+		p += f.pathlen;
+		++(fontset->count);
+	}
+
+	if (fontset->count != header->count) {
+		// a font went away, the map is no longer right
+		for (int i = 0; i < fontset->count; ++i) {
+			teddy_font_free(fontset->fonts + i);
+		}
+		fontset->count = 0;
+		munmap(cache, s.st_size);
+		return false;
+	}
+
+	fontset->cache = cache;
+	fontset->cache_len = s.st_size;
+	fontset->map = (uint8_t *)(cache + sizeof(struct fontset_cache_header));
+	return true;
+}
+
+static void fontset_cache_save(teddy_fontset_t *fontset, const char *fontname, uint64_t config_hash, char **files, double *sizes, int *indexes) {
+	char *path = fontset_cache_path(fontname);
+	char *tmppath;
+	asprintf(&tmppath, "%s~", path);
+	alloc_assert(tmppath);
+
+	struct fontset_cache_header header;
+	memcpy(header.magic, FONTSET_CACHE_MAGIC, sizeof(header.magic));
+	header.config_hash = config_hash;
+	header.count = fontset->count;
+	header.fonts_size = 0;
+	for (int i = 0; i < fontset->count; ++i) {
+		header.fonts_size += sizeof(struct fontset_cache_font) + strlen(files[i]) + 1;
+	}
+
+	FILE *out = fopen(tmppath, "w");
+	if (out == NULL) {
+		perror("Can't save fontset cache");
+	} else {
+		fwrite(&header, sizeof(header), 1, out);
+		fwrite(fontset->map, sizeof(uint8_t), FONTSET_MAP_SIZE, out);
+		for (int i = 0; i < fontset->count; ++i) {
+			struct fontset_cache_font f;
+			memset(&f, 0, sizeof(f));
+			f.size = sizes[i];
+			f.index = indexes[i];
+			f.pathlen = strlen(files[i]) + 1;
+			fwrite(&f, sizeof(f), 1, out);
+			fwrite(files[i], sizeof(char), f.pathlen, out);
+		}
+		if (fclose(out) == 0) rename(tmppath, path);
+	}
+
+	free(tmppath);
+	free(path);
 }
 
 static teddy_fontset_t *fontset_new(const char *fontname) {
@@ -129,13 +373,19 @@ static teddy_fontset_t *fontset_new(const char *fontname) {
 	alloc_assert(fontset);
 
 	fontset->count = 0;
+	fontset->nlocked = 0;
+	fontset->map = NULL;
+	fontset->cache = NULL;
 
 	for (int i = 0; i <= 0xffff; ++i) {
-		fontset->map[i] = 0xff;
+		fontset->glyph_index[i] = GLYPH_UNKNOWN;
 	}
 
 	//printf("Creating %s\n", fontname);
 
+	uint64_t config_hash = fontset_config_hash(fontname);
+	if (fontset_cache_load(fontset, fontname, config_hash)) return fontset;
+
 	FcResult result;
 
 	FcPattern *pat = FcNameParse((const FcChar8 *)fontname);
@@ -160,6 +410,12 @@ static teddy_fontset_t *fontset_new(const char *fontname) {
 
 	int acc_count = 0;
 
+	// charsets and patterns of the fonts used, the charsets belong to set
+	FcCharSet *csets[0xff];
+	char *files[0xff];
+	double sizes[0xff];
+	int indexes[0xff];
+
 	for (int i = 0; i < set->nfont; ++i) {
 		FcPattern *match = set->fonts[i];
 
@@ -178,9 +434,11 @@ static teddy_fontset_t *fontset_new(const char *fontname) {
 		}
 
 		if (c > limit) {
-			if (!fontconfig_init_from_pattern(match, fontset->fonts+fontset->count, size)) continue;
+			int n = fontset->count;
+			fontconfig_pattern_file(match, size, files + n, sizes + n, indexes + n);
+			if (!teddy_font_init_ex(fontset->fonts + n, files[n], sizes[n], indexes[n])) continue;
 
-			match_write_coverage(fontset, fontset->count, cset, accumulator);
+			csets[n] = cset;
 			++(fontset->count);
 
 			FcCharSetMerge(accumulator, cset, NULL);
@@ -190,25 +448,38 @@ static teddy_fontset_t *fontset_new(const char *fontname) {
 		}
 	}
 
+	fontset_coverage(fontset, csets);
+	fontset_cache_save(fontset, fontname, config_hash, files, sizes, indexes);
+
 	//printf("Loaded faces for %s: %d\n", fontname, fontset->count);
 
+	FcCharSetDestroy(accumulator);
+	FcFontSetDestroy(set);
+	FcPatternDestroy(pat);
+
 	return fontset;
 }
 
-teddy_fontset_t *foundry_lookup(const char *name, bool lock) {
+teddy_fontset_t *foundry_lookup(const char *name) {
 	teddy_fontset_t *r = g_hash_table_lookup(fontset_table, name);
 	if (!r) {
 		r = fontset_new(name);
 		g_hash_table_insert(fontset_table, (char *)name, r);
 	}
 
-	if (lock) {
-		for (int i = 0; i < r->count; ++i) {
-			r->fonts[i].scaled_face = cairo_ft_scaled_font_lock_face(r->fonts[i].cairofont);
-		}
+	return r;
+}
+
+// locks the face of font fontidx of fontset the first time it is needed
+static FT_Face font_face(teddy_fontset_t *fontset, int fontidx) {
+	teddy_font_t *font = fontset->fonts + fontidx;
+	for (int i = 0; i < fontset->nlocked; ++i) {
+		if (fontset->locked[i] == fontidx) return font->scaled_face;
 	}
 
-	return r;
+	font->scaled_face = cairo_ft_scaled_font_lock_face(font->cairofont);
+	fontset->locked[(fontset->nlocked)++] = fontidx;
+	return font->scaled_face;
 }
 
 int fontset_fontidx(teddy_fontset_t *fontset, uint32_t code) {
@@ -218,47 +489,85 @@ int fontset_fontidx(teddy_fontset_t *fontset, uint32_t code) {
 }
 
 FT_UInt fontset_glyph_index(teddy_fontset_t *fontset, int fondidx, uint32_t code) {
-	return FT_Get_Char_Index(fontset->fonts[fondidx].scaled_face, code);
+	if ((code > 0xffff) || (fondidx != fontset_fontidx(fontset, code))) {
+		return FT_Get_Char_Index(font_face(fontset, fondidx), code);
+	}
+
+	FT_UInt *r = fontset->glyph_index + code;
+	if (*r == GLYPH_UNKNOWN) *r = FT_Get_Char_Index(font_face(fontset, fondidx), code);
+	return *r;
 }
 
-double fontset_get_kerning(teddy_fontset_t *fontset, int fontidx, FT_UInt previous_glyph, FT_UInt glyph) {
-	if (FT_HAS_KERNING(fontset->fonts[fontidx].scaled_face) && previous_glyph && glyph) {
-		FT_Vector delta;
+static double font_kerning(teddy_fontset_t *fontset, int fontidx, FT_UInt previous_glyph, FT_UInt glyph) {
+	FT_Vector delta;
+	FT_Get_Kerning(font_face(fontset, fontidx), previous_glyph, glyph, FT_KERNING_DEFAULT, &delta);
+	return delta.x >> 6;
+}
 
-		FT_Get_Kerning(fontset->fonts[fontidx].scaled_face, previous_glyph, glyph, FT_KERNING_DEFAULT, &delta);
+double fontset_get_kerning(teddy_fontset_t *fontset, int fontidx, uint32_t previous_code, FT_UInt previous_glyph, uint32_t code, FT_UInt glyph) {
+	teddy_font_t *font = fontset->fonts + fontidx;
 
-		return delta.x >> 6;
-	} else {
-		return 0.0;
+	if (!FT_HAS_KERNING(font->face) || !previous_glyph || !glyph) return 0.0;
+
+	if ((previous_code >= KERNING_CACHE_SIZE) || (code >= KERNING_CACHE_SIZE)) {
+		return font_kerning(fontset, fontidx, previous_glyph, glyph);
+	}
+
+	if (font->kerning == NULL) {
+		font->kerning = malloc(sizeof(double) * KERNING_CACHE_SIZE * KERNING_CACHE_SIZE);
+		alloc_assert(font->kerning);
+		for (int i = 0; i < KERNING_CACHE_SIZE * KERNING_CACHE_SIZE; ++i) {
+			font->kerning[i] = NAN;
+		}
 	}
+
+	double *r = font->kerning + previous_code * KERNING_CACHE_SIZE + code;
+	if (isnan(*r)) *r = font_kerning(fontset, fontidx, previous_glyph, glyph);
+	return *r;
 }
 
 void fontset_underline_info(teddy_fontset_t *fontset, int fontidx, double *underline_thickness, double *underline_position) {
-	FT_Face *f = &(fontset->fonts[fontidx].scaled_face);
-	double y_scale = (double)((*f)->size->metrics.y_scale) / 65535;
+	FT_Face f = font_face(fontset, fontidx);
+	double y_scale = (double)(f->size->metrics.y_scale) / 65535;
 
-	//printf("underline position %d thickness %d y_scale %ld\n", (*f)->underline_position, (*f)->underline_thickness, (*f)->size->metrics.y_scale);
+	//printf("underline position %d thickness %d y_scale %ld\n", f->underline_position, f->underline_thickness, f->size->metrics.y_scale);
 
-	*underline_thickness = floor(((*f)->underline_thickness * y_scale) / 64);
-	*underline_position = floor(((*f)->underline_position * y_scale) / 64);
+	*underline_thickness = floor((f->underline_thickness * y_scale) / 64);
+	*underline_position = floor((f->underline_position * y_scale) / 64);
 }
 
 double fontset_x_advance(teddy_fontset_t *fontset, int fontidx, FT_UInt glyph) {
+	teddy_font_t *font = fontset->fonts + fontidx;
+	FT_Long nglyphs = font->face->num_glyphs;
+
+	if ((font->advances == NULL) && (nglyphs > 0)) {
+		font->advances = malloc(sizeof(double) * nglyphs);
+		alloc_assert(font->advances);
+		for (FT_Long i = 0; i < nglyphs; ++i) {
+			font->advances[i] = NAN;
+		}
+	}
+
+	if ((glyph < nglyphs) && !isnan(font->advances[glyph])) return font->advances[glyph];
+
 	cairo_text_extents_t extents;
 	cairo_glyph_t g;
 	g.index = glyph;
 	g.x = 0.0;
 	g.y = 0.0;
 
-	cairo_scaled_font_glyph_extents(fontset->fonts[fontidx].cairofont, &g, 1, &extents);
+	cairo_scaled_font_glyph_extents(font->cairofont, &g, 1, &extents);
+
+	if (glyph < nglyphs) font->advances[glyph] = extents.x_advance;
 
 	return extents.x_advance;
 }
 
 void foundry_release(teddy_fontset_t *fontset) {
-	for (int i = 0; i < fontset->count; ++i) {
-		cairo_ft_scaled_font_unlock_face(fontset->fonts[i].cairofont);
+	for (int i = 0; i < fontset->nlocked; ++i) {
+		cairo_ft_scaled_font_unlock_face(fontset->fonts[fontset->locked[i]].cairofont);
 	}
+	fontset->nlocked = 0;
 }
 
 cairo_scaled_font_t *fontset_get_cairofont(teddy_fontset_t *fontset, int fontidx) {
@@ -266,7 +575,7 @@ cairo_scaled_font_t *fontset_get_cairofont(teddy_fontset_t *fontset, int fontidx
 }
 
 cairo_scaled_font_t *fontset_get_cairofont_by_name(const char *name, int fontidx) {
-	teddy_fontset_t *fontset = foundry_lookup(name, false);
+	teddy_fontset_t *fontset = foundry_lookup(name);
 	return fontset_get_cairofont(fontset, fontidx);
 }
 
@@ -14,12 +14,14 @@ typedef struct _teddy_fontset_t teddy_fontset_t;
 
 
 void foundry_init(void);
-teddy_fontset_t *foundry_lookup(const char *name, bool lock);
+teddy_fontset_t *foundry_lookup(const char *name);
+/* Faces of the fonts of a fontset are locked the first time they are needed, releasing the fontset unlocks them */
 void foundry_release(teddy_fontset_t *font);
 
+/* Glyph lookups, kerning and advances are cached in fontset. Kerning is cached for pairs of ASCII characters, code and previous_code are the characters passed to fontset_glyph_index */
 int fontset_fontidx(teddy_fontset_t *fontset, uint32_t code);
 FT_UInt fontset_glyph_index(teddy_fontset_t *fontset, int fontidx, uint32_t code);
-double fontset_get_kerning(teddy_fontset_t *fontset, int fontidx, FT_UInt previous_glyph, FT_UInt glyph);
+double fontset_get_kerning(teddy_fontset_t *fontset, int fontidx, uint32_t previous_code, FT_UInt previous_glyph, uint32_t code, FT_UInt glyph);
 double fontset_x_advance(teddy_fontset_t *fontset, int fontidx, FT_UInt glyph);
 
 cairo_scaled_font_t *fontset_get_cairofont(teddy_fontset_t *fontset, int fontidx);
@@ -0,0 +1,219 @@
+#include "fuzzy.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "global.h"
+
+// only this many characters of a candidate are looked at
+#define FUZZY_MAX_LEN 1024
+// candidates are split between threads only if every thread gets at least this many
+#define FUZZY_SHARD_MIN 4096
+
+#define SCORE_MATCH 16
+#define BONUS_START 10
+#define BONUS_SEPARATOR 9
+#define BONUS_WORD 8
+#define BONUS_CAMEL 7
+#define BONUS_CONSECUTIVE 10
+#define PENALTY_GAP_START 5
+#define PENALTY_GAP_EXTEND 1
+
+static inline bool valid(int score) {
+	return score > FUZZY_NO_MATCH/2;
+}
+
+static int bonus(const char *candidate, int j) {
+	if (j == 0) return BONUS_START;
+
+	unsigned char p = candidate[j-1], c = candidate[j];
+	if (p == '/') return BONUS_SEPARATOR;
+	if ((p == '_') || (p == '-') || (p == '.') || (p == ' ')) return BONUS_WORD;
+	if (islower(p) && isupper(c)) return BONUS_CAMEL;
+	return 0;
+}
+
+static bool is_subsequence(const char *candidate, int len, const char *query) {
+	int j = 0;
+	for (; *query != '\0'; ++query) {
+		int q = tolower((unsigned char)*query);
+		while ((j < len) && (tolower((unsigned char)candidate[j]) != q)) ++j;
+		if (j >= len) return false;
+		++j;
+	}
+	return true;
+}
+
+/* cur[j] is the best score of a match of query[0..i] that matches query[i] with candidate[j], it's computed from the previous row either continuing the match at j-1 or after a gap */
+int fuzzy_score(const char *candidate, const char *query) {
+	int m = strlen(query);
+	if (m == 0) return 0;
+
+	int len = strnlen(candidate, FUZZY_MAX_LEN);
+	if ((m > len) || !is_subsequence(candidate, len, query)) return FUZZY_NO_MATCH;
+
+	int rows[2][FUZZY_MAX_LEN];
+	int *prev = rows[0], *cur = rows[1];
+
+	for (int i = 0; i < m; ++i) {
+		int q = tolower((unsigned char)query[i]);
+		// best score of prev[k] for k <= j-2, after paying for the gap up to j
+		int gap = FUZZY_NO_MATCH;
+
+		for (int j = 0; j < len; ++j) {
+			int s = FUZZY_NO_MATCH;
+
+			if (tolower((unsigned char)candidate[j]) == q) {
+				if (i == 0) {
+					s = SCORE_MATCH + bonus(candidate, j);
+				} else if (j > 0) {
+					int best = MAX(gap, prev[j-1] + BONUS_CONSECUTIVE);
+					if (valid(best)) s = best + SCORE_MATCH + bonus(candidate, j);
+				}
+			}
+
+			if ((i > 0) && (j > 0)) gap = MAX(gap - PENALTY_GAP_EXTEND, prev[j-1] - PENALTY_GAP_START);
+
+			cur[j] = s;
+		}
+
+		int *t = prev;
+		prev = cur;
+		cur = t;
+	}
+
+	int r = FUZZY_NO_MATCH;
+	for (int j = 0; j < len; ++j) {
+		r = MAX(r, prev[j]);
+	}
+
+	return valid(r) ? r : FUZZY_NO_MATCH;
+}
+
+static bool better(const struct fuzzy_result *a, const struct fuzzy_result *b) {
+	if (a->score != b->score) return a->score > b->score;
+	if (a->len != b->len) return a->len < b->len;
+	return a->idx < b->idx;
+}
+
+static int fuzzy_result_cmp(const void *a, const void *b) {
+	return better(a, b) ? -1 : (better(b, a) ? 1 : 0);
+}
+
+struct fuzzy_shard {
+	const char *query;
+	int *v;
+	int start, end;
+	int kept; // matching candidates, moved to v[start..start+kept)
+	fuzzy_candidate_fn *candidate;
+	void *arg;
+
+	// the best k matches of the shard, the worst one is at the top
+	struct fuzzy_result *heap;
+	int nheap, k;
+};
+
+static void heap_push(struct fuzzy_shard *sh, struct fuzzy_result *r) {
+	struct fuzzy_result *h = sh->heap;
+
+	if (sh->nheap < sh->k) {
+		int i = sh->nheap++;
+		for (; i > 0 && better(&h[(i-1)/2], r); i = (i-1)/2) {
+			h[i] = h[(i-1)/2];
+		}
+		h[i] = *r;
+		return;
+	}
+
+	if ((sh->k == 0) || !better(r, &h[0])) return;
+
+	int i = 0;
+	for (;;) {
+		int c = 2*i+1;
+		if (c >= sh->nheap) break;
+		if ((c+1 < sh->nheap) && better(&h[c], &h[c+1])) ++c;
+		if (!better(r, &h[c])) break;
+		h[i] = h[c];
+		i = c;
+	}
+	h[i] = *r;
+}
+
+static void *fuzzy_shard_thread(void *varg) {
+	struct fuzzy_shard *sh = (struct fuzzy_shard *)varg;
+
+	for (int i = sh->start; i < sh->end; ++i) {
+		int idx = sh->v[i];
+		const char *c = sh->candidate(sh->arg, idx);
+		if (c == NULL) continue;
+		int score = fuzzy_score(c, sh->query);
+		if (score == FUZZY_NO_MATCH) continue;
+
+		sh->v[sh->start + sh->kept++] = idx;
+		struct fuzzy_result r = { idx, score, strlen(c) };
+		heap_push(sh, &r);
+	}
+
+	return NULL;
+}
+
+int fuzzy_rank(const char *query, int *v, int *n, fuzzy_candidate_fn *candidate, void *arg, int k, struct fuzzy_result *best) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nshards = (int)MAX(MIN(ncpu, *n / FUZZY_SHARD_MIN), 1);
+
+	struct fuzzy_shard *shards = malloc(sizeof(struct fuzzy_shard) * nshards);
+	alloc_assert(shards);
+	pthread_t *threads = malloc(sizeof(pthread_t) * nshards);
+	alloc_assert(threads);
+	bool *started = malloc(sizeof(bool) * nshards);
+	alloc_assert(started);
+	struct fuzzy_result *heaps = malloc(sizeof(struct fuzzy_result) * MAX(k, 1) * nshards);
+	alloc_assert(heaps);
+
+	for (int s = 0; s < nshards; ++s) {
+		struct fuzzy_shard *sh = shards + s;
+		sh->query = query;
+		sh->v = v;
+		sh->start = (int)((long)*n * s / nshards);
+		sh->end = (int)((long)*n * (s+1) / nshards);
+		sh->kept = 0;
+		sh->candidate = candidate;
+		sh->arg = arg;
+		sh->heap = heaps + s * MAX(k, 1);
+		sh->nheap = 0;
+		sh->k = k;
+	}
+
+	// the first shard is done by this thread
+	for (int s = 1; s < nshards; ++s) {
+		started[s] = (pthread_create(threads + s, NULL, fuzzy_shard_thread, shards + s) == 0);
+		if (!started[s]) fuzzy_shard_thread(shards + s);
+	}
+	fuzzy_shard_thread(shards);
+
+	int m = shards[0].nheap;
+	*n = shards[0].kept;
+	for (int s = 1; s < nshards; ++s) {
+		if (started[s]) pthread_join(threads[s], NULL);
+
+		memmove(v + *n, v + shards[s].start, sizeof(int) * shards[s].kept);
+		*n += shards[s].kept;
+
+		memmove(heaps + m, shards[s].heap, sizeof(struct fuzzy_result) * shards[s].nheap);
+		m += shards[s].nheap;
+	}
+
+	qsort(heaps, m, sizeof(struct fuzzy_result), fuzzy_result_cmp);
+	m = MIN(m, k);
+	memcpy(best, heaps, sizeof(struct fuzzy_result) * m);
+
+	free(heaps);
+	free(started);
+	free(threads);
+	free(shards);
+
+	return m;
+}
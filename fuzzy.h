@@ -0,0 +1,24 @@
+#ifndef __FUZZY_H__
+#define __FUZZY_H__
+
+/* Fuzzy matching of a query against candidate strings: the characters of the query must appear in the candidate in order (ignoring case), matches at the start of words and consecutive matches score more, gaps between matches cost points */
+
+#define FUZZY_NO_MATCH (-1000000)
+
+struct fuzzy_result {
+	int idx;
+	int score;
+	int len;
+};
+
+typedef const char *fuzzy_candidate_fn(void *arg, int idx);
+
+// returns the score of candidate, FUZZY_NO_MATCH if query isn't a subsequence of it
+int fuzzy_score(const char *candidate, const char *query);
+
+/* Scores the candidates v[0..*n) against query, splitting them in shards between one thread per core.
+   Candidates that don't match are removed from v (the order of the others is kept) and *n updated.
+   The best k matches are stored in best, sorted, and their number is returned. Equal scores are ordered by the length of the candidate and then by index */
+int fuzzy_rank(const char *query, int *v, int *n, fuzzy_candidate_fn *candidate, void *arg, int k, struct fuzzy_result *best);
+
+#endif
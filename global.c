@@ -8,6 +8,7 @@
 #include "buffers.h"
 #include "ipc.h"
 #include "mq.h"
+#include "journal.h"
 
 #define MAX_GLOBAL_EVENT_WATCHERS 20
 
@@ -224,6 +225,23 @@ void utf32_to_utf8(uint32_t code, char **r, int *cap, int *allocated) {
 	return;
 }
 
+int utf32_to_utf8_buf(uint32_t code, char *dst) {
+	int first_byte_pad, first_byte_mask, inc;
+
+	utf32_to_utf8_sizing(code, &first_byte_pad, &first_byte_mask, &inc);
+
+	if (dst == NULL) return inc + 1;
+
+	for (int i = inc; i > 0; --i) {
+		dst[i] = ((uint8_t)code & 0x3f) + 0x80;
+		code >>= 6;
+	}
+
+	dst[0] = ((uint8_t)code & first_byte_mask) + first_byte_pad;
+
+	return inc + 1;
+}
+
 bool inside_allocation(double x, double y, GtkAllocation *allocation) {
 	return (x >= allocation->x)
 		&& (x <= allocation->x + allocation->width)
@@ -287,7 +305,7 @@ uint32_t utf8_to_utf32(const char *text, int *src, int len, bool *valid) {
 	/*printf("   Next char: %02x (%02x)\n", (uint8_t)text[src], (uint8_t)text[src] & 0xC0);*/
 
 	int i = 0;
-	for (; (((uint8_t)text[*src] & 0xC0) == 0x80) && (*src < len); ++(*src)) {
+	for (; (*src < len) && (((uint8_t)text[*src] & 0xC0) == 0x80); ++(*src)) {
 		code <<= 6;
 		code += (text[*src] & 0x3F);
 		++i;
@@ -520,29 +538,34 @@ char *session_directory(void) {
 	return sessiondir;
 }
 
-static char *tied_session_file(void) {
-	if (tied_session == NULL) return NULL;
-
+char *tied_session_file_ext(const char *session, const char *ext) {
 	char *sessionfile;
 	char *xdg_config_home = getenv("XDG_CONFIG_HOME");
 	if (xdg_config_home != NULL) {
-		asprintf(&sessionfile, "%s/%s.session", xdg_config_home, tied_session);
+		asprintf(&sessionfile, "%s/%s.%s", xdg_config_home, session, ext);
 	} else {
-		asprintf(&sessionfile, "%s/.config/teddy/%s.session", getenv("HOME"), tied_session);
+		asprintf(&sessionfile, "%s/.config/teddy/%s.%s", getenv("HOME"), session, ext);
 	}
 	alloc_assert(sessionfile);
 
 	return sessionfile;
 }
 
+static char *tied_session_file(void) {
+	if (tied_session == NULL) return NULL;
+	return tied_session_file_ext(tied_session, "session");
+}
+
 void save_tied_session(void) {
 	char *sessionfile = tied_session_file();
 	if (sessionfile == NULL) return;
 
 	ipc_link_to(tied_session);
+	journal_open(tied_session, true);
 
 	FILE *f = fopen(sessionfile, "w");
 	if (f == NULL) {
+		journal_open(NULL, false);
 		free(tied_session);
 		tied_session = NULL;
 		quick_message("Session error", "Could not create file");
@@ -621,10 +644,13 @@ void load_tied_session(void) {
 	if (sessionfile == NULL) return;
 
 	ipc_link_to(tied_session);
+	// before the session's files are opened, so that their undo history is restored
+	journal_open(tied_session, false);
 
 	const char *argv[] = { "teddy_intl::loadsession", sessionfile };
 	if (interp_eval_command(NULL, NULL, 2, argv) == NULL) {
 		quick_message("Session error", "Could not load tied session file");
+		journal_open(NULL, false);
 		free(tied_session);
 		tied_session = NULL;
 	}
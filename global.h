@@ -58,6 +58,8 @@ bool inside_allocation(double x, double y, GtkAllocation *allocation);
 uint8_t utf8_first_byte_processing(uint8_t ch);
 int utf8_excision(char *buf, int n);
 void utf32_to_utf8(uint32_t code, char **r, int *cap, int *allocated);
+// writes the encoding of code to dst (if not NULL), returns its length
+int utf32_to_utf8_buf(uint32_t code, char *dst);
 char *utf32_to_utf8_string(uint32_t *text, int len);
 uint32_t utf8_to_utf32(const char *text, int *src, int len, bool *valid);
 uint32_t *utf8_to_utf32_string(const char *text, int *dstlen);
@@ -71,6 +73,8 @@ void set_gdk_color_cfg(config_t *config, int name, GdkColor *c);
 void gtk_widget_modify_bg_all(GtkWidget *w, GdkColor *c);
 void gtk_widget_like_editor(config_t *config, GtkWidget *w);
 
+// path of the file of session with extension ext, in the configuration directory
+char *tied_session_file_ext(const char *session, const char *ext);
 void save_tied_session(void);
 void load_tied_session(void);
 char *session_directory(void);
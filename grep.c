@@ -0,0 +1,527 @@
+#include "grep.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <wchar.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <tre/tre.h>
+
+#include "global.h"
+#include "buffers.h"
+#include "editor.h"
+#include "interp.h"
+
+// files with a NUL character in this many bytes at the start are considered binary and skipped
+#define GREP_BINARY_CHECK 8000
+// matching lines are cut to this many characters in the output
+#define GREP_LINE_MAX 200
+// directories deeper than this aren't searched
+#define GREP_MAX_DEPTH 64
+#define GREP_FLUSH_INTERVAL 16
+/* Files smaller than this are read, bigger ones are mapped.
+   A mapped file that is truncated while it is searched (for example by a build) kills the editor with SIGBUS, reading keeps that risk to big files */
+#define GREP_MMAP_MIN (1024 * 1024)
+
+struct grep_line {
+	wchar_t *text;
+	int len, cap;
+};
+
+/* A search: the workers take items (buffers or files) in order and store the output for each one in outputs, the main thread copies them to the +grep+ buffer in the same order.
+   When searching a directory the files are collected by a walker thread while the workers search them */
+struct grep_run {
+	regex_t re;
+	buffer_t *output;
+
+	buffer_t **buffers; // items when searching buffers
+	char *dir;
+
+	bool cancelled; // accessed atomically
+
+	pthread_mutex_t mutex; // protects everything below, except threads
+	pthread_cond_t more; // signalled when paths are added or the walk ends
+	char **paths; // items when searching a directory, relative to dir
+	int n, cap;
+	int next; // next item to search
+	bool walking; // more paths can be added
+	char **outputs; // NULL until the corresponding item is searched
+	int matches;
+	int running; // workers and walker still running
+
+	pthread_t *threads;
+	int nthreads;
+	int flushed; // items already copied to the output buffer
+};
+
+// directory search running in the background, if any
+static struct grep_run *grep_current = NULL;
+
+static void grep_line_push(struct grep_line *line, uint32_t code) {
+	if (line->len >= line->cap) {
+		line->cap = MAX(2 * line->cap, 256);
+		line->text = realloc(line->text, sizeof(wchar_t) * line->cap);
+		alloc_assert(line->text);
+	}
+	line->text[line->len++] = code;
+}
+
+// matches line, if it matches appends it to out and returns 1
+static int grep_match_line(struct grep_run *run, const char *path, int lineno, struct grep_line *line, GString *out) {
+	regmatch_t pmatch[1];
+	if (tre_regwnexec(&(run->re), line->text, line->len, 1, pmatch, 0) != REG_OK) return 0;
+
+	g_string_append_printf(out, "%s:%d:%d: ", path, lineno, (int)pmatch[0].rm_so + 1);
+	int len = MIN(line->len, GREP_LINE_MAX);
+	for (int i = 0; i < len; ++i) {
+		g_string_append_unichar(out, line->text[i]);
+	}
+	if (len < line->len) g_string_append(out, "...");
+	g_string_append_c(out, '\n');
+
+	return 1;
+}
+
+// searches the text of buffer, reading the two halves of the gap buffer with the read lock held
+static int grep_buffer(struct grep_run *run, buffer_t *buffer, struct grep_line *line, GString *out) {
+	int count = 0, lineno = 1;
+	line->len = 0;
+
+	pthread_rwlock_rdlock(&(buffer->rwlock));
+
+	my_glyph_info_t *halves[2][2] = {
+		{ buffer->buf, buffer->buf + buffer->gap },
+		{ buffer->buf + buffer->gap + buffer->gapsz, buffer->buf + buffer->size },
+	};
+
+	for (int h = 0; h < 2; ++h) {
+		for (my_glyph_info_t *g = halves[h][0]; g < halves[h][1]; ++g) {
+			if (g->code == '\n') {
+				count += grep_match_line(run, buffer->path, lineno, line, out);
+				line->len = 0;
+				++lineno;
+			} else {
+				grep_line_push(line, g->code);
+			}
+		}
+	}
+
+	if (line->len > 0) count += grep_match_line(run, buffer->path, lineno, line, out);
+
+	pthread_rwlock_unlock(&(buffer->rwlock));
+	return count;
+}
+
+// searches a file, reading it or mapping it in memory (files of 2GB or more are skipped)
+static int grep_file(struct grep_run *run, const char *path, struct grep_line *line, GString *out) {
+	char *fullpath;
+	asprintf(&fullpath, "%s/%s", run->dir, path);
+	alloc_assert(fullpath);
+	int fd = open(fullpath, O_RDONLY);
+	free(fullpath);
+	if (fd < 0) return 0;
+
+	struct stat s;
+	if ((fstat(fd, &s) < 0) || (s.st_size <= 0) || (s.st_size >= INT_MAX)) {
+		close(fd);
+		return 0;
+	}
+
+	int len = s.st_size;
+	bool mapped = (len >= GREP_MMAP_MIN);
+	char *text;
+
+	if (mapped) {
+		text = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (text == MAP_FAILED) return 0;
+		madvise(text, len, MADV_SEQUENTIAL);
+	} else {
+		text = malloc(len);
+		alloc_assert(text);
+		int n = 0;
+		while (n < len) {
+			ssize_t r = read(fd, text + n, len - n);
+			if (r <= 0) break;
+			n += r;
+		}
+		close(fd);
+		len = n;
+	}
+
+	int count = 0;
+
+	if (memchr(text, '\0', MIN(len, GREP_BINARY_CHECK)) == NULL) {
+		int lineno = 1;
+		line->len = 0;
+
+		for (int i = 0; i < len; ) {
+			if (text[i] == '\n') {
+				count += grep_match_line(run, path, lineno, line, out);
+				line->len = 0;
+				++lineno;
+				++i;
+			} else {
+				bool valid = true;
+				grep_line_push(line, utf8_to_utf32(text, &i, len, &valid));
+			}
+		}
+
+		if (line->len > 0) count += grep_match_line(run, path, lineno, line, out);
+	}
+
+	if (mapped) {
+		munmap(text, len);
+	} else {
+		free(text);
+	}
+	return count;
+}
+
+static void *grep_worker_thread(void *varg) {
+	struct grep_run *run = (struct grep_run *)varg;
+	struct grep_line line = { NULL, 0, 0 };
+
+	while (!__atomic_load_n(&(run->cancelled), __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&(run->mutex));
+		while ((run->next >= run->n) && run->walking) {
+			pthread_cond_wait(&(run->more), &(run->mutex));
+		}
+		int i = run->next;
+		if (i < run->n) ++(run->next);
+		const char *path = (run->paths != NULL) && (i < run->n) ? run->paths[i] : NULL;
+		pthread_mutex_unlock(&(run->mutex));
+
+		if (i >= run->n) break;
+
+		GString *out = g_string_new("");
+		int count = (run->buffers != NULL) ? grep_buffer(run, run->buffers[i], &line, out) : grep_file(run, path, &line, out);
+
+		pthread_mutex_lock(&(run->mutex));
+		run->outputs[i] = g_string_free(out, FALSE);
+		run->matches += count;
+		pthread_mutex_unlock(&(run->mutex));
+	}
+
+	free(line.text);
+
+	pthread_mutex_lock(&(run->mutex));
+	--(run->running);
+	pthread_mutex_unlock(&(run->mutex));
+
+	return NULL;
+}
+
+static void grep_add_path(struct grep_run *run, char *path) {
+	pthread_mutex_lock(&(run->mutex));
+	if (run->n >= run->cap) {
+		int cap = MAX(2 * run->cap, 64);
+		run->paths = realloc(run->paths, sizeof(char *) * cap);
+		alloc_assert(run->paths);
+		run->outputs = realloc(run->outputs, sizeof(char *) * cap);
+		alloc_assert(run->outputs);
+		memset(run->outputs + run->cap, 0, sizeof(char *) * (cap - run->cap));
+		run->cap = cap;
+	}
+	run->paths[run->n++] = path;
+	pthread_cond_signal(&(run->more));
+	pthread_mutex_unlock(&(run->mutex));
+}
+
+// collects the regular files under dir/rel, skipping hidden files and directories
+static void grep_walk(struct grep_run *run, const char *rel, int depth) {
+	if (depth > GREP_MAX_DEPTH) return;
+	if (__atomic_load_n(&(run->cancelled), __ATOMIC_SEQ_CST)) return;
+
+	char *path;
+	if (rel == NULL) {
+		path = strdup(run->dir);
+	} else {
+		asprintf(&path, "%s/%s", run->dir, rel);
+	}
+	alloc_assert(path);
+	DIR *d = opendir(path);
+	free(path);
+	if (d == NULL) return;
+
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.') continue;
+
+		char *child;
+		if (rel == NULL) {
+			child = strdup(e->d_name);
+		} else {
+			asprintf(&child, "%s/%s", rel, e->d_name);
+		}
+		alloc_assert(child);
+
+		unsigned char type = e->d_type;
+		if (type == DT_UNKNOWN) {
+			char *full;
+			asprintf(&full, "%s/%s", run->dir, child);
+			alloc_assert(full);
+			struct stat s;
+			if (lstat(full, &s) == 0) {
+				if (S_ISDIR(s.st_mode)) type = DT_DIR;
+				else if (S_ISREG(s.st_mode)) type = DT_REG;
+			}
+			free(full);
+		}
+
+		if (type == DT_DIR) {
+			grep_walk(run, child, depth+1);
+			free(child);
+		} else if (type == DT_REG) {
+			grep_add_path(run, child);
+		} else {
+			free(child);
+		}
+	}
+
+	closedir(d);
+}
+
+static void *grep_walker_thread(void *varg) {
+	struct grep_run *run = (struct grep_run *)varg;
+
+	grep_walk(run, NULL, 0);
+
+	pthread_mutex_lock(&(run->mutex));
+	run->walking = false;
+	--(run->running);
+	pthread_cond_broadcast(&(run->more));
+	pthread_mutex_unlock(&(run->mutex));
+
+	return NULL;
+}
+
+static bool grep_buffer_open(buffer_t *buffer) {
+	for (int i = 0; i < buffers_allocated; ++i) {
+		if (buffers[i] == buffer) return true;
+	}
+	return false;
+}
+
+// appends text at the end of the output buffer without moving its cursor
+static void grep_append(struct grep_run *run, const char *text) {
+	if (text[0] == '\0') return;
+	if (!grep_buffer_open(run->output)) return;
+
+	buffer_t *buffer = run->output;
+	int cursor = buffer->cursor, mark = buffer->mark;
+	buffer->mark = buffer->cursor = BSIZE(buffer);
+	buffer_replace_selection(buffer, text);
+	buffer->cursor = cursor;
+	buffer->mark = mark;
+
+	editor_t *editor;
+	find_editor_for_buffer(buffer, NULL, NULL, &editor);
+	if (editor != NULL) gtk_widget_queue_draw(GTK_WIDGET(editor));
+}
+
+/* Copies to the output buffer the outputs of the items searched so far, stopping at the first one that isn't ready.
+   Returns true when all the workers have terminated */
+static bool grep_flush(struct grep_run *run) {
+	GString *text = g_string_new("");
+
+	pthread_mutex_lock(&(run->mutex));
+	bool done = (run->running == 0);
+	for (; run->flushed < run->n; ++(run->flushed)) {
+		char *o = run->outputs[run->flushed];
+		if (o == NULL) {
+			// a cancelled search never fills the rest
+			if (done) continue;
+			break;
+		}
+		g_string_append(text, o);
+		free(o);
+		run->outputs[run->flushed] = NULL;
+	}
+	pthread_mutex_unlock(&(run->mutex));
+
+	bool cancelled = __atomic_load_n(&(run->cancelled), __ATOMIC_SEQ_CST);
+	if (done && !cancelled) {
+		g_string_append_printf(text, "%d matches in %d %s\n", run->matches, run->n, (run->buffers != NULL) ? "buffers" : "files");
+	}
+
+	if (!cancelled) grep_append(run, text->str);
+	g_string_free(text, TRUE);
+
+	return done;
+}
+
+static void grep_run_free(struct grep_run *run) {
+	for (int i = 0; i < run->nthreads; ++i) {
+		pthread_join(run->threads[i], NULL);
+	}
+	free(run->threads);
+
+	tre_regfree(&(run->re));
+	pthread_mutex_destroy(&(run->mutex));
+	pthread_cond_destroy(&(run->more));
+
+	for (int i = 0; i < run->n; ++i) {
+		free(run->outputs[i]);
+	}
+	free(run->outputs);
+
+	if (run->paths != NULL) {
+		for (int i = 0; i < run->n; ++i) {
+			free(run->paths[i]);
+		}
+		free(run->paths);
+	}
+	free(run->buffers);
+	free(run->dir);
+	free(run);
+}
+
+static gboolean grep_flush_timeout(struct grep_run *run) {
+	if (!grep_flush(run)) return TRUE;
+
+	if (grep_current == run) grep_current = NULL;
+	grep_run_free(run);
+	return FALSE;
+}
+
+// starts the workers, and the walker if searching a directory
+static void grep_start_workers(struct grep_run *run) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = run->walking ? (int)MAX(ncpu, 1) : (int)MIN(MAX(ncpu, 1), MAX(run->n, 1));
+	run->threads = malloc(sizeof(pthread_t) * (nthreads + 1));
+	alloc_assert(run->threads);
+
+	if (run->walking) {
+		run->running = 1;
+		if (pthread_create(run->threads, NULL, grep_walker_thread, run) == 0) {
+			run->nthreads = 1;
+		} else {
+			perror("Can not start grep thread");
+			grep_walker_thread(run);
+		}
+	}
+
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_mutex_lock(&(run->mutex));
+		++(run->running);
+		pthread_mutex_unlock(&(run->mutex));
+
+		if (pthread_create(run->threads + run->nthreads, NULL, grep_worker_thread, run) != 0) {
+			perror("Can not start grep thread");
+			pthread_mutex_lock(&(run->mutex));
+			--(run->running);
+			pthread_mutex_unlock(&(run->mutex));
+			break;
+		}
+		++(run->nthreads);
+	}
+
+	// no thread could be started, search in this thread
+	if (run->nthreads == 0) {
+		++(run->running);
+		grep_worker_thread(run);
+	}
+}
+
+int teddy_grep_command(ClientData client_data, Tcl_Interp *interp, int argc, const char *argv[]) {
+	int flags = REG_EXTENDED | REG_NEWLINE;
+	int i;
+	for (i = 1; i < argc; ++i) {
+		if (argv[i][0] != '-') break;
+		if (strcmp(argv[i], "--") == 0) {
+			++i;
+			break;
+		} else if (strcmp(argv[i], "-literal") == 0) {
+			flags = (flags & ~REG_EXTENDED) | REG_LITERAL;
+		} else if (strcmp(argv[i], "-nocase") == 0) {
+			flags |= REG_ICASE;
+		} else {
+			Tcl_AddErrorInfo(interp, "Unknown option to teddy::grep");
+			return TCL_ERROR;
+		}
+	}
+
+	ARGNUM((i >= argc) || (argc - i > 2), "teddy::grep");
+
+	const char *pattern = argv[i];
+	const char *dir = (i+1 < argc) ? argv[i+1] : NULL;
+
+	struct grep_run *run = malloc(sizeof(struct grep_run));
+	alloc_assert(run);
+	memset(run, 0, sizeof(struct grep_run));
+
+	int r = tre_regcomp(&(run->re), pattern, flags);
+	if (r != REG_OK) {
+		char buf[256];
+		tre_regerror(r, &(run->re), buf, sizeof(buf));
+		Tcl_AddErrorInfo(interp, buf);
+		free(run);
+		return TCL_ERROR;
+	}
+	pthread_mutex_init(&(run->mutex), NULL);
+	pthread_cond_init(&(run->more), NULL);
+
+	// the previous search is discarded by its own timeout
+	if (grep_current != NULL) {
+		__atomic_store_n(&(grep_current->cancelled), true, __ATOMIC_SEQ_CST);
+		grep_current = NULL;
+	}
+
+	run->output = buffers_make("+grep+");
+	if (run->output == NULL) {
+		Tcl_AddErrorInfo(interp, "Can not create +grep+ buffer");
+		grep_run_free(run);
+		return TCL_ERROR;
+	}
+	buffer_aux_clear(run->output);
+
+	if (dir == NULL) {
+		run->buffers = malloc(sizeof(buffer_t *) * MAX(buffers_allocated, 1));
+		alloc_assert(run->buffers);
+		for (int j = 0; j < buffers_allocated; ++j) {
+			buffer_t *buffer = buffers[j];
+			if ((buffer == NULL) || (buffer == run->output) || (buffer->path == NULL)) continue;
+			if ((buffer->path[0] == '+') || (buffer->path[strlen(buffer->path)-1] == '/')) continue;
+			run->buffers[run->n++] = buffer;
+		}
+		run->outputs = malloc(sizeof(char *) * MAX(run->n, 1));
+		alloc_assert(run->outputs);
+		memset(run->outputs, 0, sizeof(char *) * MAX(run->n, 1));
+
+		// buffers are searched synchronously, nothing can change them while this thread waits
+		grep_start_workers(run);
+		for (int j = 0; j < run->nthreads; ++j) {
+			pthread_join(run->threads[j], NULL);
+		}
+		run->nthreads = 0;
+		grep_flush(run);
+		grep_run_free(run);
+	} else {
+		run->dir = realpath(dir, NULL);
+		if (run->dir == NULL) {
+			Tcl_AddErrorInfo(interp, "Can not open directory");
+			grep_run_free(run);
+			return TCL_ERROR;
+		}
+
+		if (run->output->wd != NULL) free(run->output->wd);
+		run->output->wd = strdup(run->dir);
+		alloc_assert(run->output->wd);
+
+		run->walking = true;
+
+		grep_current = run;
+		grep_start_workers(run);
+		g_timeout_add(GREP_FLUSH_INTERVAL, (GSourceFunc)grep_flush_timeout, run);
+	}
+
+	return TCL_OK;
+}
@@ -0,0 +1,10 @@
+#ifndef __GREP_H__
+#define __GREP_H__
+
+#include <tcl.h>
+
+/* Searches all open buffers or a directory tree for a regular expression, the matches are written to the +grep+ buffer as file:line:col links.
+   The search is split between one worker thread per core, directory searches run in the background */
+int teddy_grep_command(ClientData client_data, Tcl_Interp *interp, int argc, const char *argv[]);
+
+#endif
@@ -29,6 +29,8 @@
 #include "tags.h"
 #include "docs.h"
 #include "plumb.h"
+#include "grep.h"
+#include "treint.h"
 
 Tcl_Interp *interp;
 editor_t *the_context_editor = NULL;
@@ -300,8 +302,15 @@ static int teddy_undo_command(ClientData client_data, Tcl_Interp *interp, int ar
 			interp_context_buffer()->undo.please_fuse = true;
 		} else if (strcmp(argv[1], "redo") == 0) {
 			editor_undo_action(interp_context_editor(), true);
+		} else if (strcmp(argv[1], "memory") == 0) {
+			undo_t *undo = &(interp_context_buffer()->undo);
+			char *r;
+			asprintf(&r, "bytes %zu nodes %d budget %zu", undo->memory, undo->nodes, undo->budget);
+			alloc_assert(r);
+			Tcl_SetResult(interp, r, TCL_VOLATILE);
+			free(r);
 		} else {
-			Tcl_AddErrorInfo(interp, "Wrong arguments to 'undo', usage; undo [tag [tagname] | fusenext | get <before|after>]");
+			Tcl_AddErrorInfo(interp, "Wrong arguments to 'undo', usage; undo [tag [tagname] | fusenext | memory | get <before|after>]");
 			return TCL_ERROR;
 		}
 	} else if (argc == 3) {
@@ -319,18 +328,14 @@ static int teddy_undo_command(ClientData client_data, Tcl_Interp *interp, int ar
 				return TCL_OK;
 			}
 
-			char *text = NULL;
-
-			if (strcmp(argv[2], "before") == 0) {
-				text = u->before_selection.text;
-			} else if (strcmp(argv[2], "after") == 0) {
-				text = u->after_selection.text;
-			} else {
+			if ((strcmp(argv[2], "before") != 0) && (strcmp(argv[2], "after") != 0)) {
 				Tcl_AddErrorInfo(interp, "Wrong argument to 'undo get', expected before or after");
 				return TCL_ERROR;
 			}
 
+			char *text = buffer_undo_text(interp_context_buffer(), u, strcmp(argv[2], "before") == 0);
 			Tcl_SetResult(interp, (text != NULL) ? text : "", TCL_VOLATILE);
+			if (text != NULL) free(text);
 			return TCL_OK;
 		} else if (strcmp(argv[1], "region") == 0) {
 			undo_node_t *u = undo_peek(&(interp_context_buffer()->undo));
@@ -338,11 +343,11 @@ static int teddy_undo_command(ClientData client_data, Tcl_Interp *interp, int ar
 
 			if (u != NULL) {
 				if (strcmp(argv[2], "before") == 0) {
-					mark = u->before_selection.start;
-					cursor = u->before_selection.end;
+					mark = u->start;
+					cursor = u->before_end;
 				} else if (strcmp(argv[2], "after") == 0) {
-					mark = u->after_selection.start;
-					cursor = u->after_selection.end;
+					mark = u->start;
+					cursor = u->after_end;
 				} else {
 					Tcl_AddErrorInfo(interp, "Wrong argument to 'undo get', expected before or after");
 					return TCL_ERROR;
@@ -926,6 +931,7 @@ void interp_init(void) {
 	Tcl_CreateCommand(interp, "search", &teddy_search_command, (ClientData)NULL, NULL);
 
 	Tcl_CreateCommand(interp, "teddy_intl::wandercount", &teddy_wandercount_command, (ClientData)NULL, NULL);
+	Tcl_CreateCommand(interp, "teddy_intl::rebench", &teddy_rebench_command, (ClientData)NULL, NULL);
 
 	Tcl_CreateCommand(interp, "rgbcolor", &teddy_rgbcolor_command, (ClientData)NULL, NULL);
 
@@ -946,6 +952,7 @@ void interp_init(void) {
 	Tcl_CreateCommand(interp, "buffer", &teddy_buffer_command, (ClientData)NULL, NULL);
 
 	Tcl_CreateCommand(interp, "teddy::tags", &teddy_tags_command, (ClientData)NULL, NULL);
+	Tcl_CreateCommand(interp, "teddy::grep", &teddy_grep_command, (ClientData)NULL, NULL);
 
 	Tcl_CreateCommand(interp, "help", &teddy_help_command, (ClientData)NULL, NULL);
 	Tcl_CreateCommand(interp, "teddy::cmdline-focus", &teddy_cmdlinefocus_command, (ClientData)NULL, NULL);
@@ -1151,7 +1158,7 @@ buffer_t *interp_context_buffer(void) {
 
 void interp_return_single_point(buffer_t *buffer, int p) {
 	char *r;
-	asprintf(&r, "%d:%d", buffer_line_of(buffer, p, false), buffer_column_of(buffer, p));
+	asprintf(&r, "%d:%d", buffer_line_of(buffer, p), buffer_column_of(buffer, p));
 	alloc_assert(r);
 	Tcl_SetResult(interp, r, TCL_VOLATILE);
 	free(r);
@@ -1161,11 +1168,11 @@ void interp_return_point_pair(buffer_t *buffer, int mark, int cursor) {
 	char *r;
 	if (mark < 0) {
 		asprintf(&r, "nil %d:%d",
-			buffer_line_of(buffer, cursor, false), buffer_column_of(buffer, cursor));
+			buffer_line_of(buffer, cursor), buffer_column_of(buffer, cursor));
 	} else {
 		asprintf(&r, "%d:%d %d:%d",
-			buffer_line_of(buffer, mark, false), buffer_column_of(buffer, mark),
-			buffer_line_of(buffer, cursor, false), buffer_column_of(buffer, cursor));
+			buffer_line_of(buffer, mark), buffer_column_of(buffer, mark),
+			buffer_line_of(buffer, cursor), buffer_column_of(buffer, cursor));
 	}
 	alloc_assert(r);
 	Tcl_SetResult(interp, r, TCL_VOLATILE);
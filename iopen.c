@@ -1,8 +1,7 @@
 #include "iopen.h"
 
-#include <sys/types.h>
-#include <dirent.h>
-#include <fcntl.h>
+#include <strings.h>
+#include <pthread.h>
 
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms.h>
@@ -15,9 +14,15 @@
 #include "research.h"
 #include "interp.h"
 #include "buffers.h"
+#include "fileidx.h"
+#include "fuzzy.h"
+#include "trigram.h"
 
-#define IOPEN_RECURSOR_DEPTH_LIMIT 128
 #define IOPEN_MAX_SENT_RESULTS 128
+// microseconds
+#define IOPEN_INDEX_POLL_INTERVAL 100000
+// milliseconds
+#define IOPEN_FLUSH_INTERVAL 16
 
 GtkWidget *parent_window;
 
@@ -35,6 +40,23 @@ struct iopen_result {
 	double rank;
 };
 
+enum iopen_source { IOPEN_FILES = 0, IOPEN_TAGS, IOPEN_BUFFERS, IOPEN_SOURCES };
+
+/* All the results of a source for a request. Worker threads post them to iopen_pending, the last batch of each source is shown once per frame */
+struct iopen_batch {
+	char *request;
+	enum iopen_source source;
+	struct iopen_result **v;
+	int n, cap;
+};
+
+static pthread_mutex_t iopen_pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct iopen_batch *iopen_pending[IOPEN_SOURCES];
+static bool iopen_flush_scheduled = false;
+
+// contents of iopen_buffer when iopen is open, NULL otherwise
+static char *iopen_current_request = NULL;
+
 GAsyncQueue *file_recursor_requests;
 GAsyncQueue *tags_requests;
 GAsyncQueue *buffers_requests;
@@ -42,6 +64,8 @@ GAsyncQueue *buffers_requests;
 GtkCellRenderer *crt;
 
 static void iopen_close(void) {
+	if (iopen_current_request != NULL) free(iopen_current_request);
+	iopen_current_request = NULL;
 	g_async_queue_push(file_recursor_requests, strdup(""));
 	g_async_queue_push(tags_requests, strdup(""));
 	g_async_queue_push(buffers_requests, strdup(""));
@@ -149,36 +173,116 @@ static void iopen_result_free(struct iopen_result *r) {
 	free(r);
 }
 
-static gboolean iopen_add_result(struct iopen_result *r) {
-	bool should_add = true;
-	GtkTreeIter mah;
+static struct iopen_batch *iopen_batch_new(const char *request, enum iopen_source source) {
+	struct iopen_batch *b = malloc(sizeof(struct iopen_batch));
+	alloc_assert(b);
+	b->request = strdup(request);
+	alloc_assert(b->request);
+	b->source = source;
+	b->v = NULL;
+	b->n = b->cap = 0;
+	return b;
+}
 
-	if (gtk_tree_model_get_iter_first(GTK_TREE_MODEL(results_list), &mah)) {
-		do {
-			GValue path_value = { 0 }, show_value = { 0 };
-			gtk_tree_model_get_value(GTK_TREE_MODEL(results_list), &mah, 1, &path_value);
-			gtk_tree_model_get_value(GTK_TREE_MODEL(results_list), &mah, 0, &show_value);
-			const char *path = g_value_get_string(&path_value);
-			const char *show = g_value_get_string(&show_value);
+static void iopen_batch_add(struct iopen_batch *b, struct iopen_result *r) {
+	if (b->n >= b->cap) {
+		b->cap = MAX(2 * b->cap, 16);
+		b->v = realloc(b->v, sizeof(struct iopen_result *) * b->cap);
+		alloc_assert(b->v);
+	}
+	b->v[b->n++] = r;
+}
 
-			if ((null_strcmp(r->show, show) == 0) && (null_strcmp(r->path, path) == 0)) should_add = false;
+static void iopen_batch_free(struct iopen_batch *b) {
+	if (b == NULL) return;
+	for (int i = 0; i < b->n; ++i) {
+		iopen_result_free(b->v[i]);
+	}
+	free(b->v);
+	free(b->request);
+	free(b);
+}
 
-			g_value_unset(&path_value);
-			g_value_unset(&show_value);
-		} while (should_add && gtk_tree_model_iter_next(GTK_TREE_MODEL(results_list), &mah));
+// replaces the rows of the source of b with its results
+static void iopen_show_batch(struct iopen_batch *b) {
+	GtkTreeIter mah;
+	gboolean valid = gtk_tree_model_get_iter_first(GTK_TREE_MODEL(results_list), &mah);
+	while (valid) {
+		GValue source_value = { 0 };
+		gtk_tree_model_get_value(GTK_TREE_MODEL(results_list), &mah, 4, &source_value);
+		int source = g_value_get_int(&source_value);
+		g_value_unset(&source_value);
+
+		if (source == b->source) {
+			valid = gtk_list_store_remove(results_list, &mah);
+		} else {
+			valid = gtk_tree_model_iter_next(GTK_TREE_MODEL(results_list), &mah);
+		}
 	}
 
-	if (should_add) {
+	GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	for (int i = 0; i < b->n; ++i) {
+		struct iopen_result *r = b->v[i];
+
+		char *key = g_strconcat(r->path, "\n", r->show, NULL);
+		if (g_hash_table_lookup(seen, key) != NULL) {
+			g_free(key);
+			continue;
+		}
+		g_hash_table_insert(seen, key, key);
+
 		gtk_list_store_append(results_list, &mah);
-		gtk_list_store_set(results_list, &mah, 0, r->show, 1, r->path, 2, (r->search != NULL) ? r->search : "", 3, r->rank, -1);
+		gtk_list_store_set(results_list, &mah, 0, r->show, 1, r->path, 2, (r->search != NULL) ? r->search : "", 3, r->rank, 4, b->source, -1);
+	}
+
+	g_hash_table_destroy(seen);
+}
+
+static gboolean iopen_flush(gpointer data) {
+	struct iopen_batch *batches[IOPEN_SOURCES];
+
+	pthread_mutex_lock(&iopen_pending_mutex);
+	for (int i = 0; i < IOPEN_SOURCES; ++i) {
+		batches[i] = iopen_pending[i];
+		iopen_pending[i] = NULL;
+	}
+	iopen_flush_scheduled = false;
+	pthread_mutex_unlock(&iopen_pending_mutex);
+
+	// rows are sorted once, after all the batches are added
+	gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(results_list), GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID, GTK_SORT_ASCENDING);
+
+	for (int i = 0; i < IOPEN_SOURCES; ++i) {
+		if (batches[i] == NULL) continue;
+		// results for a request that isn't current anymore are discarded
+		if ((iopen_current_request != NULL) && (strcmp(batches[i]->request, iopen_current_request) == 0)) {
+			iopen_show_batch(batches[i]);
+		}
+		iopen_batch_free(batches[i]);
 	}
 
-	iopen_result_free(r);
+	gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(results_list), 3, GTK_SORT_ASCENDING);
+	gtk_widget_queue_draw(results_tree);
 
 	return FALSE;
 }
 
+// called by the worker threads, b replaces the results not yet shown of the same source
+static void iopen_post(struct iopen_batch *b) {
+	pthread_mutex_lock(&iopen_pending_mutex);
+	iopen_batch_free(iopen_pending[b->source]);
+	iopen_pending[b->source] = b;
+	if (!iopen_flush_scheduled) {
+		iopen_flush_scheduled = true;
+		g_timeout_add(IOPEN_FLUSH_INTERVAL, iopen_flush, NULL);
+	}
+	pthread_mutex_unlock(&iopen_pending_mutex);
+}
+
 static void iopen_buffer_onchange(buffer_t *buffer) {
+	if (iopen_current_request != NULL) free(iopen_current_request);
+	iopen_current_request = buffer_all_lines_to_text(buffer);
 	g_async_queue_push(file_recursor_requests, buffer_all_lines_to_text(buffer));
 	g_async_queue_push(tags_requests, buffer_all_lines_to_text(buffer));
 	g_async_queue_push(buffers_requests, buffer_all_lines_to_text(buffer));
@@ -186,199 +290,214 @@ static void iopen_buffer_onchange(buffer_t *buffer) {
 	gtk_widget_queue_draw(results_tree);
 }
 
+// Returns the start of the last component of path (the final '/' of directories is ignored)
+static const char *iopen_file_name(const char *path) {
+	const char *name = path;
+	for (const char *p = path; *p != '\0'; ++p) {
+		if ((*p == '/') && (p[1] != '\0')) name = p + 1;
+	}
+	return name;
+}
+
+/* Rank (lower is better) of the i-th best result of a fuzzy match, files and tags are mixed by score.
+   The position of the result keeps the order decided by fuzzy_rank between equal scores, offset orders equal results of different sources */
+static double iopen_fuzzy_rank(struct fuzzy_result *best, int i, double offset) {
+	return -best[i].score + offset + (double)i / (2.0 * IOPEN_MAX_SENT_RESULTS);
+}
+
+static const char *iopen_file_candidate(void *arg, int i) {
+	return ((struct fileidx_snapshot *)arg)->entries[i];
+}
+
 static gpointer iopen_recursor_thread(gpointer data) {
-	struct irt_frame {
-		DIR *dir;
-		struct dirent *cur;
-	} tovisit[IOPEN_RECURSOR_DEPTH_LIMIT];
-	int top = 0;
+	char *full_request = NULL;
 	char *request = NULL;
-
-	int count = 0;
 	char *rest = NULL;
 
-	for (;;) {
-		char *new_request;
+	// matches for filtered in the index with the given generation, a request that extends filtered only needs to look at them
+	char *filtered = NULL;
+	int *matches = NULL;
+	int nmatches = 0, matches_cap = 0;
+	unsigned long generation = 0;
 
-		// if top is 0 there is nothing else to do, we can block waiting for a request
-		if (top == 0) {
-			//printf("Waiting\n");
-			new_request = g_async_queue_pop(file_recursor_requests);
-		} else {
-			new_request = g_async_queue_try_pop(file_recursor_requests);
-		}
+	struct fuzzy_result best[IOPEN_MAX_SENT_RESULTS];
+
+	bool building = false;
+
+	for (;;) {
+		// while the index is being built we check periodically for new entries
+		char *new_request = building ? g_async_queue_timeout_pop(file_recursor_requests, IOPEN_INDEX_POLL_INTERVAL) : g_async_queue_pop(file_recursor_requests);
+		building = false;
 
 		if (new_request != NULL) {
-			// got a new request, discard the old one, reset the stack and start back from current directory
-			// an empty string as request will stop us if we were doing something
+			// only the most recent request is interesting
+			char *newer;
+			while ((newer = g_async_queue_try_pop(file_recursor_requests)) != NULL) {
+				free(new_request);
+				new_request = newer;
+			}
 
-			//printf("New request: <%s>\n", new_request);
+			if (full_request != NULL) free(full_request);
+			full_request = new_request;
 
 			if (request != NULL) free(request);
-			request = new_request;
+			request = strdup(full_request);
+			alloc_assert(request);
+
+			if (rest != NULL) free(rest);
+			rest = NULL;
 
 			char *first_colon = strchr(request, ':');
 			if (first_colon != NULL) {
-				asprintf(&rest, "%s", first_colon);
+				rest = strdup(first_colon);
+				alloc_assert(rest);
 				*first_colon = '\0';
-			} else {
-				if (rest != NULL) free(rest);
-				rest = NULL;
 			}
+		}
 
-			for (int i = 0; i < top; ++i) {
-				closedir(tovisit[i].dir);
-			}
+		// an empty string as request means that iopen was closed
+		if ((request == NULL) || (strcmp(request, "") == 0)) continue;
 
-			if (strcmp(request, "") == 0) {
-				top = 0;
-			} else {
-				char *wd = get_current_dir_name();
-				alloc_assert(wd);
-				tovisit[0].dir = opendir(wd);
-				tovisit[0].cur = NULL;
-				top = 1;
-				count = 0;
-				free(wd);
-			}
+		// the snapshot is ranked without blocking the main thread, which keeps updating the index
+		bool idx_building;
+		struct fileidx_snapshot *idx = fileidx_snapshot(&idx_building);
+
+		if ((new_request == NULL) && (idx->generation == generation)) {
+			// nothing new
+			building = idx_building;
+			fileidx_snapshot_release(idx);
+			continue;
 		}
 
-		if (top > 0) {
-			struct irt_frame *cf = tovisit + (top - 1);
-			if (cf->dir == NULL) {
-				// open of a directory failed, not a problem
-				--top;
-				continue;
+		if ((filtered == NULL) || (idx->generation != generation) || (strncasecmp(request, filtered, strlen(filtered)) != 0)) {
+			if (idx->n > matches_cap) {
+				matches_cap = idx->n;
+				matches = realloc(matches, sizeof(int) * matches_cap);
+				alloc_assert(matches);
 			}
-
-			cf->cur = readdir(cf->dir);
-
-			if (cf->cur == NULL) {
-				// this directory is done, close it and pop the stack
-				closedir(cf->dir);
-				--top;
-				continue;
+			for (int i = 0; i < idx->n; ++i) {
+				matches[i] = i;
 			}
+			nmatches = idx->n;
+		}
 
-			if (cf->cur->d_name[0] == '.') {
-				continue;
-			}
+		int nbest = fuzzy_rank(request, matches, &nmatches, iopen_file_candidate, idx, IOPEN_MAX_SENT_RESULTS, best);
 
-			char *match_start = strcasestr(cf->cur->d_name, request);
-			if (match_start != NULL) {
-				struct iopen_result *r = malloc(sizeof(struct iopen_result));
-				int len = 0;
-				for (int i = 0; i < top; ++i) {
-					len += strlen(tovisit[i].cur->d_name) + 1;
-				}
-				if (cf->cur->d_type == DT_DIR) ++len;
-				r->path = malloc(sizeof(char) * len);
-				alloc_assert(r->path);
-				r->path[0] = '\0';
-				for (int i = 0; i < top; ++i) {
-					strcat(r->path, tovisit[i].cur->d_name);
-					if (i != top-1) strcat(r->path, "/");
-				}
-				if (cf->cur->d_type == DT_DIR) strcat(r->path, "/");
-
-				r->show = g_markup_printf_escaped("<big><b>%s%s</b></big>\n%s", cf->cur->d_name, (cf->cur->d_type == DT_DIR) ? "/" : "", r->path);
-				alloc_assert(r->show);
-
-				r->search = (rest != NULL) ? strdup(rest) : NULL;
-
-				r->rank = (top + ((cf->cur->d_type == DT_DIR) ? 0 : -1))*1000
-					+ (match_start - cf->cur->d_name)*10
-					+ strlen(cf->cur->d_name);
-				g_idle_add((GSourceFunc)iopen_add_result, r);
-
-				if (++count > IOPEN_MAX_SENT_RESULTS) {
-					for (int i = 0; i < top; ++i) {
-						closedir(tovisit[i].dir);
-						top = 0;
-					}
-					continue;
-				}
-			}
+		struct iopen_batch *batch = iopen_batch_new(full_request, IOPEN_FILES);
+		for (int i = 0; i < nbest; ++i) {
+			const char *path = idx->entries[best[i].idx];
 
-			if ((cf->cur->d_type == DT_DIR) && (top < IOPEN_RECURSOR_DEPTH_LIMIT)) {
-				// recur on this directory
-				int newfd = openat(dirfd(cf->dir), cf->cur->d_name, O_RDONLY);
-				if (newfd != -1) {
-					tovisit[top].dir = fdopendir(newfd);
-					tovisit[top].cur = NULL;
-					top++;
-				}
-			}
+			struct iopen_result *r = malloc(sizeof(struct iopen_result));
+			alloc_assert(r);
+			r->path = strdup(path);
+			alloc_assert(r->path);
+			r->show = g_markup_printf_escaped("<big><b>%s</b></big>\n%s", iopen_file_name(path), path);
+			alloc_assert(r->show);
+			r->search = (rest != NULL) ? strdup(rest) : NULL;
+			r->rank = iopen_fuzzy_rank(best, i, 0.0);
+			iopen_batch_add(batch, r);
 		}
+
+		building = idx_building;
+		generation = idx->generation;
+		fileidx_snapshot_release(idx);
+
+		if (filtered != NULL) free(filtered);
+		filtered = strdup(request);
+		alloc_assert(filtered);
+
+		iopen_post(batch);
 	}
+
 	return NULL;
 }
 
+static const char *iopen_tag_candidate(void *arg, int i) {
+	return ((struct tags_db *)arg)->entries[i].tag;
+}
+
 static gpointer iopen_tags_thread(gpointer data) {
-	char *request = NULL;
-	int idx = -1;
-	int count = 0;
+	int *v = NULL;
+	int vcap = 0, n = 0;
+	struct fuzzy_result best[IOPEN_MAX_SENT_RESULTS];
+
+	// v holds the entries of db matching filtered
+	struct tags_db *db = NULL;
+	char *filtered = NULL;
 
 	for (;;) {
-		char *new_request;
+		char *full_request = g_async_queue_pop(tags_requests);
 
-		if (idx < 0) {
-			//printf("Waiting\n");
-			new_request = g_async_queue_pop(tags_requests);
-		} else {
-			new_request = g_async_queue_try_pop(tags_requests);
+		// only the most recent request is interesting
+		char *newer;
+		while ((newer = g_async_queue_try_pop(tags_requests)) != NULL) {
+			free(full_request);
+			full_request = newer;
 		}
 
-		if (new_request != NULL) {
-			// got a new request, discard the old one, reset the stack and start back at the top
-			// an empty string as request will stop us if we were doing something
-
-			//printf("New request: <%s>\n", new_request);
+		char *request = strdup(full_request);
+		alloc_assert(request);
+		char *first_colon = strchr(request, ':');
+		if (first_colon != NULL) *first_colon = '\0';
+
+		// an empty string as request means that iopen was closed
+		if (strcmp(request, "") == 0) {
+			tags_release(db);
+			db = NULL;
+			free(request);
+			free(full_request);
+			continue;
+		}
 
-			if (request != NULL) free(request);
-			request = new_request;
+		struct tags_db *cur = tags_acquire();
 
-			char *first_colon = strchr(request, ':');
-			if (first_colon != NULL) *first_colon = '\0';
+		if ((cur != db) || (filtered == NULL) || (strncasecmp(request, filtered, strlen(filtered)) != 0)) {
+			tags_release(db);
+			db = cur;
+			cur = NULL;
 
-			idx = (strcmp(request, "") == 0) ? -1 : 0;
-			count = 0;
+			n = (db != NULL) ? db->n : 0;
+			if (n > vcap) {
+				vcap = n;
+				v = realloc(v, sizeof(int) * vcap);
+				alloc_assert(v);
+			}
+			for (int i = 0; i < n; ++i) {
+				v[i] = i;
+			}
 		}
 
-		if (idx < 0) continue;
+		tags_release(cur);
 
-		if (idx >= tag_entries_cap) {
-			idx = -1;
-			count = 0;
-			continue;
-		}
+		int nbest = (n > 0) ? fuzzy_rank(request, v, &n, iopen_tag_candidate, db, IOPEN_MAX_SENT_RESULTS, best) : 0;
+
+		struct iopen_batch *batch = iopen_batch_new(full_request, IOPEN_TAGS);
+		for (int i = 0; i < nbest; ++i) {
+			char *search;
+			int lineno;
+			char *path = tags_entry_location(db, best[i].idx, &search, &lineno);
+			if (path == NULL) continue;
 
-		char *match_start = strcasestr(tag_entries[idx].tag, request);
-		if (match_start != NULL) {
 			struct iopen_result *r = malloc(sizeof(struct iopen_result));
-			r->show = g_markup_printf_escaped("<big><b>%s</b></big>\n%s", tag_entries[idx].tag, tag_entries[idx].path);
+			alloc_assert(r);
+			r->show = g_markup_printf_escaped("<big><b>%s</b></big>\n%s", db->entries[best[i].idx].tag, path);
 			alloc_assert(r->show);
-			r->path = strdup(tag_entries[idx].path);
-			alloc_assert(r->path);
-			if (tag_entries[idx].search != NULL) {
-				r->search = strdup(tag_entries[idx].search);
-				alloc_assert(r->search);
+			r->path = path;
+			if (search != NULL) {
+				r->search = search;
 			} else {
-				r->search = NULL;
-			}
-			r->rank = 1000 + (match_start - tag_entries[idx].tag) * 10 + strlen(tag_entries[idx].tag);
-			g_idle_add((GSourceFunc)iopen_add_result, r);
-
-			//printf("\t<%s>\n", tag_entries[idx].tag);
-
-			if (count++ > IOPEN_MAX_SENT_RESULTS) {
-				idx = -1;
-				count = 0;
-				continue;
+				asprintf(&(r->search), ":%d", lineno);
+				alloc_assert(r->search);
 			}
+			r->rank = iopen_fuzzy_rank(best, i, 0.5);
+			iopen_batch_add(batch, r);
 		}
 
-		++idx;
+		iopen_post(batch);
+
+		if (filtered != NULL) free(filtered);
+		filtered = request;
+		free(full_request);
 	}
 
 	return NULL;
@@ -406,7 +525,9 @@ static gpointer iopen_buffer_thread(gpointer data) {
 	uint32_t *urequest = NULL;
 	int ureqlen = 0;
 	int bufidx = -1;
+	int line = 0; // next line to search in buffers[bufidx]
 	int count;
+	struct iopen_batch *batch = NULL;
 
 	for (;;) {
 		char *new_request;
@@ -423,19 +544,19 @@ static gpointer iopen_buffer_thread(gpointer data) {
 				free(request);
 				free(urequest);
 			}
-			if (strlen(new_request) >= 3) {
-				request = new_request;
-			} else {
-				request = strdup("");
-			}
+			iopen_batch_free(batch);
+			batch = iopen_batch_new(new_request, IOPEN_BUFFERS);
+			request = new_request;
 
 			char *first_colon = strchr(request, ':');
 			if (first_colon != NULL) *first_colon = '\0';
 
-			bufidx = (strcmp(request, "") == 0) ? -1 : 0;
-			count = 0;
-
 			urequest = utf8_to_utf32_string(request, &ureqlen);
+
+			// trigram_find needs at least one trigram, shorter requests are treated as empty
+			bufidx = (ureqlen >= 3) ? 0 : -1;
+			line = 0;
+			count = 0;
 		}
 
 		if (bufidx < 0) continue;
@@ -450,68 +571,69 @@ static gpointer iopen_buffer_thread(gpointer data) {
 		}
 
 		if (buf == NULL) {
+			iopen_post(batch);
+			batch = NULL;
 			bufidx = -1;
 			count = 0;
 			continue;
 		}
 
-		for (int p = 0; p+ureqlen < MIN(100000, BSIZE(buf)); ++p) {
-			int i;
-			for (i = 0; i < ureqlen; ++i) {
-				my_glyph_info_t *g = bat(buf, p+i);
-				if (urequest[i] != g->code) break;
+		struct trigram_match found[IOPEN_MAX_SENT_RESULTS + 1];
+
+		pthread_rwlock_rdlock(&(buf->rwlock));
+
+		int n = trigram_find(buf, urequest, ureqlen, &line, found, IOPEN_MAX_SENT_RESULTS - count + 1);
+
+		for (int i = 0; i < n; ++i) {
+			int s = buffer_line_start(buf, found[i].line + 1);
+			int e = s;
+			buffer_move_point_glyph(buf, &e, MT_END, 0);
+
+			char *text = buffer_lines_to_text(buf, s, e);
+
+			int indentation_depth = too_much_indent(text);
+			if (indentation_depth < 0) {
+				free(text);
+				continue;
 			}
-			if (i == ureqlen) {
-				// match found
-				int s = p, e = p;
-				buffer_move_point_glyph(buf, &s, MT_ABS, 1);
-				buffer_move_point_glyph(buf, &e, MT_END, 0);
-
-				char *line = buffer_lines_to_text(buf, s, e);
-
-				int indentation_depth = too_much_indent(line);
-				if (indentation_depth >= 0) {
-					int lineno = buffer_line_of(buf, p, false);
-					struct iopen_result *r = malloc(sizeof(struct iopen_result));
-
-					int c = strncmp(buf->path, top_working_directory(), strlen(top_working_directory()));
-					if (c == 0) {
-						r->path = strdup(buf->path + strlen(top_working_directory()) + 1);
-					} else {
-						r->path = strdup(buf->path);
-					}
-					alloc_assert(r->path);
-
-					r->show = g_markup_printf_escaped("<big><b>%s</b></big>\n%s:%d", line, r->path, lineno);
-					free(line);
-
-					asprintf(&(r->search), ":%d", lineno);
-					alloc_assert(r->search);
-					r->rank = 10000 + indentation_depth * 100 + (p - s);
-					g_idle_add((GSourceFunc)iopen_add_result, r);
-
-					//printf("\t<%s>\n", tag_entries[idx].tag);
-
-					if (count++ > IOPEN_MAX_SENT_RESULTS) {
-						bufidx = -1;
-						count = 0;
-						break;
-					}
-				} else {
-					free(line);
-				}
-
-				p = e+1;
+
+			int lineno = found[i].line + 1;
+			struct iopen_result *r = malloc(sizeof(struct iopen_result));
+
+			int c = strncmp(buf->path, top_working_directory(), strlen(top_working_directory()));
+			if (c == 0) {
+				r->path = strdup(buf->path + strlen(top_working_directory()) + 1);
+			} else {
+				r->path = strdup(buf->path);
 			}
+			alloc_assert(r->path);
+
+			r->show = g_markup_printf_escaped("<big><b>%s</b></big>\n%s:%d", text, r->path, lineno);
+			free(text);
+
+			asprintf(&(r->search), ":%d", lineno);
+			alloc_assert(r->search);
+			r->rank = 10000 + indentation_depth * 100 + (found[i].point - s);
+			iopen_batch_add(batch, r);
+
+			if (++count > IOPEN_MAX_SENT_RESULTS) break;
 		}
 
-		if (count++ > IOPEN_MAX_SENT_RESULTS) {
+		pthread_rwlock_unlock(&(buf->rwlock));
+
+		if (count > IOPEN_MAX_SENT_RESULTS) {
+			iopen_post(batch);
+			batch = NULL;
 			bufidx = -1;
 			count = 0;
 			continue;
 		}
 
+		// the search of this buffer was interrupted by someone that wanted to modify it, it will continue from line
+		if (line >= 0) continue;
+
 		++bufidx;
+		line = 0;
 	}
 
 	return NULL;
@@ -543,7 +665,7 @@ void iopen_init(GtkWidget *window) {
 
 	gtk_box_pack_start(GTK_BOX(main_vbox), GTK_WIDGET(iopen_editor), FALSE, FALSE, 0);
 
-	results_list = gtk_list_store_new(4, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_DOUBLE);
+	results_list = gtk_list_store_new(5, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_DOUBLE, G_TYPE_INT);
 	gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(results_list), 3, GTK_SORT_ASCENDING);
 	results_tree = gtk_tree_view_new();
 
@@ -593,6 +715,8 @@ void iopen(const char *initial_text) {
 
 	gtk_list_store_clear(results_list);
 
+	fileidx_update(top_working_directory());
+
 	buffer_aux_clear(iopen_buffer);
 	iopen_buffer->cursor = 0;
 
@@ -21,6 +21,8 @@
 
 #define JOBS_READ_BUFFER_SIZE 2048
 #define SHOWANYWAY_TIMO 500
+#define JOBS_FLUSH_INTERVAL 16 // milliseconds, output read within this interval is added to the buffer at once
+#define JOBS_FLUSH_MAX_BYTES (1024 * 1024)
 
 void jobs_init(void) {
 	int i;
@@ -48,7 +50,27 @@ static char *cut_prompt(job_t *job) {
 	return r;
 }
 
+static void job_flush(job_t *job);
+
+/* Removes text from the start of the buffer of job until it is at most max characters long, cutting at the beginning of a line if possible */
+static void job_trim_output(job_t *job, int max) {
+	buffer_t *buffer = job->buffer;
+	int n = BSIZE(buffer) - max;
+	if (n <= 0) return;
+
+	int nl = buffer_newlines_before(buffer, n);
+	if (nl < LSIZE(buffer)) n = buffer_newline_position(buffer, nl) + 1;
+
+	buffer_trim_head(buffer, n);
+	job->reset_position = MAX(job->reset_position - n, 0);
+}
+
 static void job_destroy(job_t *job) {
+	job_flush(job);
+	free(job->output);
+	job->output = NULL;
+	job->output_cap = 0;
+
 	g_source_remove(job->pipe_from_child_source_id);
 	g_source_remove(job->child_source_id);
 	g_io_channel_shutdown(job->pipe_from_child, FALSE, NULL);
@@ -80,40 +102,49 @@ static void job_destroy(job_t *job) {
 	job->used = 0;
 }
 
-static void job_append(job_t *job, const char *msg, int len, int on_new_line) {
-	if (job->buffer == NULL) return;
-	buffer_t *buffer = job->buffer;
+/* Adds the output accumulated by job_append to the buffer, with a single call to buffer_replace_selection that also puts back the input the user was typing */
+static void job_flush(job_t *job) {
+	if (job->output_source_id != 0) {
+		g_source_remove(job->output_source_id);
+		job->output_source_id = 0;
+	}
+
+	if (job->output_len == 0) return;
 
-	//buffer_append(job->buffer, msg, len, on_new_line);
+	if (job->buffer == NULL) {
+		job->output_len = 0;
+		return;
+	}
+
+	buffer_t *buffer = job->buffer;
 
 	char *prompt_str = cut_prompt(job);
 	//printf("prompt_str <%s>\n", prompt_str);
 
-	if (on_new_line) {
-		my_glyph_info_t *glyph = bat(buffer, buffer->cursor);
-		if ((glyph != NULL) && (glyph->code != '\n')) {
-			buffer_replace_selection(buffer, "\n");
+	if (prompt_str != NULL) {
+		int prompt_len = strlen(prompt_str);
+		if (job->output_len + prompt_len + 1 > job->output_cap) {
+			job->output_cap = job->output_len + prompt_len + 1;
+			job->output = realloc(job->output, job->output_cap);
+			alloc_assert(job->output);
 		}
+		memcpy(job->output + job->output_len, prompt_str, prompt_len);
+		job->output_len += prompt_len;
+		free(prompt_str);
 	}
 
-	char *text = malloc(sizeof(char) * (len + 1));
-	alloc_assert(text);
-	strncpy(text, msg, len);
-	text[len] = '\0';
-
-	//printf("jobappending <%s> (%d:%d <%s>)\n", text, buffer->mark, buffer->cursor, prompt_str);
+	job->output[job->output_len] = '\0';
 
-	buffer_replace_selection(buffer, text);
+	//printf("jobappending <%s> (%d:%d)\n", job->output, buffer->mark, buffer->cursor);
 
-	free(text);
-
-	if (prompt_str != NULL) {
-		buffer_replace_selection(buffer, prompt_str);
-		free(prompt_str);
-	}
+	buffer_replace_selection(buffer, job->output);
+	job->output_len = 0;
 
 	buffer->appjumps[APPJUMP_INPUT] = buffer->cursor;
 
+	int limit = config_intval(&global_config, CFG_JOBS_OUTPUT_LIMIT);
+	if (limit > 0) job_trim_output(job, limit);
+
 	editor_t *editor;
 	find_editor_for_buffer(job->buffer, NULL, NULL, &editor);
 	if (editor != NULL) {
@@ -122,6 +153,32 @@ static void job_append(job_t *job, const char *msg, int len, int on_new_line) {
 	}
 }
 
+static gboolean job_flush_timeout(job_t *job) {
+	job->output_source_id = 0;
+	job_flush(job);
+	return FALSE;
+}
+
+/* Output is accumulated and added to the buffer at most once every JOBS_FLUSH_INTERVAL milliseconds, anything that changes the buffer of a job in some other way must call job_flush first.
+   Text appended with on_new_line is added immediately */
+static void job_append(job_t *job, const char *msg, int len, int on_new_line) {
+	if (job->buffer == NULL) return;
+
+	if (job->output_len + len + 1 > job->output_cap) {
+		job->output_cap = MAX(job->output_len + len + 1, 2 * job->output_cap);
+		job->output = realloc(job->output, job->output_cap);
+		alloc_assert(job->output);
+	}
+	memcpy(job->output + job->output_len, msg, len);
+	job->output_len += len;
+
+	if (on_new_line || (job->output_len > JOBS_FLUSH_MAX_BYTES)) {
+		job_flush(job);
+	} else if (job->output_source_id == 0) {
+		job->output_source_id = g_timeout_add(JOBS_FLUSH_INTERVAL, (GSourceFunc)job_flush_timeout, job);
+	}
+}
+
 static gboolean job_update_directory(job_t  *job) {
 	if (job->buffer == NULL) return FALSE;
 	pid_t pid = tcgetpgrp(job->masterfd);
@@ -166,6 +223,7 @@ static gboolean job_update_directory(job_t  *job) {
 
 void job_send_input(job_t *job, const char *actual_input) {
 	if (job->buffer == NULL) return;
+	job_flush(job);
 	char *input = cut_prompt(job);
 	//printf("input <%s>\n", input);
 	job->buffer->mark = -1;
@@ -201,6 +259,8 @@ static void ansi_append_escape(job_t *job) {
 	if (buffer == NULL) return;
 	const char command_char = job->ansiseq[job->ansiseq_cap-1];
 
+	job_flush(job);
+
 	if (command_char == 'J') {
 		buffer->mark = buffer->cursor = 0;
 		buffer_move_point_line(buffer, &(buffer->cursor), MT_END, 0);
@@ -237,6 +297,7 @@ static void ansi_append(job_t *job, const char *msg, int len) {
 				job->ansi_state = ANSI_0D;
 			} else if (msg[i] == 0x08) {
 				job_append(job, msg+start, i - start, 0);
+				job_flush(job);
 				start = i+1;
 				char *p = cut_prompt(job);
 				if (p != NULL) free(p);
@@ -254,6 +315,7 @@ static void ansi_append(job_t *job, const char *msg, int len) {
 			if (msg[i] == 0x0a) {
 				job->ansi_state = ANSI_NORMAL;
 			} else {
+				job_flush(job);
 				job->buffer->mark = job->buffer->cursor = BSIZE(job->buffer)-1;
 				buffer_move_point_glyph(buffer, &(job->buffer->mark), MT_ABS, 1);
 				buffer_replace_selection(buffer, "");
@@ -295,15 +357,7 @@ static void job_lexy_refresh(job_t *job) {
 	//printf("\teditor: %p\n", editor);
 	if (editor == NULL) return;
 
-	for (int count = 0; job->buffer->lexy_running != 0; ++count) {
-		//printf("Lexy is running: %d\n", job->buffer->lexy_running);
-		if (count > 5) return;
-
-		struct timespec s;
-		s.tv_sec = 0;
-		s.tv_nsec = 10000000;
-		nanosleep(&s, NULL);
-	}
+	if (!lexy_wait(job->buffer, 50)) return;
 
 	//printf("Issuing redraw\n");
 
@@ -330,11 +384,7 @@ static void job_attach_to_buffer(job_t *job, const char *command, buffer_t *buff
 	if (sb == 0) {
 		buffer_aux_clear(buffer);
 	} else {
-		if (BSIZE(buffer) > sb) {
-			buffer->mark = 0;
-			buffer->cursor = BSIZE(buffer) - sb - 1;
-			buffer_replace_selection(buffer, "");
-		}
+		job_trim_output(job, sb);
 		buffer->mark = -1;
 		buffer->cursor = BSIZE(buffer);
 	}
@@ -523,6 +573,10 @@ int jobs_register(pid_t child_pid, int masterfd, buffer_t *buffer, const char *c
 
 	jobs[i].utf8annoyance[0] = '\0';
 
+	jobs[i].output = NULL;
+	jobs[i].output_len = jobs[i].output_cap = 0;
+	jobs[i].output_source_id = 0;
+
 	jobs[i].pipe_from_child = g_io_channel_unix_new(masterfd);
 	g_io_channel_set_encoding(jobs[i].pipe_from_child, NULL, NULL);
 
@@ -9,7 +9,7 @@
 struct _buffer_t;
 
 #define RATELIMIT_BUCKET_DURATION_SECS 5
-#define RATELIMIT_MAX_BYTES 30000
+#define RATELIMIT_MAX_BYTES (8 * 1024 * 1024)
 
 #define ANSI_SEQ_MAX_LEN 32
 
@@ -40,6 +40,11 @@ typedef struct _job_t {
 
 	char utf8annoyance[12];
 
+	/* output read from the child and not yet added to the buffer, see job_flush */
+	char *output;
+	int output_len, output_cap;
+	guint output_source_id;
+
 	int reset_position;
 
 	bool never_attach;
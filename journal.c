@@ -0,0 +1,414 @@
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "global.h"
+#include "buffers.h"
+#include "cfg.h"
+
+#define JOURNAL_MAGIC "teddy undo journal 2\n"
+// a journal bigger than this is started over when the session is opened
+#define JOURNAL_MAX_SIZE (256 * 1024 * 1024)
+
+enum journal_record_type {
+	JR_OPEN = 'O', // a file was opened, payload is the hash of its contents
+	JR_PUSH = 'P', // an undo node was pushed, payload is a struct journal_node and its text
+	JR_UNDO = 'U',
+	JR_REDO = 'R',
+	JR_SAVED = 'S', // payload is the hash of the saved contents
+};
+
+// flags of JR_PUSH and JR_OPEN records
+#define JR_FUSE 0x01 // the node was fused with the head
+#define JR_RESTORED 0x01 // the history was restored, otherwise it starts over
+
+struct journal_record {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t reserved;
+	uint32_t size; // of the payload that follows
+	uint64_t key; // hash of the path of the file
+};
+
+struct journal_node {
+	int32_t start, before_end, after_end;
+	int32_t prefix, suffix;
+	uint32_t deleted, inserted;
+	uint32_t reserved;
+	int64_t time;
+};
+
+// offsets of the records of a file
+struct journal_entry {
+	uint64_t key;
+	size_t *v;
+	int n, cap;
+};
+
+static int journal_fd = -1;
+static char *journal_path;
+static size_t journal_end;
+static GHashTable *journal_index; // key -> struct journal_entry
+
+static uint64_t fnv1a(uint64_t h, const void *p, size_t len) {
+	const uint8_t *b = p;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= b[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+static uint64_t journal_key(buffer_t *buffer) {
+	return fnv1a(FNV1A_INIT, buffer->path, strlen(buffer->path));
+}
+
+/* Hash of the contents of a buffer, it's computed on every open and save so code points are mixed two at a time, straight from the two halves of the gap buffer.
+   A code point left alone at the end of the first half is carried to the second one, so the hash doesn't depend on where the gap is */
+struct content_hash {
+	uint64_t h;
+	uint64_t word;
+	bool half; // word holds one code point
+};
+
+static inline void content_hash_mix(struct content_hash *ch, uint64_t word) {
+	ch->h = (ch->h ^ word) * 0x9e3779b97f4a7c15ULL;
+	ch->h ^= ch->h >> 29;
+}
+
+static void content_hash_add(struct content_hash *ch, const my_glyph_info_t *g, int n) {
+	int i = 0;
+	if (ch->half && (n > 0)) {
+		content_hash_mix(ch, ch->word | ((uint64_t)g[0].code << 32));
+		ch->half = false;
+		i = 1;
+	}
+	for (; i+1 < n; i += 2) {
+		content_hash_mix(ch, (uint64_t)g[i].code | ((uint64_t)g[i+1].code << 32));
+	}
+	if (i < n) {
+		ch->word = g[i].code;
+		ch->half = true;
+	}
+}
+
+static uint64_t journal_content_hash(buffer_t *buffer) {
+	struct content_hash ch = { FNV1A_INIT, 0, false };
+	content_hash_add(&ch, buffer->buf, buffer->gap);
+	content_hash_add(&ch, buffer->buf + buffer->gap + buffer->gapsz, buffer->size - buffer->gap - buffer->gapsz);
+	if (ch.half) content_hash_mix(&ch, ch.word | (1ULL << 63));
+	content_hash_mix(&ch, (uint64_t)BSIZE(buffer));
+
+	// final avalanche, the same as murmur3's
+	uint64_t h = ch.h;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static bool journal_wants(buffer_t *buffer) {
+	return (journal_fd >= 0) && buffer->has_filename && (buffer->job == NULL) && (buffer->path[0] != '+');
+}
+
+static struct journal_entry *journal_entry(uint64_t key, bool create) {
+	struct journal_entry *e = g_hash_table_lookup(journal_index, &key);
+	if ((e != NULL) || !create) return e;
+
+	e = malloc(sizeof(struct journal_entry));
+	alloc_assert(e);
+	e->key = key;
+	e->v = NULL;
+	e->n = e->cap = 0;
+	g_hash_table_insert(journal_index, &(e->key), e);
+	return e;
+}
+
+static void journal_entry_free(gpointer p) {
+	struct journal_entry *e = p;
+	free(e->v);
+	free(e);
+}
+
+static void journal_index_add(uint64_t key, size_t offset) {
+	struct journal_entry *e = journal_entry(key, true);
+	if (e->n >= e->cap) {
+		e->cap = (e->cap == 0) ? 16 : 2 * e->cap;
+		e->v = realloc(e->v, sizeof(size_t) * e->cap);
+		alloc_assert(e->v);
+	}
+	e->v[e->n++] = offset;
+}
+
+static void journal_close(void) {
+	if (journal_fd < 0) return;
+	for (int i = 0; i < buffers_allocated; ++i) {
+		if (buffers[i] != NULL) buffers[i]->journaled = false;
+	}
+	close(journal_fd);
+	journal_fd = -1;
+	free(journal_path);
+	journal_path = NULL;
+	g_hash_table_destroy(journal_index);
+	journal_index = NULL;
+}
+
+static void journal_write(uint8_t type, uint8_t flags, uint64_t key, struct iovec *payload, int npayload) {
+	if (journal_fd < 0) return;
+
+	struct journal_record r = { type, flags, 0, 0, key };
+	struct iovec iov[4];
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	for (int i = 0; i < npayload; ++i) {
+		r.size += payload[i].iov_len;
+		iov[i+1] = payload[i];
+	}
+
+	ssize_t expected = sizeof(r) + r.size;
+	if (writev(journal_fd, iov, npayload+1) != expected) {
+		perror("Can't write undo journal");
+		// drop whatever was written, the journal must stay readable
+		if (ftruncate(journal_fd, journal_end) != 0) perror("Can't truncate undo journal");
+		return;
+	}
+
+	journal_index_add(key, journal_end);
+	journal_end += expected;
+}
+
+static void journal_write_hash(uint8_t type, uint8_t flags, buffer_t *buffer) {
+	uint64_t hash = journal_content_hash(buffer);
+	struct iovec payload = { &hash, sizeof(hash) };
+	journal_write(type, flags, journal_key(buffer), &payload, 1);
+}
+
+// the histories of the files opened before the journal start over from their current contents
+static void journal_adopt(void) {
+	for (int i = 0; i < buffers_allocated; ++i) {
+		if ((buffers[i] == NULL) || buffers[i]->journaled || !journal_wants(buffers[i])) continue;
+		journal_write_hash(JR_OPEN, 0, buffers[i]);
+		buffers[i]->journaled = true;
+	}
+}
+
+/* Indexes the records of the journal, returns the end of the last complete record */
+static size_t journal_scan(const char *map, size_t len) {
+	size_t off = strlen(JOURNAL_MAGIC);
+	if ((len < off) || (memcmp(map, JOURNAL_MAGIC, off) != 0)) return 0;
+
+	while (off + sizeof(struct journal_record) <= len) {
+		struct journal_record r;
+		memcpy(&r, map + off, sizeof(r));
+		if (off + sizeof(r) + r.size > len) break;
+		journal_index_add(r.key, off);
+		off += sizeof(r) + r.size;
+	}
+
+	return off;
+}
+
+void journal_open(const char *session, bool adopt) {
+	if ((session != NULL) && (journal_path != NULL)) {
+		char *path = tied_session_file_ext(session, "undo");
+		bool same = (strcmp(path, journal_path) == 0);
+		free(path);
+		if (same) {
+			if (adopt) journal_adopt();
+			return;
+		}
+	}
+
+	journal_close();
+	if (session == NULL) return;
+
+	journal_path = tied_session_file_ext(session, "undo");
+	journal_fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (journal_fd < 0) {
+		perror("Can't open undo journal");
+		free(journal_path);
+		journal_path = NULL;
+		return;
+	}
+
+	journal_index = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, journal_entry_free);
+
+	// only the headers of the records are read here, the rest of the file is read when the history of a file is needed
+	struct stat s;
+	journal_end = 0;
+	if ((fstat(journal_fd, &s) == 0) && (s.st_size > 0) && (s.st_size <= JOURNAL_MAX_SIZE)) {
+		char *map = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, journal_fd, 0);
+		if (map != MAP_FAILED) {
+			journal_end = journal_scan(map, s.st_size);
+			munmap(map, s.st_size);
+		}
+	}
+
+	if (journal_end == 0) {
+		g_hash_table_remove_all(journal_index);
+		if ((ftruncate(journal_fd, 0) != 0) || (write(journal_fd, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != strlen(JOURNAL_MAGIC))) {
+			perror("Can't write undo journal");
+			journal_close();
+			return;
+		}
+		journal_end = strlen(JOURNAL_MAGIC);
+	} else if (journal_end < s.st_size) {
+		// a record was cut short
+		if (ftruncate(journal_fd, journal_end) != 0) perror("Can't truncate undo journal");
+	}
+
+	if (adopt) journal_adopt();
+}
+
+static undo_node_t *journal_read_node(undo_t *undo, const char *payload, uint32_t size) {
+	struct journal_node jn;
+	if (size < sizeof(jn)) return NULL;
+	memcpy(&jn, payload, sizeof(jn));
+	if (sizeof(jn) + (size_t)jn.deleted + jn.inserted > size) return NULL;
+
+	undo_node_t *node = undo_node_new(undo, jn.deleted, jn.inserted);
+	node->start = jn.start;
+	node->before_end = jn.before_end;
+	node->after_end = jn.after_end;
+	node->prefix = jn.prefix;
+	node->suffix = jn.suffix;
+	node->time = jn.time;
+	memcpy(undo_node_deleted(node), payload + sizeof(jn), jn.deleted);
+	memcpy(undo_node_inserted(node), payload + sizeof(jn) + jn.deleted, jn.inserted);
+
+	return node;
+}
+
+// moves the head of undo to the node marked as saved, returns false if there isn't one
+static bool journal_head_to_saved(undo_t *undo) {
+	for (undo_node_t *n = undo->root; n != NULL; n = n->next) {
+		if (n->saved) {
+			undo->head = n;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Replays the records of the file in undo, returns the hash of the contents of the file at the node marked as saved */
+static uint64_t journal_replay(undo_t *undo, struct journal_entry *e) {
+	uint64_t saved_hash = 0;
+
+	struct stat s;
+	if ((fstat(journal_fd, &s) != 0) || (s.st_size < journal_end)) return 0;
+
+	char *map = mmap(NULL, journal_end, PROT_READ, MAP_SHARED, journal_fd, 0);
+	if (map == MAP_FAILED) return 0;
+
+	for (int i = 0; i < e->n; ++i) {
+		struct journal_record r;
+		memcpy(&r, map + e->v[i], sizeof(r));
+		const char *payload = map + e->v[i] + sizeof(r);
+
+		switch (r.type) {
+		case JR_OPEN:
+			if (r.size < sizeof(uint64_t)) break;
+			if (r.flags & JR_RESTORED) {
+				journal_head_to_saved(undo);
+			} else {
+				size_t budget = undo->budget;
+				undo_free(undo);
+				undo_init(undo);
+				undo->budget = budget;
+			}
+			memcpy(&saved_hash, payload, sizeof(uint64_t));
+			break;
+
+		case JR_SAVED:
+			if (r.size < sizeof(uint64_t)) break;
+			undo_saved(undo);
+			memcpy(&saved_hash, payload, sizeof(uint64_t));
+			break;
+
+		case JR_PUSH: {
+			undo_node_t *node = journal_read_node(undo, payload, r.size);
+			if (node == NULL) break;
+			if ((r.flags & JR_FUSE) && ((undo->head == NULL) || undo->head->fake)) r.flags &= ~JR_FUSE;
+			undo_push(undo, node, r.flags & JR_FUSE);
+			break;
+		}
+
+		case JR_UNDO:
+			undo_pop(undo);
+			break;
+
+		case JR_REDO:
+			undo_redo_pop(undo);
+			break;
+		}
+	}
+
+	munmap(map, journal_end);
+	return saved_hash;
+}
+
+void journal_load(buffer_t *buffer) {
+	if (!journal_wants(buffer)) return;
+
+	uint64_t hash = journal_content_hash(buffer);
+	struct journal_entry *e = journal_entry(journal_key(buffer), false);
+
+	bool restored = false;
+
+	if (e != NULL) {
+		undo_t undo;
+		undo_init(&undo);
+		undo.budget = (size_t)config_intval(&(buffer->config), CFG_UNDO_MEMORY) * 1024 * 1024;
+
+		if ((journal_replay(&undo, e) == hash) && journal_head_to_saved(&undo)) {
+			undo_free(&(buffer->undo));
+			buffer->undo = undo;
+			restored = true;
+		} else {
+			undo_free(&undo);
+		}
+	}
+
+	struct iovec payload = { &hash, sizeof(hash) };
+	journal_write(JR_OPEN, restored ? JR_RESTORED : 0, journal_key(buffer), &payload, 1);
+	buffer->journaled = true;
+}
+
+void journal_push(buffer_t *buffer, undo_node_t *node, bool fuse) {
+	if (!buffer->journaled || !journal_wants(buffer)) return;
+
+	struct journal_node jn = {
+		node->start, node->before_end, node->after_end,
+		node->prefix, node->suffix,
+		node->deleted, node->inserted,
+		0, node->time
+	};
+
+	struct iovec payload[] = {
+		{ &jn, sizeof(jn) },
+		{ undo_node_deleted(node), node->deleted },
+		{ undo_node_inserted(node), node->inserted },
+	};
+
+	journal_write(JR_PUSH, fuse ? JR_FUSE : 0, journal_key(buffer), payload, 3);
+}
+
+void journal_move(buffer_t *buffer, bool redo) {
+	if (!buffer->journaled || !journal_wants(buffer)) return;
+	journal_write(redo ? JR_REDO : JR_UNDO, 0, journal_key(buffer), NULL, 0);
+}
+
+void journal_saved(buffer_t *buffer) {
+	if (!buffer->journaled || !journal_wants(buffer)) return;
+	journal_write_hash(JR_SAVED, 0, buffer);
+}
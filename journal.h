@@ -0,0 +1,24 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdbool.h>
+
+#include "buffer.h"
+
+/* Undo journal of a tied session, kept next to the session file. Every change to the undo history of a file buffer is appended to it as it happens, records are keyed by the path of the file.
+   When a file is opened its history is rebuilt from the journal, if the contents of the file are the ones the history was at when the file was last saved (or opened) */
+
+/* Starts writing to the journal of session (NULL to stop). If adopt is set the file buffers already open that aren't in the journal are added to it, with a history starting from their current contents */
+void journal_open(const char *session, bool adopt);
+
+// called after a file is loaded in buffer, restores its undo history
+void journal_load(buffer_t *buffer);
+
+// called before node is pushed on the undo list of buffer
+void journal_push(buffer_t *buffer, undo_node_t *node, bool fuse);
+// called after an undo (or redo) of buffer
+void journal_move(buffer_t *buffer, bool redo);
+// called after buffer is saved
+void journal_saved(buffer_t *buffer);
+
+#endif
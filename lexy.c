@@ -1,6 +1,7 @@
 #include "lexy.h"
 
 #include <stdlib.h>
+#include <limits.h>
 
 #include <tre/tre.h>
 
@@ -48,6 +49,17 @@ lexyassoc <lexy name>/<lexy state> <extension>
 
 pthread_attr_t lexy_thread_attrs;
 
+#define LEXY_WORKERS 2
+#define LEXY_NO_REQUEST INT_MAX
+
+static pthread_mutex_t lexy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lexy_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lexy_idle_cond = PTHREAD_COND_INITIALIZER;
+static buffer_t *lexy_queue_head = NULL, *lexy_queue_tail = NULL;
+static long lexy_requests = 0, lexy_coalesced = 0;
+
+static void *lexy_worker_thread(void *varg);
+
 int lexy_colors[0xff];
 
 #define LEXY_ASSOCIATION_NUMBER 1024
@@ -55,7 +67,6 @@ int lexy_colors[0xff];
 #define LEXY_STATUS_NUMBER LEXY_ROWS/LEXY_STATUS_BLOCK_SIZE
 #define LEXY_LINE_LENGTH_LIMIT 512
 
-#define LEXY_LOAD_HOOK_MAX_COUNT 4096
 #define LEXY_QUICK_EXIT_MAX_COUNT 10
 
 #define LEXY_DEFAULT_LINK_OPEN_FN "teddy_intl::link_open"
@@ -72,6 +83,14 @@ enum match_kind {
 	LM_UNKNOWN,
 };
 
+/* Keywords of a LM_KEYWORDS row are compiled into a trie, children of a node are contiguous in the node array and sorted by code */
+struct kw_node {
+	uint32_t code;
+	int children, nchildren;
+	int end_kw; // index of the first keyword ending at this node, INT_MAX if there isn't one
+	int bound_kw; // index of the first keyword ending at this node with a word boundary ('>'), INT_MAX if there isn't one
+};
+
 struct lexy_row {
 	bool enabled;
 	bool jump;
@@ -79,9 +98,7 @@ struct lexy_row {
 	enum match_kind match_kind;
 
 	/* LM_KEYWORDS */
-	int kwlen;
-	uint32_t *kws;
-	bool kwsp; /* enable special character match */
+	struct kw_node *kwtrie;
 
 	/* LM_REGION */
 	uint32_t *region_end;
@@ -126,6 +143,13 @@ void lexy_init(void) {
 
 	pthread_attr_init(&lexy_thread_attrs);
 	pthread_attr_setdetachstate(&lexy_thread_attrs, PTHREAD_CREATE_DETACHED);
+
+	for (int i = 0; i < LEXY_WORKERS; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, &lexy_thread_attrs, lexy_worker_thread, NULL) != 0) {
+			perror("Can not start lexy thread");
+		}
+	}
 }
 
 int lexy_find_status(const char *name) {
@@ -272,6 +296,118 @@ static struct lexy_row *new_row_for_state(int state) {
 	return NULL;
 }
 
+struct kw_tmp_node {
+	uint32_t code;
+	int first_child, next_sibling;
+	int end_kw, bound_kw;
+};
+
+/* Compiles the list of keywords kws (separated by '\0'), when special is set '>' marks the end of a keyword that must be followed by a character that can not be part of a word */
+static struct kw_node *kwtrie_compile(const uint32_t *kws, int kwlen, bool special) {
+	int cap = kwlen + 1, n = 1;
+	struct kw_tmp_node *tmp = malloc(sizeof(struct kw_tmp_node) * cap);
+	alloc_assert(tmp);
+
+	tmp[0].code = 0;
+	tmp[0].first_child = tmp[0].next_sibling = -1;
+	tmp[0].end_kw = tmp[0].bound_kw = INT_MAX;
+
+	int kw = 0;
+	for (int start = 0; start < kwlen; ++kw) {
+		int cur = 0;
+		bool bound = false;
+		int i;
+		for (i = start; (i < kwlen) && (kws[i] != '\0'); ++i) {
+			if (special && (kws[i] == '>')) {
+				bound = true;
+				break;
+			}
+
+			// find the child for kws[i], keeping children sorted
+			int *link = &(tmp[cur].first_child);
+			while ((*link >= 0) && (tmp[*link].code < kws[i])) link = &(tmp[*link].next_sibling);
+			if ((*link < 0) || (tmp[*link].code != kws[i])) {
+				tmp[n].code = kws[i];
+				tmp[n].first_child = -1;
+				tmp[n].next_sibling = *link;
+				tmp[n].end_kw = tmp[n].bound_kw = INT_MAX;
+				*link = n++;
+			}
+			cur = *link;
+		}
+
+		if (bound) {
+			tmp[cur].bound_kw = MIN(tmp[cur].bound_kw, kw);
+		} else {
+			tmp[cur].end_kw = MIN(tmp[cur].end_kw, kw);
+		}
+
+		// moving to next keyword
+		for (; (i < kwlen) && (kws[i] != '\0'); ++i);
+		start = i+1;
+	}
+
+	// lay out nodes breadth first so that the children of every node are contiguous
+	int *queue = malloc(sizeof(int) * n);
+	alloc_assert(queue);
+	struct kw_node *trie = malloc(sizeof(struct kw_node) * n);
+	alloc_assert(trie);
+
+	queue[0] = 0;
+	int qn = 1;
+	for (int qi = 0; qi < qn; ++qi) {
+		struct kw_tmp_node *t = tmp + queue[qi];
+		trie[qi].code = t->code;
+		trie[qi].end_kw = t->end_kw;
+		trie[qi].bound_kw = t->bound_kw;
+		trie[qi].children = qn;
+		trie[qi].nchildren = 0;
+		for (int c = t->first_child; c >= 0; c = tmp[c].next_sibling) {
+			queue[qn++] = c;
+			++(trie[qi].nchildren);
+		}
+	}
+
+	free(queue);
+	free(tmp);
+	return trie;
+}
+
+/* Returns the length of the first keyword (in definition order) that matches at start, -1 if none does */
+static int kwtrie_match(struct kw_node *trie, buffer_t *buffer, int start) {
+	int best = INT_MAX, best_len = -1;
+	struct kw_node *node = trie;
+
+	for (int d = 0; ; ++d) {
+		my_glyph_info_t *g = bat(buffer, start + d);
+
+		if (node->end_kw < best) {
+			best = node->end_kw;
+			best_len = d;
+		}
+		if ((node->bound_kw < best) && (g != NULL) && !u_isalnum(g->code) && (g->code != '_')) {
+			best = node->bound_kw;
+			best_len = d;
+		}
+
+		if ((g == NULL) || (node->nchildren == 0)) break;
+
+		int lo = node->children, hi = node->children + node->nchildren;
+		while (lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+			if (trie[mid].code < g->code) {
+				lo = mid+1;
+			} else {
+				hi = mid;
+			}
+		}
+		if ((lo >= node->children + node->nchildren) || (trie[lo].code != g->code)) break;
+		node = trie + lo;
+	}
+
+	return best_len;
+}
+
 static enum match_kind parse_match_kind(const char *match_kind) {
 	if (strcmp(match_kind, "keywords") == 0) {
 		return LM_KEYWORDS;
@@ -375,15 +511,17 @@ int lexy_append_command(ClientData client_data, Tcl_Interp *interp, int argc, co
 		new_row->enabled = true;
 		break;
 
-	case LM_KEYWORDS:
-		new_row->kws = utf8_to_utf32_string(pattern, &(new_row->kwlen));
-		new_row->kwsp = true;
-		alloc_assert(new_row->kws);
-		for (int i = 0; i < new_row->kwlen; ++i) {
-			if (new_row->kws[i] == '|') new_row->kws[i] = '\0';
+	case LM_KEYWORDS: {
+		int kwlen;
+		uint32_t *kws = utf8_to_utf32_string(pattern, &kwlen);
+		for (int i = 0; i < kwlen; ++i) {
+			if (kws[i] == '|') kws[i] = '\0';
 		}
+		new_row->kwtrie = kwtrie_compile(kws, kwlen, true);
+		free(kws);
 		new_row->enabled = true;
 		break;
+	}
 
 	case LM_ANY:
 		new_row->enabled = true;
@@ -406,9 +544,10 @@ int lexy_append_command(ClientData client_data, Tcl_Interp *interp, int argc, co
 		}
 
 		new_row->match_kind = LM_KEYWORDS;
-		new_row->kws = utf8_to_utf32_string(start, &(new_row->kwlen));
-		new_row->kwsp = false;
-		alloc_assert(new_row->kws);
+		int kwlen;
+		uint32_t *kws = utf8_to_utf32_string(start, &kwlen);
+		new_row->kwtrie = kwtrie_compile(kws, kwlen, false);
+		free(kws);
 		new_row->check = false;
 		new_row->enabled = true;
 
@@ -484,7 +623,7 @@ static int bufmatch(buffer_t *buffer, int start, const uint32_t *needle, bool sp
 	return i;
 }
 
-static void lexy_update_one_token(int dirfd, buffer_t *buffer, int *i, int *status) {
+static void lexy_update_one_token(int dirfd, buffer_t *buffer, struct tre_window *win, int *i, int *status) {
 	int base = *status;
 
 	//printf("Coloring one token at %p:%d (status %d)\n", buffer, *i, *status);
@@ -520,13 +659,12 @@ static void lexy_update_one_token(int dirfd, buffer_t *buffer, int *i, int *stat
 			matchpoint.offset = 0;
 			matchpoint.endatnewline = true;
 			matchpoint.endatspace = !(row->match_kind == LM_REGEXP_SPACE);
+			matchpoint.limit = -1;
 
-			tre_str_source tss;
-			tre_bridge_init(&matchpoint, &tss);
 #define NMATCH 10
 			regmatch_t pmatch[NMATCH];
 			//printf("\tPattern matching:\n");
-			int r = tre_reguexec(&(row->pattern), &tss, NMATCH, pmatch, 0);
+			int r = tre_window_exec(win, &(row->pattern), &matchpoint, NMATCH, pmatch, 0);
 			//printf("\tdone %d %d\n", r, REG_OK);
 
 			if (r == REG_OK) {
@@ -552,22 +690,7 @@ static void lexy_update_one_token(int dirfd, buffer_t *buffer, int *i, int *stat
 			break;
 
 		case LM_KEYWORDS:
-			for (int start = 0; start < row->kwlen; ) {
-				//printf("Matching %d <%s>\n", row->kwlen, row->kws + start);
-				int m = bufmatch(buffer, *i, row->kws + start, row->kwsp);
-				if (m >= 0) {
-					match_len = m;
-					break;
-				} else {
-					// moving to next keyword
-					for (; start < row->kwlen; ++start) {
-						if (row->kws[start] == '\0') {
-							++start;
-							break;
-						}
-					}
-				}
-			}
+			match_len = kwtrie_match(row->kwtrie, buffer, *i);
 			break;
 
 		case LM_ANY:
@@ -654,18 +777,51 @@ static void refresher_add(buffer_t *buffer) {
 	if (editor != NULL) g_idle_add((GSourceFunc)refresher, editor);
 }
 
-static void *lexy_update_starting_at_thread(void *varg) {
-	buffer_t *buffer = (buffer_t *)varg;
-
-	int start_status_index = lexy_start_status_for_buffer(buffer);
-	if (start_status_index < 0) {
-		buffer->lexy_running = 0;
-		return NULL;
+/* Highlighting is done by a fixed pool of worker threads shared by all buffers.
+Buffers that need highlighting are put in lexy_queue with the point where highlighting should start (lexy_start), requests for a buffer that is already queued (or that a worker picked up but didn't start on yet) are coalesced by moving lexy_start back.
+Once a worker starts on a buffer it sets lexy_start to LEXY_NO_REQUEST, requests received after that requeue the buffer when the worker is done with it.
+The end of the changed text is kept in lexy_dirty_tail as a distance from the end of the buffer, so that it stays valid when text is changed before it.
+At every line boundary the tokenizer records its status in the checkpoints of the line index, once it's past the changed text and reaches a line whose checkpoint didn't change it stops: everything after it would be highlighted the same way.
+A worker that is highlighting a buffer holds its read lock, it gives it up (and suspends the buffer, remembering where it stopped) as soon as someone asks for the write lock through release_read_lock.
+Everything in buffer_t that starts with lexy_ and the queue itself are protected by lexy_mutex. */
+
+static void lexy_enqueue(buffer_t *buffer) {
+	buffer->lexy_running = LEXY_QUEUED;
+	buffer->lexy_next = NULL;
+	if (lexy_queue_tail != NULL) {
+		lexy_queue_tail->lexy_next = buffer;
+	} else {
+		lexy_queue_head = buffer;
 	}
+	lexy_queue_tail = buffer;
+	pthread_cond_signal(&lexy_queue_cond);
+}
+
+static buffer_t *lexy_dequeue(void) {
+	buffer_t *buffer = lexy_queue_head;
+	if (buffer == NULL) return NULL;
+	lexy_queue_head = buffer->lexy_next;
+	if (lexy_queue_head == NULL) lexy_queue_tail = NULL;
+	buffer->lexy_next = NULL;
+	return buffer;
+}
 
-	pthread_rwlock_rdlock(&(buffer->rwlock));
+static void lexy_queue_remove(buffer_t *buffer) {
+	buffer_t *prev = NULL;
+	for (buffer_t *cur = lexy_queue_head; cur != NULL; prev = cur, cur = cur->lexy_next) {
+		if (cur != buffer) continue;
+		if (prev != NULL) prev->lexy_next = cur->lexy_next; else lexy_queue_head = cur->lexy_next;
+		if (lexy_queue_tail == cur) lexy_queue_tail = prev;
+		cur->lexy_next = NULL;
+		return;
+	}
+}
 
-	int start = buffer->lexy_start;
+/* Highlights buffer starting at start, must be called with the read lock held.
+Returns true if it got to the end (or to a line that doesn't need to be highlighted again after dirty_end), otherwise *stop is set to the point where it was interrupted */
+static bool lexy_update_buffer(buffer_t *buffer, int start, int dirty_end, int quick_exit, int *stop) {
+	int start_status_index = lexy_start_status_for_buffer(buffer);
+	if (start_status_index < 0) return true;
 
 	//printf("Coloring buffer %p (%s) starting at %d (%zd)\n", buffer, buffer->path, start, BSIZE(buffer));
 
@@ -681,10 +837,16 @@ static void *lexy_update_starting_at_thread(void *varg) {
 		The only type of token that can span multiple lines is the region match but that will work (because it is a separate state in the state machine)*/
 
 		buffer_move_point_glyph(buffer, &start, MT_ABS, 1);
-		if (start > 0) --start;
-		my_glyph_info_t *glyph = bat(buffer, start);
-		status = (glyph != NULL) ? glyph->status : start_status_index;
-		if (status == 0xffff) status = start_status_index;
+		int k = buffer_newlines_before(buffer, start);
+		uint16_t checkpoint = (k > 0) ? *buffer_line_checkpoint(buffer, k-1) : LEXY_NO_CHECKPOINT;
+		if (checkpoint != LEXY_NO_CHECKPOINT) {
+			status = checkpoint;
+		} else {
+			if (start > 0) --start;
+			my_glyph_info_t *glyph = bat(buffer, start);
+			status = (glyph != NULL) ? glyph->status : start_status_index;
+			if (status == 0xffff) status = start_status_index;
+		}
 	}
 
 	char *dir = buffer_directory(buffer);
@@ -700,6 +862,12 @@ static void *lexy_update_starting_at_thread(void *varg) {
 	//printf("Buffer <%s> status: %d lexy_start_status_for_buffer %d\n", buffer->path, status, start_status_index);
 
 	int count = 0;
+	bool r = true;
+	int k = buffer_newlines_before(buffer, start); // next newline to check
+	bool converged = false;
+
+	struct tre_window win;
+	tre_window_init(&win);
 
 	for (int i = start; i < BSIZE(buffer); ) {
 		my_glyph_info_t *g = bat(buffer, i);
@@ -711,93 +879,212 @@ static void *lexy_update_starting_at_thread(void *varg) {
 
 		int previ = i;
 
-		if (buffer->release_read_lock) {
+		if (__atomic_load_n(&(buffer->release_read_lock), __ATOMIC_SEQ_CST)) {
 			//printf("Lexy preempted\n");
-			buffer->lexy_running = 2;
-			goto lexy_update_starting_at_thread_end;
+			*stop = i;
+			r = false;
+			break;
 		}
 
-		lexy_update_one_token(dirfd, buffer, &i, &status);
+		lexy_update_one_token(dirfd, buffer, &win, &i, &status);
 
 		if (previ == i) ++i;
-		if (count > LEXY_LOAD_HOOK_MAX_COUNT) break;
 
-		if (buffer->lexy_quick_exit > 0) {
-			if (count > buffer->lexy_quick_exit) {
-				//printf("Self preemption\n");
-				buffer->lexy_running = 2;
-				goto lexy_update_starting_at_thread_end;
+		for (; k < LSIZE(buffer); ++k) {
+			int nl = buffer_newline_position(buffer, k);
+			if (nl >= i) break;
+			uint16_t *checkpoint = buffer_line_checkpoint(buffer, k);
+			if (nl+1 != i) {
+				// the newline is in the middle of a token, there is no status for the beginning of the next line
+				*checkpoint = LEXY_NO_CHECKPOINT;
+				continue;
+			}
+			if ((*checkpoint == status) && (i >= dirty_end)) {
+				converged = true;
+				break;
 			}
+			*checkpoint = status;
+		}
+		if (converged) break;
+
+		if ((quick_exit > 0) && (count > quick_exit)) {
+			//printf("Self preemption\n");
+			*stop = i;
+			r = false;
+			break;
 		}
 	}
 
-	//printf("Lexy finished\n");
+	tre_window_free(&win);
+	close(dirfd);
+	return r;
+}
 
-	buffer->lexy_running = 0;
+static void *lexy_worker_thread(void *varg) {
+	pthread_mutex_lock(&lexy_mutex);
+
+	for (;;) {
+		buffer_t *buffer;
+		while ((buffer = lexy_dequeue()) == NULL) {
+			pthread_cond_wait(&lexy_queue_cond, &lexy_mutex);
+		}
+		buffer->lexy_running = LEXY_RUNNING;
+		pthread_mutex_unlock(&lexy_mutex);
+
+		pthread_rwlock_rdlock(&(buffer->rwlock));
+
+		// requests that arrived while we were waiting for the read lock are already merged into lexy_start
+		pthread_mutex_lock(&lexy_mutex);
+		int start = buffer->lexy_start;
+		int dirty_tail = buffer->lexy_dirty_tail;
+		int quick_exit = buffer->lexy_quick_exit;
+		buffer->lexy_start = LEXY_NO_REQUEST;
+		pthread_mutex_unlock(&lexy_mutex);
+
+		int stop = start;
+		bool finished = lexy_update_buffer(buffer, start, BSIZE(buffer) - dirty_tail, quick_exit, &stop);
+
+		pthread_rwlock_unlock(&(buffer->rwlock));
+		refresher_add(buffer);
+
+		pthread_mutex_lock(&lexy_mutex);
+		if (buffer->lexy_start != LEXY_NO_REQUEST) {
+			// the buffer was changed after we started
+			if (!finished) {
+				buffer->lexy_start = MIN(buffer->lexy_start, stop);
+				buffer->lexy_dirty_tail = MIN(buffer->lexy_dirty_tail, dirty_tail);
+			}
+			lexy_enqueue(buffer);
+		} else if (finished) {
+			buffer->lexy_running = LEXY_IDLE;
+		} else {
+			buffer->lexy_running = LEXY_SUSPENDED;
+			buffer->lexy_start = stop;
+			buffer->lexy_dirty_tail = dirty_tail;
+		}
+		pthread_cond_broadcast(&lexy_idle_cond);
+	}
 
-lexy_update_starting_at_thread_end:
-	close(dirfd);
-	pthread_rwlock_unlock(&(buffer->rwlock));
-	refresher_add(buffer);
 	return NULL;
 }
 
 void lexy_update_resume(buffer_t *buffer) {
-	if (buffer->lexy_running != 2) return;
 	if (config_intval(&(buffer->config), CFG_LEXY_ENABLED) == 0) return;
-	buffer->lexy_quick_exit = -1;
-	buffer->lexy_running = 1;
-	pthread_t thread;
-	if (pthread_create(&thread, &lexy_thread_attrs, lexy_update_starting_at_thread, buffer) != 0) {
-		buffer->lexy_running = 0;
-		perror("Can not start new thread");
+	pthread_mutex_lock(&lexy_mutex);
+	if (buffer->lexy_running == LEXY_SUSPENDED) {
+		++lexy_requests;
+		buffer->lexy_quick_exit = -1;
+		lexy_enqueue(buffer);
 	}
+	pthread_mutex_unlock(&lexy_mutex);
 }
 
-void lexy_update_starting_at(buffer_t *buffer, int start, bool quick_exit) {
+void lexy_update_starting_at(buffer_t *buffer, int start, int end, bool quick_exit) {
 	/* Skip doing updates for +unnamed buffers, they are always temp buffers used for computations */
 	if (config_intval(&(buffer->config), CFG_LEXY_ENABLED) == 0) return;
 	if (strcmp(buffer->path, "+unnamed") == 0) return;
 
-	if (buffer->lexy_running == 1) {
-		// this function runs with the write lock acquired, we can only see lexy_running == 1
-		// when the lexy thread is running but hasn't acquired the read lock yet.
-		// just update the start
+	int nlines = LEXY_QUICK_EXIT_MAX_COUNT;
+	GtkAllocation alloc;
+	editor_t *editor = NULL;
+	find_editor_for_buffer(buffer, NULL, NULL, &editor);
+	if (editor != NULL) {
+		gtk_widget_get_allocation(GTK_WIDGET(editor), &alloc);
+		nlines = alloc.height / buffer->line_height + 1;
+	}
+
+	int dirty_tail = (start < 0) ? 0 : (BSIZE(buffer) - MIN(end, BSIZE(buffer)));
+
+	pthread_mutex_lock(&lexy_mutex);
+
+	++lexy_requests;
+
+	switch (buffer->lexy_running) {
+	case LEXY_QUEUED:
+	case LEXY_RUNNING:
+		if (buffer->lexy_start == LEXY_NO_REQUEST) {
+			// the worker already started on this buffer and released the read lock to let this change happen, it will requeue the buffer
+			buffer->lexy_start = start;
+			buffer->lexy_dirty_tail = dirty_tail;
+			buffer->lexy_quick_exit = quick_exit ? nlines : -1;
+			break;
+		}
+		// a worker will get to this buffer, just move the start back
 		//printf("%p Continuing at %d %d -> %d\n", buffer, buffer->lexy_start, start, MIN(buffer->lexy_start, start));
+		++lexy_coalesced;
+		if (abs(buffer->lexy_start - start) > 1000) quick_exit = false;
 		buffer->lexy_start = MIN(buffer->lexy_start, start);
-		return;
-	} else if (buffer->lexy_running == 2) {
-		// the lexy thread was preempted by a buffer update (buffer_replace_selection / buffer_undo)
-		// update lexy_start and restart the thread
+		buffer->lexy_dirty_tail = MIN(buffer->lexy_dirty_tail, dirty_tail);
+		if (!quick_exit) buffer->lexy_quick_exit = -1;
+		break;
+
+	case LEXY_SUSPENDED:
+		// the worker was preempted by a buffer update (buffer_replace_selection / buffer_undo) or stopped after the visible lines
 		//printf("%p Restarting at %d %d -> %d\n", buffer, buffer->lexy_start, start, MIN(buffer->lexy_start, start));
+		++lexy_coalesced;
+		if (abs(buffer->lexy_start - start) > 1000) quick_exit = false;
 		buffer->lexy_start = MIN(buffer->lexy_start, start);
-	} else if (buffer->lexy_running == 0) {
+		buffer->lexy_dirty_tail = MIN(buffer->lexy_dirty_tail, dirty_tail);
+		buffer->lexy_quick_exit = quick_exit ? nlines : -1;
+		lexy_enqueue(buffer);
+		break;
+
+	case LEXY_IDLE:
 		//printf("%p Starting at %d\n", buffer, start);
 		buffer->lexy_start = start;
+		buffer->lexy_dirty_tail = dirty_tail;
+		buffer->lexy_quick_exit = quick_exit ? nlines : -1;
+		lexy_enqueue(buffer);
+		break;
 	}
 
-	if (quick_exit) {
-		if (abs(buffer->lexy_start - start) > 1000) {
-			quick_exit = false;
+	pthread_mutex_unlock(&lexy_mutex);
+}
+
+void lexy_forget(buffer_t *buffer) {
+	__atomic_store_n(&(buffer->release_read_lock), 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&lexy_mutex);
+	for (;;) {
+		if (buffer->lexy_running == LEXY_QUEUED) {
+			lexy_queue_remove(buffer);
+		} else if (buffer->lexy_running == LEXY_RUNNING) {
+			// the worker could also requeue the buffer when it's done
+			pthread_cond_wait(&lexy_idle_cond, &lexy_mutex);
+			continue;
 		}
+		break;
 	}
+	buffer->lexy_running = LEXY_IDLE;
+	pthread_mutex_unlock(&lexy_mutex);
+}
 
-	int nlines = LEXY_QUICK_EXIT_MAX_COUNT;
-	GtkAllocation alloc;
-	editor_t *editor = NULL;
-	find_editor_for_buffer(buffer, NULL, NULL, &editor);
-	if (editor != NULL) {
-		gtk_widget_get_allocation(GTK_WIDGET(editor), &alloc);
-		nlines = alloc.height / buffer->line_height + 1;
+bool lexy_wait(buffer_t *buffer, int msec) {
+	struct timespec tv;
+	clock_gettime(CLOCK_REALTIME, &tv);
+	tv.tv_sec += msec / 1000;
+	tv.tv_nsec += (msec % 1000) * 1000000;
+	if (tv.tv_nsec >= 1000000000) {
+		++tv.tv_sec;
+		tv.tv_nsec -= 1000000000;
 	}
 
-	buffer->lexy_running = 1;
-	buffer->lexy_quick_exit = quick_exit ? nlines : -1;
-	pthread_t thread;
-	if (pthread_create(&thread, &lexy_thread_attrs, lexy_update_starting_at_thread, buffer) != 0) {
-		buffer->lexy_running = 0;
-		perror("Can not start new thread");
+	pthread_mutex_lock(&lexy_mutex);
+	int r = 0;
+	while (((buffer->lexy_running == LEXY_QUEUED) || (buffer->lexy_running == LEXY_RUNNING)) && (r == 0)) {
+		r = pthread_cond_timedwait(&lexy_idle_cond, &lexy_mutex, &tv);
 	}
+	bool idle = (buffer->lexy_running == LEXY_IDLE) || (buffer->lexy_running == LEXY_SUSPENDED);
+	pthread_mutex_unlock(&lexy_mutex);
+
+	return idle;
+}
+
+void lexy_stats(long *requests, long *coalesced) {
+	pthread_mutex_lock(&lexy_mutex);
+	*requests = lexy_requests;
+	*coalesced = lexy_coalesced;
+	pthread_mutex_unlock(&lexy_mutex);
 }
 
 int lexy_parse_token(int state, const char *text, char **file, char **line, char **col) {
@@ -12,8 +12,15 @@
 void lexy_init(void);
 int lexy_find_status(const char *name);
 int lexy_start_status_for_buffer(buffer_t *buffer);
-void lexy_update_starting_at(buffer_t *buffer, int start, bool quick_exit);
+// highlights buffer again after the text between start and end changed (start = -1 highlights the whole buffer)
+void lexy_update_starting_at(buffer_t *buffer, int start, int end, bool quick_exit);
 void lexy_update_resume(buffer_t *buffer);
+// removes buffer from the highlighting queue, waiting for the workers to stop using it
+void lexy_forget(buffer_t *buffer);
+// waits (at most msec milliseconds) for pending highlighting of buffer to finish, returns false if it didn't
+bool lexy_wait(buffer_t *buffer, int msec);
+// number of highlighting requests received and of requests merged with a pending one
+void lexy_stats(long *requests, long *coalesced);
 
 int lexy_append_command(ClientData client_data, Tcl_Interp *interp, int argc, const char *argv[]);
 
@@ -0,0 +1,152 @@
+#include "litsearch.h"
+
+#include <stdlib.h>
+#include <unicode/uchar.h>
+
+#include "global.h"
+
+// needles shorter than this are searched by looking for their first character
+#define LITSEARCH_SHORT_NEEDLE 4
+
+#define SKIP_MASK (LITSEARCH_SKIP_SIZE - 1)
+
+static inline uint32_t fold(struct litsearch_t *ls, uint32_t c) {
+	if (ls->case_sensitive) return c;
+	if (c < 0x80) return ((c >= 'A') && (c <= 'Z')) ? c + ('a' - 'A') : c;
+	return u_tolower(c);
+}
+
+void litsearch_init(struct litsearch_t *ls, const uint32_t *needle, int len, bool case_sensitive) {
+	ls->case_sensitive = case_sensitive;
+	ls->len = len;
+	ls->needle = malloc(sizeof(uint32_t) * MAX(len, 1));
+	alloc_assert(ls->needle);
+
+	for (int i = 0; i < len; ++i) {
+		ls->needle[i] = fold(ls, needle[i]);
+	}
+
+	for (int c = 0; c < LITSEARCH_SKIP_SIZE; ++c) {
+		ls->fwd_skip[c] = ls->bwd_skip[c] = MAX(len, 1);
+	}
+
+	// characters that share a slot get the smallest shift of any of them
+	for (int i = 0; i < len-1; ++i) {
+		ls->fwd_skip[ls->needle[i] & SKIP_MASK] = len-1-i;
+	}
+	for (int i = len-1; i > 0; --i) {
+		ls->bwd_skip[ls->needle[i] & SKIP_MASK] = i;
+	}
+}
+
+void litsearch_free(struct litsearch_t *ls) {
+	free(ls->needle);
+	ls->needle = NULL;
+}
+
+// compares the needle with text starting at s, the first character is assumed to have already been checked
+static inline bool litsearch_rest(struct litsearch_t *ls, const my_glyph_info_t *text, int s) {
+	for (int i = 1; i < ls->len; ++i) {
+		if (fold(ls, text[s+i].code) != ls->needle[i]) return false;
+	}
+	return true;
+}
+
+/* Searches text for the first occurrence starting between from and to (inclusive), every character of these occurrences must be inside text */
+static int forward_contiguous(struct litsearch_t *ls, const my_glyph_info_t *text, int from, int to) {
+	uint32_t first = ls->needle[0];
+
+	if (ls->len < LITSEARCH_SHORT_NEEDLE) {
+		for (int s = from; s <= to; ++s) {
+			if ((fold(ls, text[s].code) == first) && litsearch_rest(ls, text, s)) return s;
+		}
+		return -1;
+	}
+
+	int last = ls->len-1;
+	uint32_t lastc = ls->needle[last];
+
+	for (int s = from; s <= to; ) {
+		uint32_t c = fold(ls, text[s+last].code);
+		if ((c == lastc) && (fold(ls, text[s].code) == first) && litsearch_rest(ls, text, s)) return s;
+		s += ls->fwd_skip[c & SKIP_MASK];
+	}
+
+	return -1;
+}
+
+/* Searches text for the last occurrence starting between to and from (inclusive, from >= to) */
+static int backward_contiguous(struct litsearch_t *ls, const my_glyph_info_t *text, int from, int to) {
+	uint32_t first = ls->needle[0];
+
+	if (ls->len < LITSEARCH_SHORT_NEEDLE) {
+		for (int s = from; s >= to; --s) {
+			if ((fold(ls, text[s].code) == first) && litsearch_rest(ls, text, s)) return s;
+		}
+		return -1;
+	}
+
+	for (int s = from; s >= to; ) {
+		uint32_t c = fold(ls, text[s].code);
+		if ((c == first) && litsearch_rest(ls, text, s)) return s;
+		s -= ls->bwd_skip[c & SKIP_MASK];
+	}
+
+	return -1;
+}
+
+// occurrence starting at s that crosses the gap
+static bool litsearch_across_gap(struct litsearch_t *ls, buffer_t *buffer, int s) {
+	for (int i = 0; i < ls->len; ++i) {
+		if (fold(ls, bat(buffer, s+i)->code) != ls->needle[i]) return false;
+	}
+	return true;
+}
+
+int litsearch_forward(struct litsearch_t *ls, buffer_t *buffer, int start, int end) {
+	int last = MIN(end, BSIZE(buffer) - ls->len);
+	if (start < 0) start = 0;
+	if (ls->len == 0) return (start <= last) ? start : -1;
+	if (start > last) return -1;
+
+	int gap = buffer->gap;
+
+	// occurrences before the gap
+	int to = MIN(last, gap - ls->len);
+	if (start <= to) {
+		int r = forward_contiguous(ls, buffer->buf, start, to);
+		if (r >= 0) return r;
+		start = to+1;
+	}
+
+	for (; (start <= last) && (start < gap); ++start) {
+		if (litsearch_across_gap(ls, buffer, start)) return start;
+	}
+
+	if (start > last) return -1;
+
+	// occurrences after the gap, point p of the buffer is at buf + gapsz + p
+	return forward_contiguous(ls, buffer->buf + buffer->gapsz, start, last);
+}
+
+int litsearch_backward(struct litsearch_t *ls, buffer_t *buffer, int start) {
+	start = MIN(start, BSIZE(buffer) - ls->len);
+	if (start < 0) return -1;
+	if (ls->len == 0) return start;
+
+	int gap = buffer->gap;
+
+	if (start >= gap) {
+		int r = backward_contiguous(ls, buffer->buf + buffer->gapsz, start, gap);
+		if (r >= 0) return r;
+		start = gap-1;
+	}
+
+	for (; (start >= 0) && (start > gap - ls->len); --start) {
+		if (litsearch_across_gap(ls, buffer, start)) return start;
+	}
+
+	if (start < 0) return -1;
+
+	return backward_contiguous(ls, buffer->buf, start, 0);
+}
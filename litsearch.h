@@ -0,0 +1,28 @@
+#ifndef __LITSEARCH_H__
+#define __LITSEARCH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "buffer.h"
+
+#define LITSEARCH_SKIP_SIZE 256
+
+/* Literal search of a string in a buffer, works directly on the two halves of the gap buffer.
+   Short needles are found by scanning for their first character, longer ones with Horspool's algorithm */
+struct litsearch_t {
+	uint32_t *needle; // case folded unless case_sensitive is set
+	int len;
+	bool case_sensitive;
+	int fwd_skip[LITSEARCH_SKIP_SIZE], bwd_skip[LITSEARCH_SKIP_SIZE]; // shift tables, indexed by the low bits of a character
+};
+
+void litsearch_init(struct litsearch_t *ls, const uint32_t *needle, int len, bool case_sensitive);
+void litsearch_free(struct litsearch_t *ls);
+
+// returns the first position between start and end (inclusive) where the needle occurs, or -1
+int litsearch_forward(struct litsearch_t *ls, buffer_t *buffer, int start, int end);
+// returns the last position at or before start where the needle occurs, or -1
+int litsearch_backward(struct litsearch_t *ls, buffer_t *buffer, int start);
+
+#endif
@@ -11,10 +11,16 @@
 #include "global.h"
 #include "treint.h"
 #include "lexy.h"
+#include "litsearch.h"
+#include "searchidx.h"
+
+// regexps that can't match a newline are run on chunks of lines this long, instead of the rest of the buffer
+#define RESEARCH_CHUNK (64 * 1024)
 
 static void research_free_temp(struct research_t *r) {
 	if (r->mode == SM_REGEXP) {
 		tre_regfree(&(r->regexp));
+		tre_window_free(&(r->window));
 		if (r->cmd != NULL) {
 			Tcl_Free(r->cmd);
 			r->cmd = NULL;
@@ -33,6 +39,7 @@ static void research_free_temp(struct research_t *r) {
 
 void quit_search_mode(editor_t *editor, bool clear_selection) {
 	research_free_temp(&(editor->research));
+	searchidx_cancel();
 	if (editor->research.mode == SM_LITERAL) {
 		char *x = utf32_to_utf8_string(editor->research.literal_text, editor->research.literal_text_cap);
 		history_add(&search_history, time(NULL), NULL, x, true);
@@ -63,62 +70,61 @@ static void search_start_point(editor_t *editor, bool ctrl_g_invoked, bool start
 	}
 }
 
-typedef bool uchar_match_fn(uint32_t a, uint32_t b);
-
-static bool uchar_match_case_sensitive(uint32_t a, uint32_t b) {
-	return a == b;
-}
-
-static bool uchar_match_case_insensitive(uint32_t a, uint32_t b) {
-	return u_tolower(a) == u_tolower(b);
-}
-
-static uchar_match_fn *should_be_case_sensitive(buffer_t *buffer, uint32_t *needle, int len) {
-	if (config_intval(&(buffer->config), CFG_INTERACTIVE_SEARCH_CASE_SENSITIVE) == 0) return uchar_match_case_insensitive;
-	if (config_intval(&(buffer->config), CFG_INTERACTIVE_SEARCH_CASE_SENSITIVE) == 1) return uchar_match_case_sensitive;
+static bool should_be_case_sensitive(buffer_t *buffer, uint32_t *needle, int len) {
+	if (config_intval(&(buffer->config), CFG_INTERACTIVE_SEARCH_CASE_SENSITIVE) == 0) return false;
+	if (config_intval(&(buffer->config), CFG_INTERACTIVE_SEARCH_CASE_SENSITIVE) == 1) return true;
 
 	// smart case sensitiveness set up here
 
 	for (int i = 0; i < len; ++i) {
-		if (u_isupper(needle[i])) return uchar_match_case_sensitive;
+		if (u_isupper(needle[i])) return true;
 	}
 
-	return uchar_match_case_insensitive;
+	return false;
 }
 
 static void move_incremental_search(editor_t *editor, bool ctrl_g_invoked, bool direction_forward, bool restart) {
 	int dst = editor->research.literal_text_cap;
 	uint32_t *needle = editor->research.literal_text;
 
-	uchar_match_fn *match_fn = should_be_case_sensitive(editor->buffer, needle, dst);
+	bool case_sensitive = should_be_case_sensitive(editor->buffer, needle, dst);
+	searchidx_request(editor->buffer, needle, dst, case_sensitive);
+
+	struct litsearch_t ls;
+	litsearch_init(&ls, needle, dst, case_sensitive);
 
 	int search_point;
 	search_start_point(editor, ctrl_g_invoked, direction_forward, &search_point);
 
-	int direction = direction_forward ? +1 : -1;
-
-#define OS(start, offset) (start + direction * offset)
-
-	int i = 0, j = 0;
-	int needle_start = direction_forward ? 0 : dst-1;
-
-	for (; (OS(search_point, i) >= 0) && (OS(search_point, i) < BSIZE(editor->buffer)); ++i) {
-		if (j >= dst) break;
-		if (match_fn(bat(editor->buffer, OS(search_point, i))->code, needle[OS(needle_start, j)])) {
-			++j;
-		} else {
-			i -= j;
-			j = 0;
+	bool found = true;
+
+	if (dst == 0) {
+		if (!direction_forward) ++search_point; // because of selection semantics
+		editor->buffer->mark = editor->buffer->cursor = search_point;
+	} else if (direction_forward) {
+		int s;
+		if (!searchidx_find(editor->buffer, search_point, true, &s)) s = litsearch_forward(&ls, editor->buffer, search_point, BSIZE(editor->buffer));
+		if (s >= 0) {
+			editor->buffer->mark = s;
+			editor->buffer->cursor = s + dst;
+		}
+		found = (s >= 0);
+	} else {
+		// the match must end at search_point
+		int s;
+		if (!searchidx_find(editor->buffer, search_point - dst + 1, false, &s)) s = litsearch_backward(&ls, editor->buffer, search_point - dst + 1);
+		if (s >= 0) {
+			editor->buffer->mark = s + dst;
+			editor->buffer->cursor = s;
 		}
+		found = (s >= 0);
 	}
 
-	if (j >= dst) {
-		if (!direction_forward) --i; // correction, because of selection semantics
+	litsearch_free(&ls);
 
-		// search was successful
-		editor->buffer->mark = OS(OS(search_point, i), -j);
-		editor->buffer->cursor = OS(search_point, i);
-	} else if (restart) {
+	if (found) return;
+
+	if (restart) {
 		int mark = editor->buffer->mark;
 		editor->buffer->mark = -1;
 		move_incremental_search(editor, ctrl_g_invoked, direction_forward, false);
@@ -138,6 +144,26 @@ static bool regmatch_to_lpoints(struct augmented_lpoint_t *search_point, regmatc
 	return (*s >= 0) && (*e >= 0);
 }
 
+/* Returns false if regexp (compiled with REG_NEWLINE) can't match a newline: '.' and negated classes don't, so only look for escapes and classes that can */
+static bool regexp_can_match_newline(const char *regexp, bool literal) {
+	if (strchr(regexp, '\n') != NULL) return true;
+	if (literal) return false;
+
+	const char *needles[] = { "\\n", "\\s", "\\W", "\\x", "[:space:]", "[:cntrl:]", NULL };
+	for (int i = 0; needles[i] != NULL; ++i) {
+		if (strstr(regexp, needles[i]) != NULL) return true;
+	}
+	return false;
+}
+
+// end of the first line that ends at least RESEARCH_CHUNK characters after point
+static int research_chunk_end(buffer_t *buffer, int point) {
+	int p = point + RESEARCH_CHUNK;
+	if (p >= BSIZE(buffer)) return BSIZE(buffer);
+	int k = buffer_newlines_before(buffer, p);
+	return (k < LSIZE(buffer)) ? buffer_newline_position(buffer, k) : BSIZE(buffer);
+}
+
 static bool move_regexp_search_forward(struct research_t *research, bool execute, int *mark, int *cursor) {
 	if (execute && (research->cmd != NULL) && (mark >= 0)) {
 		editor_t *editor;
@@ -185,9 +211,6 @@ static bool move_regexp_search_forward(struct research_t *research, bool execute
 #define OVECTOR_SIZE 10
 	regmatch_t ovector[OVECTOR_SIZE];
 
-	tre_str_source tss;
-	tre_bridge_init(&search_point, &tss);
-
 	int flags = 0;
 	if (search_point.start_glyph > 0) {
 		my_glyph_info_t *glyph = bat(research->buffer, search_point.start_glyph-1);
@@ -196,7 +219,17 @@ static bool move_regexp_search_forward(struct research_t *research, bool execute
 		}
 	}
 
-	int r = tre_reguexec(&(research->regexp), &tss, OVECTOR_SIZE, ovector, flags);
+	int r;
+	for (;;) {
+		search_point.limit = research->multiline ? -1 : research_chunk_end(research->buffer, search_point.start_glyph);
+		r = tre_window_exec(&(research->window), &(research->regexp), &search_point, OVECTOR_SIZE, ovector, flags);
+		if ((r != REG_NOMATCH) || research->line_limit || (search_point.limit < 0) || (search_point.limit >= BSIZE(research->buffer))) break;
+
+		// no match can cross the newline at the end of the chunk, go on with the following line
+		search_point.start_glyph = search_point.limit + 1;
+		search_point.offset = 0;
+		flags = 0;
+	}
 
 	if (r == REG_NOMATCH) {
 		research->search_failed = true;
@@ -231,6 +264,13 @@ static bool move_regexp_search_forward(struct research_t *research, bool execute
 }
 
 
+void research_update_index(editor_t *editor) {
+	if (editor->research.mode != SM_LITERAL) return;
+	uint32_t *needle = editor->research.literal_text;
+	int len = editor->research.literal_text_cap;
+	searchidx_request(editor->buffer, needle, len, should_be_case_sensitive(editor->buffer, needle, len));
+}
+
 void move_search(editor_t *editor, bool ctrl_g_invoked, bool direction_forward, bool replace) {
 	switch(editor->research.mode) {
 	case SM_LITERAL:
@@ -257,6 +297,7 @@ void research_init(struct research_t *r) {
 	r->cmd = NULL;
 	r->regexpstr = NULL;
 	r->literal_text = NULL;
+	tre_window_init(&(r->window));
 }
 
 enum research_get_type {
@@ -303,10 +344,141 @@ int do_regex_noninteractive_search(Tcl_Interp *interp, struct research_t *resear
 }
 
 
+/* If cmd is a single call to c returns a script that evaluates to its argument, otherwise NULL */
+static char *research_batch_script(const char *cmd) {
+	Tcl_Parse parse;
+	if (Tcl_ParseCommand(NULL, cmd, -1, 0, &parse) != TCL_OK) return NULL;
+
+	char *r = NULL;
+	const char *rest = parse.commandStart + parse.commandSize;
+	while ((*rest == ' ') || (*rest == '\t') || (*rest == '\n') || (*rest == ';')) ++rest;
+
+	Tcl_Token *first = parse.tokenPtr;
+	if ((parse.numWords == 2) && (*rest == '\0') && (first->type == TCL_TOKEN_SIMPLE_WORD) && (first->size == 1) && (first->start[0] == 'c')) {
+		Tcl_Token *word = first + 1 + first->numComponents;
+		if (word->type != TCL_TOKEN_EXPAND_WORD) {
+			asprintf(&r, "return -level 0 %.*s", word->size, word->start);
+			alloc_assert(r);
+		}
+	}
+
+	Tcl_FreeParse(&parse);
+	return r;
+}
+
+struct replacement_t {
+	int start, end;
+	char *text;
+};
+
+/* Replaces the text of the buffer covered by the n replacements in v (sorted and not overlapping) with a single call to buffer_replace_selection */
+static void research_apply_replacements(buffer_t *buffer, struct replacement_t *v, int n) {
+	if (n == 0) return;
+
+	GString *text = g_string_new("");
+	for (int i = 0; i < n; ++i) {
+		if (i > 0) {
+			char *kept = buffer_lines_to_text(buffer, v[i-1].end, v[i].start);
+			g_string_append(text, kept);
+			free(kept);
+		}
+		g_string_append(text, v[i].text);
+	}
+
+	buffer->mark = v[0].start;
+	buffer->cursor = v[n-1].end;
+	buffer_replace_selection(buffer, text->str);
+
+	g_string_free(text, TRUE);
+}
+
+/* Global replace for commands that are a single call to c: script (see research_batch_script) is evaluated for every match without changing the buffer, then all replacements are applied at once.
+Returns false if the script didn't behave, in that case the replacements found so far are applied and the rest must be done one at a time starting at the cursor */
+static bool do_regex_batch_replace(struct research_t *research, const char *script) {
+	buffer_t *buffer = research->buffer;
+	editor_t *editor;
+	find_editor_for_buffer(buffer, NULL, NULL, &editor);
+
+	struct replacement_t *v = NULL;
+	int n = 0, cap = 0;
+
+	bool done = true;
+	int mark, cursor = buffer->cursor;
+
+	while (move_regexp_search_forward(research, false, &mark, &cursor)) {
+		unsigned long revision = buffer->revision;
+		buffer->mark = mark;
+		buffer->cursor = cursor;
+
+		int code = interp_eval(editor, buffer, script, false, false);
+
+		if (buffer->revision != revision) {
+			// the script changed the buffer on its own, continue from wherever it left the cursor
+			done = false;
+			break;
+		}
+
+		if (code != TCL_OK) {
+			// run the script again on this match the normal way, so that errors are reported
+			buffer->mark = -1;
+			buffer->cursor = mark;
+			done = false;
+			break;
+		}
+
+		if (n >= cap) {
+			cap = MAX(2 * cap, 64);
+			v = realloc(v, sizeof(struct replacement_t) * cap);
+			alloc_assert(v);
+		}
+		v[n].start = mark;
+		v[n].end = cursor;
+		v[n].text = strdup(Tcl_GetStringResult(interp));
+		alloc_assert(v[n].text);
+		++n;
+		Tcl_ResetResult(interp);
+
+		if (mark == cursor) {
+			// empty match, the next search must start after it
+			if (cursor >= BSIZE(buffer)) break;
+			++cursor;
+		}
+	}
+
+	// the point where the replacement stopped is after all the replacements
+	int resume = buffer->cursor;
+	int size = BSIZE(buffer);
+	research_apply_replacements(buffer, v, n);
+	if (!done) {
+		buffer->mark = -1;
+		buffer->cursor = resume + BSIZE(buffer) - size;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		free(v[i].text);
+	}
+	free(v);
+
+	return done;
+}
+
 static bool do_regex_noninteractive_replace(struct research_t *research) {
 	bool execute = false;
 	bool r = true;
 
+	if (research->cmd != NULL) {
+		char *script = research_batch_script(research->cmd);
+		if (script != NULL) {
+			bool done = do_regex_batch_replace(research, script);
+			free(script);
+			if (done) {
+				research->buffer->mark = -1;
+				research_free_temp(research);
+				return true;
+			}
+		}
+	}
+
 	int count = 0;
 	int prevpoint = research->buffer->cursor;
 
@@ -371,6 +543,7 @@ int teddy_research_command(ClientData client_data, Tcl_Interp *interp, int argc,
 	research.mode = SM_REGEXP;
 	research.literal_text = NULL;
 	research.literal_text_allocated = research.literal_text_cap = 0;
+	tre_window_init(&(research.window));
 
 	int flags = 0;
 	bool literal = false;
@@ -429,6 +602,7 @@ int teddy_research_command(ClientData client_data, Tcl_Interp *interp, int argc,
 
 	research.regexpstr = strdup(argv[i]);
 	alloc_assert(research.regexpstr);
+	research.multiline = regexp_can_match_newline(argv[i], literal);
 
 	int r = tre_regcomp(&(research.regexp), argv[i], flags | REG_NEWLINE | (literal ? REG_LITERAL : REG_EXTENDED));
 	if (r != REG_OK) {
@@ -7,6 +7,7 @@
 #include <tre/tre.h>
 
 #include "buffer.h"
+#include "treint.h"
 
 enum search_mode_t {
 	SM_NONE = 0,
@@ -20,6 +21,8 @@ struct research_t {
 
 	regex_t regexp;
 	char *regexpstr;
+	bool multiline; // the regexp can match a newline
+	struct tre_window window; // reused by every search until the buffer changes
 	char *cmd;
 	bool line_limit;
 	bool next_will_wrap_around;
@@ -43,4 +46,7 @@ extern int teddy_research_command(ClientData client_data, Tcl_Interp *interp, in
 
 extern void research_continue_replace_to_end(struct _editor_t *editor);
 
+// restarts the index of the occurrences of the literal search if it changed
+extern void research_update_index(struct _editor_t *editor);
+
 #endif
@@ -0,0 +1,286 @@
+#include "searchidx.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "global.h"
+#include "litsearch.h"
+
+// the worker publishes its results and checks if it should stop every this many characters
+#define SEARCHIDX_CHUNK (1024 * 1024)
+
+enum searchidx_state { SEARCHIDX_IDLE = 0, SEARCHIDX_QUEUED, SEARCHIDX_RUNNING, SEARCHIDX_PREEMPTED, SEARCHIDX_DONE };
+
+/* The index is built by a single worker thread. The main thread changes the query (and increments generation), the worker scans the buffer with its read lock held and appends what it finds to v one chunk at a time, discarding it if the generation changed in the meantime.
+When someone asks for the write lock of the buffer the worker stops (SEARCHIDX_PREEMPTED), the next call to searchidx_request either restarts the index, if the text changed, or resumes it.
+Everything in searchidx is protected by searchidx_mutex */
+static struct {
+	buffer_t *buffer;
+	uint32_t *needle;
+	int len, needle_cap;
+	bool case_sensitive;
+	unsigned long generation;
+	unsigned long revision; // revision of the buffer the index is for
+
+	enum searchidx_state state;
+	buffer_t *working_on; // buffer the worker is using
+
+	int *v; // start of every occurrence found, sorted
+	int n, cap;
+	int scanned; // every occurrence starting before this point is in v
+} searchidx;
+
+static pthread_mutex_t searchidx_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t searchidx_cond = PTHREAD_COND_INITIALIZER;
+
+static void searchidx_append(int *v, int n) {
+	if (searchidx.n + n > searchidx.cap) {
+		searchidx.cap = MAX(searchidx.n + n, 2 * searchidx.cap);
+		searchidx.v = realloc(searchidx.v, sizeof(int) * searchidx.cap);
+		alloc_assert(searchidx.v);
+	}
+	memcpy(searchidx.v + searchidx.n, v, sizeof(int) * n);
+	searchidx.n += n;
+}
+
+static gboolean searchidx_refresher(buffer_t *buffer) {
+	pthread_mutex_lock(&searchidx_mutex);
+	bool current = (searchidx.buffer == buffer);
+	pthread_mutex_unlock(&searchidx_mutex);
+
+	if (!current) return FALSE;
+
+	editor_t *editor = NULL;
+	find_editor_for_buffer(buffer, NULL, NULL, &editor);
+	if (editor != NULL) gtk_widget_queue_draw(editor->drar);
+	return FALSE;
+}
+
+/* Scans buffer from start, must be called with the read lock of buffer held and searchidx_mutex not held.
+Returns the new state of the index */
+static enum searchidx_state searchidx_scan(buffer_t *buffer, struct litsearch_t *ls, unsigned long generation, int start) {
+	int cap = 1024, *found = malloc(sizeof(int) * cap);
+	alloc_assert(found);
+	enum searchidx_state r = SEARCHIDX_DONE;
+
+	for (int chunk = start; chunk < BSIZE(buffer); chunk += SEARCHIDX_CHUNK) {
+		if (__atomic_load_n(&(buffer->release_read_lock), __ATOMIC_SEQ_CST)) {
+			r = SEARCHIDX_PREEMPTED;
+			break;
+		}
+
+		int end = MIN(chunk + SEARCHIDX_CHUNK, BSIZE(buffer));
+		int n = 0;
+		for (int s = chunk; (s = litsearch_forward(ls, buffer, s, end-1)) >= 0; ++s) {
+			if (n >= cap) {
+				cap *= 2;
+				found = realloc(found, sizeof(int) * cap);
+				alloc_assert(found);
+			}
+			found[n++] = s;
+		}
+
+		pthread_mutex_lock(&searchidx_mutex);
+		bool cancelled = (searchidx.generation != generation);
+		if (!cancelled) {
+			searchidx_append(found, n);
+			searchidx.scanned = end;
+		}
+		pthread_mutex_unlock(&searchidx_mutex);
+
+		if (cancelled) {
+			r = SEARCHIDX_IDLE;
+			break;
+		}
+		if (n > 0) g_idle_add((GSourceFunc)searchidx_refresher, buffer);
+	}
+
+	free(found);
+	return r;
+}
+
+static void *searchidx_worker_thread(void *varg) {
+	pthread_mutex_lock(&searchidx_mutex);
+
+	for (;;) {
+		while (searchidx.state != SEARCHIDX_QUEUED) {
+			pthread_cond_wait(&searchidx_cond, &searchidx_mutex);
+		}
+
+		buffer_t *buffer = searchidx.buffer;
+		unsigned long generation = searchidx.generation;
+		unsigned long revision = searchidx.revision;
+		int start = searchidx.scanned;
+		struct litsearch_t ls;
+		litsearch_init(&ls, searchidx.needle, searchidx.len, searchidx.case_sensitive);
+		searchidx.state = SEARCHIDX_RUNNING;
+		searchidx.working_on = buffer;
+		pthread_mutex_unlock(&searchidx_mutex);
+
+		pthread_rwlock_rdlock(&(buffer->rwlock));
+		// if the text changed since the index was requested the results are useless, the next request will restart it
+		enum searchidx_state r = (buffer->revision == revision) ? searchidx_scan(buffer, &ls, generation, start) : SEARCHIDX_PREEMPTED;
+		pthread_rwlock_unlock(&(buffer->rwlock));
+
+		litsearch_free(&ls);
+
+		pthread_mutex_lock(&searchidx_mutex);
+		searchidx.working_on = NULL;
+		if (searchidx.generation != generation) {
+			// a new request arrived while we were working
+			if (searchidx.state == SEARCHIDX_RUNNING) searchidx.state = SEARCHIDX_IDLE;
+		} else {
+			searchidx.state = r;
+		}
+		pthread_cond_broadcast(&searchidx_cond);
+		if (searchidx.buffer == buffer) g_idle_add((GSourceFunc)searchidx_refresher, buffer);
+	}
+
+	return NULL;
+}
+
+void searchidx_init(void) {
+	pthread_attr_t attrs;
+	pthread_attr_init(&attrs);
+	pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
+
+	pthread_t thread;
+	if (pthread_create(&thread, &attrs, searchidx_worker_thread, NULL) != 0) {
+		perror("Can not start search index thread");
+	}
+
+	pthread_attr_destroy(&attrs);
+}
+
+static void searchidx_reset(void) {
+	++(searchidx.generation);
+	searchidx.n = 0;
+	searchidx.scanned = 0;
+	searchidx.state = SEARCHIDX_IDLE;
+}
+
+void searchidx_request(buffer_t *buffer, const uint32_t *needle, int len, bool case_sensitive) {
+	if (len <= 0) {
+		searchidx_cancel();
+		return;
+	}
+
+	pthread_mutex_lock(&searchidx_mutex);
+
+	bool same = (searchidx.buffer == buffer) && (searchidx.revision == buffer->revision) && (searchidx.case_sensitive == case_sensitive) && (searchidx.len == len) && (memcmp(searchidx.needle, needle, sizeof(uint32_t) * len) == 0);
+
+	if (!same) {
+		searchidx_reset();
+		if (len > searchidx.needle_cap) {
+			searchidx.needle_cap = len;
+			searchidx.needle = realloc(searchidx.needle, sizeof(uint32_t) * len);
+			alloc_assert(searchidx.needle);
+		}
+		memcpy(searchidx.needle, needle, sizeof(uint32_t) * len);
+		searchidx.len = len;
+		searchidx.case_sensitive = case_sensitive;
+		searchidx.buffer = buffer;
+		searchidx.revision = buffer->revision;
+	}
+
+	if ((searchidx.state == SEARCHIDX_IDLE) || (searchidx.state == SEARCHIDX_PREEMPTED)) {
+		searchidx.state = SEARCHIDX_QUEUED;
+		pthread_cond_broadcast(&searchidx_cond);
+	}
+
+	pthread_mutex_unlock(&searchidx_mutex);
+}
+
+void searchidx_cancel(void) {
+	pthread_mutex_lock(&searchidx_mutex);
+	searchidx_reset();
+	searchidx.buffer = NULL;
+	pthread_mutex_unlock(&searchidx_mutex);
+}
+
+void searchidx_forget(buffer_t *buffer) {
+	pthread_mutex_lock(&searchidx_mutex);
+	if (searchidx.buffer == buffer) {
+		searchidx_reset();
+		searchidx.buffer = NULL;
+	}
+	while (searchidx.working_on == buffer) {
+		pthread_cond_wait(&searchidx_cond, &searchidx_mutex);
+	}
+	pthread_mutex_unlock(&searchidx_mutex);
+}
+
+// index of the first occurrence starting at or after point
+static int searchidx_lower_bound(int point) {
+	int lo = 0, hi = searchidx.n;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (searchidx.v[mid] < point) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static bool searchidx_valid(buffer_t *buffer) {
+	return (searchidx.buffer == buffer) && (searchidx.revision == buffer->revision);
+}
+
+bool searchidx_find(buffer_t *buffer, int point, bool forward, int *s) {
+	bool r = false;
+	pthread_mutex_lock(&searchidx_mutex);
+
+	if (searchidx_valid(buffer)) {
+		if (forward) {
+			int i = searchidx_lower_bound(point);
+			if (i < searchidx.n) {
+				*s = searchidx.v[i];
+				r = true;
+			} else if (searchidx.state == SEARCHIDX_DONE) {
+				*s = -1;
+				r = true;
+			}
+		} else if ((point < searchidx.scanned) || (searchidx.state == SEARCHIDX_DONE)) {
+			int i = searchidx_lower_bound(point+1) - 1;
+			*s = (i >= 0) ? searchidx.v[i] : -1;
+			r = true;
+		}
+	}
+
+	pthread_mutex_unlock(&searchidx_mutex);
+	return r;
+}
+
+int searchidx_range(buffer_t *buffer, int start, int end, int *v, int cap, int *len) {
+	int n = 0;
+	pthread_mutex_lock(&searchidx_mutex);
+
+	if (searchidx_valid(buffer)) {
+		*len = searchidx.len;
+		for (int i = searchidx_lower_bound(start - searchidx.len + 1); (i < searchidx.n) && (searchidx.v[i] < end) && (n < cap); ++i) {
+			v[n++] = searchidx.v[i];
+		}
+	}
+
+	pthread_mutex_unlock(&searchidx_mutex);
+	return n;
+}
+
+bool searchidx_position(buffer_t *buffer, int s, int *k, int *n, bool *complete) {
+	bool r = false;
+	pthread_mutex_lock(&searchidx_mutex);
+
+	if (searchidx_valid(buffer)) {
+		int i = searchidx_lower_bound(s);
+		*k = ((i < searchidx.n) && (searchidx.v[i] == s)) ? i+1 : 0;
+		*n = searchidx.n;
+		*complete = (searchidx.state == SEARCHIDX_DONE);
+		r = true;
+	}
+
+	pthread_mutex_unlock(&searchidx_mutex);
+	return r;
+}
@@ -0,0 +1,29 @@
+#ifndef __SEARCHIDX_H__
+#define __SEARCHIDX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "buffer.h"
+
+/* Index of all the occurrences of the current literal search, built in the background.
+   There is only one index: a request for a different buffer or string replaces it. Results are published incrementally, starting from the top of the buffer */
+
+void searchidx_init(void);
+
+// (re)starts the index for needle in buffer, does nothing if the index is already for this search and the buffer didn't change
+void searchidx_request(buffer_t *buffer, const uint32_t *needle, int len, bool case_sensitive);
+// discards the index
+void searchidx_cancel(void);
+// called before buffer is freed, waits for the worker to stop using it
+void searchidx_forget(buffer_t *buffer);
+
+/* Looks up the first occurrence starting at or after point (or the last one starting at or before point, if forward is false).
+   Returns false if the index can't answer yet, otherwise *s is the start of the occurrence or -1 if there isn't one */
+bool searchidx_find(buffer_t *buffer, int point, bool forward, int *s);
+// copies to v (at most cap) the start of the occurrences that intersect [start, end), returns how many were copied and the length of the needle in *len
+int searchidx_range(buffer_t *buffer, int start, int end, int *v, int cap, int *len);
+// returns false if the index isn't for buffer, otherwise the number of the occurrence at s (1 based, 0 if there isn't one) in *k, the number of occurrences in *n and whether the index is complete
+bool searchidx_position(buffer_t *buffer, int s, int *k, int *n, bool *complete);
+
+#endif
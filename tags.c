@@ -1,164 +1,347 @@
 #include "tags.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "buffers.h"
 #include "global.h"
+#include "cfg.h"
+
+// longer lines of the tags file are ignored
+#define TAGS_MAX_LINE 512
 
 critbit0_tree tags_file_critbit;
 
-struct tag_entry *tag_entries;
-int allocated;
-int tag_entries_cap;
+/* tags_current is only replaced by the main thread, tags_mutex protects it and the reference counts of every tags_db */
+static struct tags_db *tags_current = NULL;
+static pthread_mutex_t tags_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long tags_load_id; // the load that will be published, accessed atomically
+
+struct tags_load {
+	unsigned long id;
+	char *path;
+	bool discard_lineno;
+
+	struct tags_db *db;
+	critbit0_tree names; // distinct names of db
+};
 
 void tags_init(void) {
-	allocated = 10;
-	tag_entries = malloc(allocated * sizeof(struct tag_entry));
-	alloc_assert(tag_entries);
-	for (int i = 0; i < allocated; ++i) tag_entries[i].tag = NULL;
-	tag_entries_cap = 0;
 	tags_file_critbit.root = NULL;
 }
 
-static void tags_grow(void) {
-	tag_entries = realloc(tag_entries, 2 * allocated * sizeof(struct tag_entry));
-	alloc_assert(tag_entries);
-	for (int i = allocated; i < 2*allocated; ++i) tag_entries[i].tag = NULL;
-	allocated *= 2;
+struct tags_db *tags_acquire(void) {
+	pthread_mutex_lock(&tags_mutex);
+	struct tags_db *db = tags_current;
+	if (db != NULL) ++(db->refcount);
+	pthread_mutex_unlock(&tags_mutex);
+	return db;
 }
 
-static void tags_free(void) {
-	for (int i = 0; i < tag_entries_cap; ++i) {
-		if (tag_entries[i].tag != NULL) free(tag_entries[i].tag);
-		if (tag_entries[i].path != NULL) free(tag_entries[i].path);
-		if (tag_entries[i].search != NULL) free(tag_entries[i].search);
-	}
+static void tags_db_free(struct tags_db *db) {
+	free(db->text);
+	free(db->entries);
+	g_string_chunk_free(db->names);
+	free(db);
+}
 
-	tag_entries_cap = 0;
+void tags_release(struct tags_db *db) {
+	if (db == NULL) return;
+	pthread_mutex_lock(&tags_mutex);
+	bool last = (--(db->refcount) == 0);
+	pthread_mutex_unlock(&tags_mutex);
+	if (last) tags_db_free(db);
 }
 
-void tags_load(char *wd) {
-#define BUF_SIZE 1024
-	char buf[BUF_SIZE];
+static bool tags_load_stale(struct tags_load *l) {
+	return __atomic_load_n(&tags_load_id, __ATOMIC_SEQ_CST) != l->id;
+}
+
+static void tags_load_free(struct tags_load *l) {
+	if (l->db != NULL) tags_db_free(l->db);
+	critbit0_clear(&(l->names));
+	free(l->path);
+	free(l);
+}
+
+static int tag_entry_cmp(const void *a, const void *b) {
+	const struct tag_entry *ta = a, *tb = b;
+	int r = (ta->tag == tb->tag) ? 0 : strcmp(ta->tag, tb->tag);
+	if (r != 0) return r;
+	// keeps the order of the file
+	return (ta->offset < tb->offset) ? -1 : ((ta->offset > tb->offset) ? 1 : 0);
+}
 
-	tags_free();
+// copies the line at offset into buf, returns false if it is too long
+static bool tags_line(struct tags_db *db, size_t offset, char *buf) {
+	const char *start = db->text + offset;
+	const char *end = memchr(start, '\n', db->len - offset);
+	size_t len = (end != NULL) ? end - start : db->len - offset;
+	if (len > TAGS_MAX_LINE) return false;
+	memcpy(buf, start, len);
+	buf[len] = '\0';
+	return true;
+}
+
+static gboolean tags_publish(struct tags_load *l) {
+	if (tags_load_stale(l)) {
+		tags_load_free(l);
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&tags_mutex);
+	struct tags_db *old = tags_current;
+	tags_current = l->db;
+	pthread_mutex_unlock(&tags_mutex);
+	tags_release(old);
+	l->db = NULL;
 
 	critbit0_clear(&tags_file_critbit);
+	tags_file_critbit = l->names;
+	l->names.root = NULL;
 
-	char *tags_file;
-	asprintf(&tags_file, "%s/%s", wd, "tags");
-	alloc_assert(tags_file);
+	tags_load_free(l);
 
-	FILE *f = fopen(tags_file, "r");
+	word_completer_full_update();
+	return FALSE;
+}
 
-	if (f == NULL) {
-		buffers_register_tags(NULL);
-		free(tags_file);
-		return;
-	} else {
-		buffers_register_tags(tags_file);
+static void *tags_load_thread(void *arg) {
+	struct tags_load *l = (struct tags_load *)arg;
+
+	int fd = open(l->path, O_RDONLY);
+	if (fd < 0) goto tags_load_thread_publish;
+
+	struct stat s;
+	if ((fstat(fd, &s) != 0) || (s.st_size == 0)) {
+		close(fd);
+		goto tags_load_thread_publish;
 	}
 
-	free(tags_file);
+	char *map = malloc(s.st_size);
+	alloc_assert(map);
+	size_t len = 0;
+	while (len < s.st_size) {
+		ssize_t r = read(fd, map + len, s.st_size - len);
+		if (r <= 0) break;
+		len += r;
+	}
+	close(fd);
+	if (len == 0) {
+		free(map);
+		goto tags_load_thread_publish;
+	}
 
-	while (fgets(buf, BUF_SIZE, f) != NULL) {
-		if (buf[strlen(buf)-1] == '\n') buf[strlen(buf)-1] = '\0';
-		if (strcmp(buf, "") == 0) continue;
-		if (buf[0] == '!') continue;
-		if (strlen(buf) > 512) continue;
+	struct tags_db *db = malloc(sizeof(struct tags_db));
+	alloc_assert(db);
+	db->refcount = 1;
+	db->text = map;
+	db->len = len; // the file may have been truncated while we were reading it
+	db->n = 0;
+	db->names = g_string_chunk_new(64 * 1024);
 
-		char *toks;
-		char *tag = strtok_r(buf, "\t", &toks);
-		if (tag == NULL) continue;
-		char *path = strtok_r(NULL, "\t", &toks);
-		if (path == NULL) continue;
-		char *search = strtok_r(NULL, "", &toks);
-		if (search == NULL) continue;
+	int cap = 1024;
+	db->entries = malloc(sizeof(struct tag_entry) * cap);
+	alloc_assert(db->entries);
 
-		critbit0_insert(&tags_file_critbit, tag);
+	l->db = db;
 
-		char *d = strstr(search, ";\"\t");
-		if (d != NULL) *d = '\0';
+	char name[TAGS_MAX_LINE+1];
+	bool sorted = true;
 
-		if (tag_entries_cap >= allocated) tags_grow();
-		if (tag_entries_cap >= allocated) break;
+	for (size_t start = 0; start < db->len; ) {
+		const char *line = map + start;
+		const char *end = memchr(line, '\n', db->len - start);
+		size_t len = (end != NULL) ? end - line : db->len - start;
+		size_t offset = start;
+		start += len + 1;
 
-		tag_entries[tag_entries_cap].tag = strdup(tag);
-		alloc_assert(tag_entries[tag_entries_cap].tag);
-		tag_entries[tag_entries_cap].path = strdup(path);
-		alloc_assert(tag_entries[tag_entries_cap].path);
+		if ((len == 0) || (line[0] == '!') || (len > TAGS_MAX_LINE)) continue;
 
-		bool is_search = false;
+		const char *t1 = memchr(line, '\t', len);
+		if ((t1 == NULL) || (t1 == line)) continue;
+		const char *t2 = memchr(t1+1, '\t', len - (t1+1 - line));
+		if ((t2 == NULL) || (t2 == t1+1) || (t2+1 >= line + len)) continue;
 
-		if (search[0] == '/') {
-			is_search = true;
-			search++;
-			search[strlen(search)-1] = '\0';
-		} else {
-			is_search = false;
-		}
+		if (l->discard_lineno && (t2[1] != '/')) continue;
 
-		if (search[0] == '^') {
-			search++;
+		if ((db->n % 65536 == 0) && tags_load_stale(l)) {
+			tags_load_free(l);
+			return NULL;
 		}
 
-		if (search[strlen(search)-1] == '$') {
-			search[strlen(search)-1] = '\0';
-		}
+		memcpy(name, line, t1 - line);
+		name[t1 - line] = '\0';
 
-		if (is_search) {
-			// replace \/ with /
-			int src = 0, dst = 0;
-			while (src < strlen(search)) {
-				if ((src+1 < strlen(search)) && (search[src] == '\\')) {
-					++src;
-				} else {
-					search[dst] = search[src];
-					++src; ++dst;
-				}
-			}
-			search[dst] = '\0';
+		if (db->n >= cap) {
+			cap *= 2;
+			db->entries = realloc(db->entries, sizeof(struct tag_entry) * cap);
+			alloc_assert(db->entries);
 		}
 
-		if (is_search) {
-			tag_entries[tag_entries_cap].search = strdup(search);
-			alloc_assert(tag_entries[tag_entries_cap].search);
-		} else {
-			tag_entries[tag_entries_cap].search = NULL;
-			tag_entries[tag_entries_cap].lineno = atoi(search);
-		}
+		struct tag_entry *e = db->entries + db->n;
+		e->tag = g_string_chunk_insert_const(db->names, name);
+		e->offset = offset;
+		if ((db->n > 0) && (tag_entry_cmp(e - 1, e) > 0)) sorted = false;
+		++(db->n);
+	}
 
-		//printf("search: <%s>\n", tag_entries[tag_entries_cap].search);
+	if (!sorted) qsort(db->entries, db->n, sizeof(struct tag_entry), tag_entry_cmp);
 
-		if (config_intval(&global_config, CFG_TAGS_DISCARD_LINENO) != 0) {
-			if (tag_entries[tag_entries_cap].search == NULL) {
-				free(tag_entries[tag_entries_cap].tag);
-				free(tag_entries[tag_entries_cap].path);
-				//printf("\tdiscarded\n");
-				--tag_entries_cap;
-			}
-		}
+	for (int i = 0; i < db->n; ++i) {
+		// names are interned, equal names are the same pointer
+		if ((i > 0) && (db->entries[i].tag == db->entries[i-1].tag)) continue;
+		critbit0_insert(&(l->names), db->entries[i].tag);
+	}
+
+tags_load_thread_publish:
+	g_idle_add((GSourceFunc)tags_publish, l);
+	return NULL;
+}
 
-		++tag_entries_cap;
+void tags_load(char *wd) {
+	unsigned long id = __atomic_add_fetch(&tags_load_id, 1, __ATOMIC_SEQ_CST);
+
+	struct tags_load *l = malloc(sizeof(struct tags_load));
+	alloc_assert(l);
+	l->id = id;
+	asprintf(&(l->path), "%s/%s", wd, "tags");
+	alloc_assert(l->path);
+	l->discard_lineno = config_intval(&global_config, CFG_TAGS_DISCARD_LINENO) != 0;
+	l->db = NULL;
+	l->names.root = NULL;
+
+	if (access(l->path, R_OK) != 0) {
+		buffers_register_tags(NULL);
+		tags_publish(l);
+		return;
 	}
 
-	//printf("loaded: %d\n", tag_entries_cap);
-	fclose(f);
+	buffers_register_tags(l->path);
 
-	word_completer_full_update();
+	pthread_attr_t attrs;
+	pthread_attr_init(&attrs);
+	pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
+
+	pthread_t thread;
+	if (pthread_create(&thread, &attrs, tags_load_thread, l) != 0) {
+		perror("Can not start tags loading thread");
+		tags_load_free(l);
+	}
+
+	pthread_attr_destroy(&attrs);
 }
 
 bool tags_loaded(void) {
-	return tag_entries_cap > 0;
+	struct tags_db *db = tags_acquire();
+	bool r = (db != NULL) && (db->n > 0);
+	tags_release(db);
+	return r;
+}
+
+static int tags_name_cmp(const char *tag, const char *name, size_t len, bool exact) {
+	return exact ? strcmp(tag, name) : strncmp(tag, name, len);
+}
+
+// index of the first entry of db that compares greater than name (or greater or equal if orequal is set)
+static int tags_bound(struct tags_db *db, const char *name, size_t len, bool exact, bool orequal) {
+	int lo = 0, hi = db->n;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		int c = tags_name_cmp(db->entries[mid].tag, name, len, exact);
+		if ((c < 0) || (!orequal && (c == 0))) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+int tags_lookup(struct tags_db *db, const char *name, bool exact, int *count) {
+	size_t len = strlen(name);
+	int first = tags_bound(db, name, len, exact, true);
+	*count = tags_bound(db, name, len, exact, false) - first;
+	return first;
+}
+
+char *tags_entry_location(struct tags_db *db, int i, char **search, int *lineno) {
+	char buf[TAGS_MAX_LINE+1];
+
+	*search = NULL;
+	*lineno = 0;
+
+	if (!tags_line(db, db->entries[i].offset, buf)) return NULL;
+
+	char *toks;
+	char *tag = strtok_r(buf, "\t", &toks);
+	if (tag == NULL) return NULL;
+	char *path = strtok_r(NULL, "\t", &toks);
+	if (path == NULL) return NULL;
+	char *address = strtok_r(NULL, "", &toks);
+	if (address == NULL) return NULL;
+
+	char *d = strstr(address, ";\"\t");
+	if (d != NULL) *d = '\0';
+
+	bool is_search = false;
+
+	if (address[0] == '/') {
+		is_search = true;
+		address++;
+		if (address[0] != '\0') address[strlen(address)-1] = '\0';
+	}
+
+	if (address[0] == '^') {
+		address++;
+	}
+
+	if ((address[0] != '\0') && (address[strlen(address)-1] == '$')) {
+		address[strlen(address)-1] = '\0';
+	}
+
+	if (is_search) {
+		// replace \/ with /
+		int src = 0, dst = 0;
+		int len = strlen(address);
+		while (src < len) {
+			if ((src+1 < len) && (address[src] == '\\')) {
+				++src;
+			} else {
+				address[dst] = address[src];
+				++src; ++dst;
+			}
+		}
+		address[dst] = '\0';
+
+		*search = strdup(address);
+		alloc_assert(*search);
+	} else {
+		*lineno = atoi(address);
+	}
+
+	char *r = strdup(path);
+	alloc_assert(r);
+	return r;
 }
 
 int teddy_tags_command(ClientData client_data, Tcl_Interp *interp, int argc, const char *argv[]) {
-	if (argc != 2) {
+	bool prefix = (argc == 3) && (strcmp(argv[1], "-prefix") == 0);
+
+	if ((argc != 2) && !prefix) {
 		Tcl_AddErrorInfo(interp, "Wrong number of arguments to 'tags' command");
 		return TCL_ERROR;
 	}
 
-	if (tag_entries_cap == 0) {
+	struct tags_db *db = tags_acquire();
+
+	if ((db == NULL) || (db->n == 0)) {
+		tags_release(db);
 		Tcl_AddErrorInfo(interp, "No tags loaded");
 		return TCL_ERROR;
 	}
@@ -166,29 +349,52 @@ int teddy_tags_command(ClientData client_data, Tcl_Interp *interp, int argc, con
 	Tcl_Obj *retlist = Tcl_NewListObj(0, NULL);
 	Tcl_IncrRefCount(retlist);
 
-	for (int i = 0; i < tag_entries_cap; ++i) {
-		if (strcmp(tag_entries[i].tag, argv[1]) == 0) {
-			if (i > 0) {
-				// skip identical entries
-				if ((strcmp(tag_entries[i].path, tag_entries[i-1].path) == 0) &&
-					(strcmp(tag_entries[i].search, tag_entries[i-1].search) == 0)) {
-					continue;
-				}
-			}
+	int count;
+	int first = tags_lookup(db, argv[argc-1], !prefix, &count);
+
+	char *last = NULL;
 
-			char *text;
-			asprintf(&text, "%s\t/%s/", tag_entries[i].path, tag_entries[i].search!=NULL ? tag_entries[i].search : "");
-			alloc_assert(text);
+	for (int i = first; i < first + count; ++i) {
+		if (prefix) {
+			if ((i > first) && (db->entries[i].tag == db->entries[i-1].tag)) continue;
+			Tcl_ListObjAppendElement(interp, retlist, Tcl_NewStringObj(db->entries[i].tag, -1));
+			continue;
+		}
+
+		char *search;
+		int lineno;
+		char *path = tags_entry_location(db, i, &search, &lineno);
+		if (path == NULL) continue;
+
+		char *text;
+		if (search != NULL) {
+			asprintf(&text, "%s\t/%s/", path, search);
+		} else {
+			asprintf(&text, "%s\t:%d", path, lineno);
+		}
+		alloc_assert(text);
 
-			Tcl_Obj *text_obj = Tcl_NewStringObj(text, strlen(text));
-			Tcl_ListObjAppendElement(interp, retlist, text_obj);
+		free(path);
+		if (search != NULL) free(search);
 
+		// skip identical entries
+		if ((last != NULL) && (strcmp(last, text) == 0)) {
 			free(text);
+			continue;
 		}
+
+		Tcl_ListObjAppendElement(interp, retlist, Tcl_NewStringObj(text, -1));
+
+		if (last != NULL) free(last);
+		last = text;
 	}
 
+	if (last != NULL) free(last);
+
+	tags_release(db);
+
 	Tcl_SetObjResult(interp, retlist);
 	Tcl_DecrRefCount(retlist);
 
 	return TCL_OK;
-}
\ No newline at end of file
+}
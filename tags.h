@@ -2,26 +2,47 @@
 #define __TAGS__
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <glib.h>
 #include <tcl.h>
 
 #include "critbit.h"
 
 struct tag_entry {
-	char *tag;
-	char *path;
-	char *search;
-	int lineno;
+	const char *tag; // interned in tags_db.names
+	size_t offset; // start of the line of the tags file
 };
 
-extern struct tag_entry *tag_entries;
-extern int tag_entries_cap;
+/* A loaded tags file, the file is read in memory once and only the names of the tags are copied (once for every distinct name).
+   The file isn't kept mapped: ctags rewrites it in place and a mapping of the old file could be truncated under us.
+   Entries are sorted by name. A tags_db is never modified after being loaded, a reload creates a new one in the background and swaps it in */
+struct tags_db {
+	int refcount; // protected by the mutex in tags.c
+	char *text; // contents of the tags file
+	size_t len;
+
+	struct tag_entry *entries;
+	int n;
+
+	GStringChunk *names;
+};
 
 extern critbit0_tree tags_file_critbit;
 
 void tags_init(void);
+// starts loading the tags file of wd in the background
 void tags_load(char *wd);
 bool tags_loaded(void);
 
+// returns the current tags (or NULL) and keeps them alive until tags_release is called, can be called from any thread
+struct tags_db *tags_acquire(void);
+void tags_release(struct tags_db *db);
+
+// returns the index of the first entry whose name starts with prefix and in *count the number of such entries, or is equal to name if exact is set
+int tags_lookup(struct tags_db *db, const char *name, bool exact, int *count);
+/* Returns the path of entry i (allocated) and in *search the text to search in the file (allocated) or NULL if the entry is a line number, stored in *lineno */
+char *tags_entry_location(struct tags_db *db, int i, char **search, int *lineno);
+
 int teddy_tags_command(ClientData client_data, Tcl_Interp *interp, int argc, const char *argv[]);
 
 #endif
@@ -12,6 +12,7 @@
 #include "cfg.h"
 #include "research.h"
 #include "lexy.h"
+#include "searchidx.h"
 #include "foundry.h"
 #include "iopen.h"
 #include "top.h"
@@ -96,6 +97,7 @@ int main(int argc, char *argv[]) {
 	buffer_wordcompl_init_charset();
 
 	lexy_init();
+	searchidx_init();
 	interp_init();
 
 	read_conf();
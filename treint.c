@@ -1,6 +1,12 @@
 #include "treint.h"
 
 #include <stdio.h>
+#include <time.h>
+
+#include "global.h"
+#include "interp.h"
+
+#define TRE_WINDOW_MAX (256 * 1024)
 
 static int tre_point_bridge_get_next_char(tre_char_t *c, unsigned int *pos_add, void *context) {
 	struct augmented_lpoint_t *point = (struct augmented_lpoint_t *)context;
@@ -11,6 +17,12 @@ static int tre_point_bridge_get_next_char(tre_char_t *c, unsigned int *pos_add,
 		return -1;
 	}
 
+	if ((point->limit >= 0) && ((point->offset + point->start_glyph) >= point->limit)) {
+		*c = 0;
+		*pos_add = 0;
+		return -1;
+	}
+
 	my_glyph_info_t *g = bat(point->buffer, point->start_glyph + point->offset);
 
 	if (point->endatspace) {
@@ -60,3 +72,140 @@ void tre_bridge_init(struct augmented_lpoint_t *point, tre_str_source *tss) {
 	tss->compare = tre_point_bridge_compare;
 	tss->get_next_char = tre_point_bridge_get_next_char;
 }
+
+void tre_window_init(struct tre_window *win) {
+	win->buffer = NULL;
+	win->revision = 0;
+	win->text = NULL;
+	win->cap = 0;
+	win->start = win->end = 0;
+}
+
+void tre_window_free(struct tre_window *win) {
+	free(win->text);
+	tre_window_init(win);
+}
+
+int tre_window_exec(struct tre_window *win, const regex_t *preg, struct augmented_lpoint_t *point, size_t nmatch, regmatch_t pmatch[], int eflags) {
+	buffer_t *buffer = point->buffer;
+	int p = point->start_glyph + point->offset;
+
+	// the bridge stops at the end of the buffer or at the first newline
+	int stop = BSIZE(buffer);
+	if (point->endatnewline) {
+		int k = buffer_newlines_before(buffer, p);
+		if (k < LSIZE(buffer)) stop = buffer_newline_position(buffer, k);
+	}
+	if ((point->limit >= 0) && (point->limit < stop)) stop = point->limit;
+
+	if ((p > stop) || (stop - p > TRE_WINDOW_MAX)) {
+		tre_str_source tss;
+		tre_bridge_init(point, &tss);
+		return tre_reguexec(preg, &tss, nmatch, pmatch, eflags);
+	}
+
+	if ((win->buffer != buffer) || (win->revision != buffer->revision) || (p < win->start) || (stop > win->end)) {
+		if (stop - p > win->cap) {
+			win->cap = MAX(stop - p, 2 * win->cap);
+			free(win->text);
+			win->text = malloc(sizeof(wchar_t) * win->cap);
+			alloc_assert(win->text);
+		}
+		for (int i = p; i < stop; ++i) {
+			win->text[i - p] = bat(buffer, i)->code;
+		}
+		win->buffer = buffer;
+		win->revision = buffer->revision;
+		win->start = p;
+		win->end = stop;
+	}
+
+	const wchar_t *text = win->text + (p - win->start);
+	int len = stop - p;
+
+	if (point->endatspace) {
+		for (int i = 0; i < len; ++i) {
+			if ((text[i] == ' ') || (text[i] == '\t')) {
+				len = i;
+				break;
+			}
+		}
+	}
+
+	return tre_regwnexec(preg, text, len, nmatch, pmatch, eflags);
+}
+
+static double tre_bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int teddy_rebench_command(ClientData client_data, Tcl_Interp *interp, int argc, const char *argv[]) {
+	HASBUF("teddy_intl::rebench");
+	ARGNUM((argc != 2), "teddy_intl::rebench");
+
+	buffer_t *buffer = interp_context_buffer();
+
+	char *fixed_pattern;
+	asprintf(&fixed_pattern, "^(?:%s)", argv[1]);
+	alloc_assert(fixed_pattern);
+	regex_t re;
+	int r = tre_regcomp(&re, fixed_pattern, REG_EXTENDED);
+	free(fixed_pattern);
+	if (r != REG_OK) {
+		Tcl_AddErrorInfo(interp, "Syntax error in regular expression");
+		return TCL_ERROR;
+	}
+
+	/* Matches the expression at the beginning of every word of every line of the buffer, the way lexy does, first through the bridge then through a window */
+
+	struct tre_window win;
+	tre_window_init(&win);
+
+	int matches[2] = { 0, 0 };
+	double elapsed[2];
+	int nlines = LSIZE(buffer) + 1;
+
+	for (int pass = 0; pass < 2; ++pass) {
+		double begin = tre_bench_now();
+		int p = 0;
+		while (p < BSIZE(buffer)) {
+			struct augmented_lpoint_t point;
+			point.buffer = buffer;
+			point.start_glyph = p;
+			point.offset = 0;
+			point.endatnewline = true;
+			point.endatspace = false;
+			point.limit = -1;
+
+			regmatch_t pmatch[1];
+			if (pass == 0) {
+				tre_str_source tss;
+				tre_bridge_init(&point, &tss);
+				r = tre_reguexec(&re, &tss, 1, pmatch, 0);
+			} else {
+				r = tre_window_exec(&win, &re, &point, 1, pmatch, 0);
+			}
+
+			if (r == REG_OK) {
+				++matches[pass];
+				p += MAX(pmatch[0].rm_eo, 1);
+			} else {
+				++p;
+			}
+		}
+		elapsed[pass] = tre_bench_now() - begin;
+	}
+
+	tre_window_free(&win);
+	tre_regfree(&re);
+
+	char *res;
+	asprintf(&res, "%d lines, bridge: %0.2fms (%d matches), window: %0.2fms (%d matches)", nlines, elapsed[0], matches[0], elapsed[1], matches[1]);
+	alloc_assert(res);
+	Tcl_SetResult(interp, res, TCL_VOLATILE);
+	free(res);
+
+	return TCL_OK;
+}
@@ -4,6 +4,8 @@
 #include <tre/tre.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <wchar.h>
+#include <tcl.h>
 
 #include "buffer.h"
 
@@ -13,9 +15,28 @@ struct augmented_lpoint_t {
 	int offset;
 	bool endatnewline;
 	bool endatspace;
+	int limit; // if not negative the text ends at this glyph
 };
 
 void tre_bridge_init(struct augmented_lpoint_t *point, tre_str_source *tss);
 
+/* Contiguous copy of a piece of the buffer, regular expressions are run on it with tre_regwnexec instead of going through the bridge.
+   A window is reused for matches on the same buffer as long as the buffer doesn't change */
+struct tre_window {
+	buffer_t *buffer;
+	unsigned long revision;
+	wchar_t *text;
+	int cap;
+	int start, end; // text holds the characters of the buffer between start and end
+};
+
+void tre_window_init(struct tre_window *win);
+void tre_window_free(struct tre_window *win);
+
+/* Like tre_reguexec on the bridge for point, but uses the window when the text that can be matched is short enough */
+int tre_window_exec(struct tre_window *win, const regex_t *preg, struct augmented_lpoint_t *point, size_t nmatch, regmatch_t pmatch[], int eflags);
+
+int teddy_rebench_command(ClientData client_data, Tcl_Interp *interp, int argc, const char *argv[]);
+
 
 #endif
\ No newline at end of file
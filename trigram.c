@@ -0,0 +1,221 @@
+#include "trigram.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+
+// lines in a new block, blocks that grow past twice this are split
+#define TRIGRAM_BLOCK_LINES 64
+#define TRIGRAM_BITS 8192
+#define TRIGRAM_WORDS (TRIGRAM_BITS / 64)
+
+struct trigram_block {
+	int nlines;
+	bool dirty; // bits must be recomputed
+	uint64_t bits[TRIGRAM_WORDS];
+};
+
+struct trigram_index {
+	struct trigram_block *blocks;
+	int n, cap;
+};
+
+static inline uint32_t trigram_hash(uint32_t a, uint32_t b, uint32_t c) {
+	uint32_t h = a * 0x9e3779b1u;
+	h = (h ^ (h >> 15)) + b * 0x85ebca77u;
+	h = (h ^ (h >> 13)) + c * 0xc2b2ae3du;
+	return (h ^ (h >> 16)) % TRIGRAM_BITS;
+}
+
+static int line_start(buffer_t *buffer, int line) {
+	return (line == 0) ? 0 : buffer_newline_position(buffer, line-1) + 1;
+}
+
+static int line_end(buffer_t *buffer, int line) {
+	return (line < LSIZE(buffer)) ? buffer_newline_position(buffer, line) : BSIZE(buffer);
+}
+
+// makes room for n blocks at position b
+static void trigram_insert_blocks(struct trigram_index *idx, int b, int n) {
+	if (idx->n + n > idx->cap) {
+		idx->cap = MAX(idx->n + n, 2 * idx->cap);
+		idx->blocks = realloc(idx->blocks, sizeof(struct trigram_block) * idx->cap);
+		alloc_assert(idx->blocks);
+	}
+	memmove(idx->blocks + b + n, idx->blocks + b, sizeof(struct trigram_block) * (idx->n - b));
+	idx->n += n;
+}
+
+// splits the lines of block b in blocks of TRIGRAM_BLOCK_LINES lines
+static void trigram_split(struct trigram_index *idx, int b) {
+	int nlines = idx->blocks[b].nlines;
+	int n = (nlines + TRIGRAM_BLOCK_LINES - 1) / TRIGRAM_BLOCK_LINES;
+	if (n <= 1) return;
+
+	trigram_insert_blocks(idx, b+1, n-1);
+	for (int i = 0; i < n; ++i) {
+		idx->blocks[b+i].nlines = MIN(TRIGRAM_BLOCK_LINES, nlines);
+		idx->blocks[b+i].dirty = true;
+		nlines -= idx->blocks[b+i].nlines;
+	}
+}
+
+static void trigram_create(buffer_t *buffer) {
+	struct trigram_index *idx = malloc(sizeof(struct trigram_index));
+	alloc_assert(idx);
+	idx->blocks = NULL;
+	idx->n = idx->cap = 0;
+
+	trigram_insert_blocks(idx, 0, 1);
+	idx->blocks[0].nlines = LSIZE(buffer) + 1;
+	trigram_split(idx, 0);
+	idx->blocks[0].dirty = true;
+
+	buffer->trigrams = idx;
+}
+
+void trigram_free(buffer_t *buffer) {
+	if (buffer->trigrams == NULL) return;
+	free(buffer->trigrams->blocks);
+	free(buffer->trigrams);
+	buffer->trigrams = NULL;
+}
+
+void trigram_edit(buffer_t *buffer, int line, int removed, int inserted) {
+	struct trigram_index *idx = buffer->trigrams;
+	if (idx == NULL) return;
+
+	int b = 0, first = 0;
+	while ((b < idx->n) && (first + idx->blocks[b].nlines <= line)) {
+		first += idx->blocks[b].nlines;
+		++b;
+	}
+
+	if (b >= idx->n) {
+		// out of sync, it will be recreated
+		trigram_free(buffer);
+		return;
+	}
+
+	// the removed lines are the ones after line in block b, then the first lines of the following blocks
+	idx->blocks[b].dirty = true;
+	int j = b, avail = idx->blocks[b].nlines - (line - first) - 1;
+	for (;;) {
+		int k = MIN(removed, avail);
+		idx->blocks[j].nlines -= k;
+		idx->blocks[j].dirty = true;
+		removed -= k;
+		if (removed <= 0) break;
+		if (++j >= idx->n) {
+			trigram_free(buffer);
+			return;
+		}
+		avail = idx->blocks[j].nlines;
+	}
+
+	idx->blocks[b].nlines += inserted;
+
+	// drop the blocks left empty
+	int w = b+1;
+	for (int r = b+1; r < idx->n; ++r) {
+		if ((r <= j) && (idx->blocks[r].nlines == 0)) continue;
+		if (w != r) idx->blocks[w] = idx->blocks[r];
+		++w;
+	}
+	idx->n = w;
+
+	if (idx->blocks[b].nlines > 2 * TRIGRAM_BLOCK_LINES) trigram_split(idx, b);
+}
+
+static void trigram_block_update(buffer_t *buffer, struct trigram_block *blk, int first) {
+	memset(blk->bits, 0, sizeof(blk->bits));
+
+	for (int l = first; l < first + blk->nlines; ++l) {
+		int e = line_end(buffer, l);
+		int p = line_start(buffer, l);
+		if (e - p < 3) continue;
+
+		uint32_t a = bat(buffer, p)->code, b = bat(buffer, p+1)->code;
+		for (p += 2; p < e; ++p) {
+			uint32_t c = bat(buffer, p)->code;
+			uint32_t h = trigram_hash(a, b, c);
+			blk->bits[h / 64] |= (uint64_t)1 << (h % 64);
+			a = b;
+			b = c;
+		}
+	}
+
+	blk->dirty = false;
+}
+
+static int trigram_find_in_line(buffer_t *buffer, const uint32_t *needle, int len, int line) {
+	int e = line_end(buffer, line);
+	for (int p = line_start(buffer, line); p + len <= e; ++p) {
+		int i;
+		for (i = 0; i < len; ++i) {
+			if (bat(buffer, p+i)->code != needle[i]) break;
+		}
+		if (i == len) return p;
+	}
+	return -1;
+}
+
+int trigram_find(buffer_t *buffer, const uint32_t *needle, int len, int *line, struct trigram_match *v, int cap) {
+	if (buffer->trigrams != NULL) {
+		// a buffer that changed without calling trigram_edit
+		int total = 0;
+		for (int b = 0; b < buffer->trigrams->n; ++b) {
+			total += buffer->trigrams->blocks[b].nlines;
+		}
+		if (total != LSIZE(buffer) + 1) trigram_free(buffer);
+	}
+
+	if (buffer->trigrams == NULL) trigram_create(buffer);
+	struct trigram_index *idx = buffer->trigrams;
+
+	int nh = len - 2;
+	uint32_t *h = malloc(sizeof(uint32_t) * MAX(nh, 1));
+	alloc_assert(h);
+	for (int i = 0; i < nh; ++i) {
+		h[i] = trigram_hash(needle[i], needle[i+1], needle[i+2]);
+	}
+
+	int n = 0;
+	int first = 0;
+	for (int b = 0; b < idx->n; first += idx->blocks[b].nlines, ++b) {
+		struct trigram_block *blk = idx->blocks + b;
+		if (first + blk->nlines <= *line) continue;
+
+		if (__atomic_load_n(&(buffer->release_read_lock), __ATOMIC_SEQ_CST)) {
+			*line = MAX(first, *line);
+			free(h);
+			return n;
+		}
+
+		if (blk->dirty) trigram_block_update(buffer, blk, first);
+
+		int i;
+		for (i = 0; i < nh; ++i) {
+			if ((blk->bits[h[i] / 64] & ((uint64_t)1 << (h[i] % 64))) == 0) break;
+		}
+		if (i < nh) continue;
+
+		for (int l = MAX(first, *line); l < first + blk->nlines; ++l) {
+			int p = trigram_find_in_line(buffer, needle, len, l);
+			if (p < 0) continue;
+			if (n >= cap) {
+				*line = l;
+				free(h);
+				return n;
+			}
+			v[n].line = l;
+			v[n].point = p;
+			++n;
+		}
+	}
+
+	free(h);
+	*line = -1;
+	return n;
+}
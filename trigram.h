@@ -0,0 +1,25 @@
+#ifndef __TRIGRAM_H__
+#define __TRIGRAM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "buffer.h"
+
+/* Trigram index of a buffer, used to find the lines containing a string.
+   Lines are grouped in blocks, each block records (in a bitmap indexed by a hash) the trigrams of its lines. Blocks only store how many lines they have, so an edit only changes the blocks it touches, their bitmaps are recomputed the next time the index is used */
+
+struct trigram_match {
+	int line; // 0 based
+	int point; // first occurrence in the line
+};
+
+// called by buffer.c after the text of buffer changes: removed lines after line were joined to it, then inserted lines were added after it
+void trigram_edit(buffer_t *buffer, int line, int removed, int inserted);
+void trigram_free(buffer_t *buffer);
+
+/* Finds the lines of buffer that contain needle (len >= 3) starting at line *line, must be called with the read lock of buffer held. Creates the index if it doesn't exist.
+   At most cap matches are stored in v. Returns the number of matches, *line is set to the first line that wasn't searched (-1 when the search is complete): the search stops when v is full or when someone wants the write lock */
+int trigram_find(buffer_t *buffer, const uint32_t *needle, int len, int *line, struct trigram_match *v, int cap);
+
+#endif
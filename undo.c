@@ -5,41 +5,160 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "global.h"
+
 //#define UNDO_DEBUGGING
 
-static void undo_node_free(undo_node_t *node) {
-	free(node->before_selection.text);
-	free(node->after_selection.text);
+// texts of undo nodes are allocated in chunks of this size, bigger texts get a chunk of their own
+#define UNDO_CHUNK_SIZE (256 * 1024)
+
+struct undo_chunk {
+	struct undo_chunk *next;
+	size_t size, used;
+	size_t live; // bytes used by blocks that weren't released
+	char data[];
+};
+
+static size_t undo_block_size(undo_node_t *node) {
+	return node->deleted + node->inserted + 2;
+}
+
+static struct undo_chunk *undo_chunk_new(undo_t *undo, size_t size) {
+	struct undo_chunk *chunk = malloc(sizeof(struct undo_chunk) + size);
+	alloc_assert(chunk);
+	chunk->size = size;
+	chunk->used = chunk->live = 0;
+	chunk->next = undo->chunks;
+	undo->chunks = chunk;
+	undo->memory += sizeof(struct undo_chunk) + size;
+	return chunk;
+}
+
+static void undo_chunk_free(undo_t *undo, struct undo_chunk *chunk) {
+	for (struct undo_chunk **p = &(undo->chunks); *p != NULL; p = &((*p)->next)) {
+		if (*p == chunk) {
+			*p = chunk->next;
+			break;
+		}
+	}
+	undo->memory -= sizeof(struct undo_chunk) + chunk->size;
+	free(chunk);
+}
+
+static void undo_block_alloc(undo_t *undo, undo_node_t *node) {
+	size_t size = undo_block_size(node);
+	struct undo_chunk *chunk;
+
+	if (size > UNDO_CHUNK_SIZE/4) {
+		chunk = undo_chunk_new(undo, size);
+	} else {
+		if ((undo->current == NULL) || (undo->current->size - undo->current->used < size)) {
+			undo->current = undo_chunk_new(undo, UNDO_CHUNK_SIZE);
+		}
+		chunk = undo->current;
+	}
+
+	node->chunk = chunk;
+	node->text = chunk->data + chunk->used;
+	chunk->used += size;
+	chunk->live += size;
+
+	node->text[node->deleted] = '\0';
+	node->text[size-1] = '\0';
+}
+
+static void undo_block_release(undo_t *undo, undo_node_t *node) {
+	struct undo_chunk *chunk = node->chunk;
+	if (chunk == NULL) return;
+
+	size_t size = undo_block_size(node);
+	chunk->live -= size;
+	// the last block of a chunk can be reused
+	if (node->text + size == chunk->data + chunk->used) chunk->used -= size;
+
+	if (chunk->live == 0) {
+		if (chunk == undo->current) {
+			chunk->used = 0;
+		} else {
+			undo_chunk_free(undo, chunk);
+		}
+	}
+
+	node->chunk = NULL;
+	node->text = NULL;
+}
+
+static void undo_node_free(undo_t *undo, undo_node_t *node) {
+	undo_block_release(undo, node);
 	if (node->tag != NULL) free(node->tag);
 	free(node);
+	undo->memory -= sizeof(undo_node_t);
+	--(undo->nodes);
+}
+
+static undo_node_t *undo_node_alloc(undo_t *undo) {
+	undo_node_t *node = malloc(sizeof(undo_node_t));
+	alloc_assert(node);
+	node->start = node->before_end = node->after_end = 0;
+	node->prefix = node->suffix = 0;
+	node->text = NULL;
+	node->deleted = node->inserted = 0;
+	node->chunk = NULL;
+	node->prev = node->next = NULL;
+	node->tag = NULL;
+	node->fake = false;
+	node->saved = false;
+	node->time = time(NULL);
+	undo->memory += sizeof(undo_node_t);
+	++(undo->nodes);
+	return node;
+}
+
+undo_node_t *undo_node_new(undo_t *undo, size_t deleted, size_t inserted) {
+	undo_node_t *node = undo_node_alloc(undo);
+	node->deleted = deleted;
+	node->inserted = inserted;
+	undo_block_alloc(undo, node);
+	return node;
+}
+
+char *undo_node_deleted(undo_node_t *node) {
+	return node->text;
+}
+
+char *undo_node_inserted(undo_node_t *node) {
+	return node->text + node->deleted + 1;
 }
 
 void undo_init(undo_t *undo) {
-	undo->head = malloc(sizeof(undo_node_t));
-	undo->head->tag = NULL;
+	undo->memory = 0;
+	undo->budget = 0;
+	undo->nodes = 0;
+	undo->chunks = undo->current = NULL;
+
+	undo->head = undo->root = undo_node_alloc(undo);
 	undo->head->fake = true;
 	undo->head->saved = true; // empty buffer is saved
-	undo->head->prev = NULL;
-	undo->head->next = NULL;
 	undo->please_fuse = false;
 }
 
 void undo_free(undo_t *undo) {
-	undo_node_t *cur;
-	for(;;) {
-		cur = undo_pop(undo);
-		if (cur == NULL) {
-			break;
-		}
-		undo_node_free(cur);
+	undo_node_t *node = undo->root;
+	while (node != NULL) {
+		undo_node_t *next = node->next;
+		undo_node_free(undo, node);
+		node = next;
 	}
-}
 
-#ifdef UNDO_DEBUGGING
-static void debug_print_selection(selection_t *selection) {
-	printf("   %d,%d <%s>\n", selection->start, selection->end, selection->text);
+	while (undo->chunks != NULL) {
+		undo_chunk_free(undo, undo->chunks);
+	}
+
+	undo->head = undo->root = NULL;
+	undo->current = NULL;
 }
 
+#ifdef UNDO_DEBUGGING
 static void debug_print_undo(undo_node_t *node) __attribute__ ((unused));
 static void debug_print_undo(undo_node_t *node) {
 	if (node == NULL) {
@@ -48,39 +167,68 @@ static void debug_print_undo(undo_node_t *node) {
 		if (node->fake) {
 			printf("   fake %d\n", node->fake);
 		} else {
-			debug_print_selection(&(node->before_selection));
-			debug_print_selection(&(node->after_selection));
+			printf("   %d,%d,%d (%d %d) <%s> -> <%s>\n", node->start, node->before_end, node->after_end, node->prefix, node->suffix, undo_node_deleted(node), undo_node_inserted(node));
 		}
 	}
 }
 #endif
 
-static bool selection_is_empty(selection_t *selection) {
-	return (selection->start == selection->end) && (selection->text[0] == '\0');
+static bool node_is_whole(undo_node_t *node) {
+	return (node->prefix == 0) && (node->suffix == 0);
 }
 
-static bool selections_are_adjacent(selection_t *a, selection_t *b) {
-	return a->end == b->start;
+// a is followed by b: b changes the text right after the text inserted by a
+static bool nodes_are_adjacent(undo_node_t *a, undo_node_t *b) {
+	return a->after_end == b->start;
 }
 
-static int selection_len(selection_t *selection) {
-	int r = selection->end - selection->start;
-	return (r < 0) ? -r : r;
-}
+/* Merges the text of src, adjacent to dst, into dst. When the two blocks are next to each other and the merged text fits without moving any of dst's bytes they are merged in place, this is the common case of typing and of repeated deletions */
+static void nodes_cat(undo_t *undo, undo_node_t *dst, undo_node_t *src) {
+	dst->before_end += src->before_end - src->start;
+	dst->after_end += src->after_end - src->start;
 
-static void selections_cat(selection_t *dst, selection_t *src) {
-#ifdef UNDO_DEBUGGING
-	printf("Concatenating\n");
-#endif
-	dst->end = src->end;
+	size_t deleted = dst->deleted + src->deleted, inserted = dst->inserted + src->inserted;
+
+	if ((dst->chunk == src->chunk) && (dst->text + undo_block_size(dst) == src->text) && ((src->deleted == 0) || (dst->inserted == 0))) {
+		struct undo_chunk *chunk = dst->chunk;
+		size_t srcsize = undo_block_size(src);
+		bool last = (src->text + srcsize == chunk->data + chunk->used);
 
-	char *newtext = malloc(strlen(src->text) + strlen(dst->text) + 1);
+		if (src->deleted == 0) {
+			// dst: D1 \0 I1 \0, src: \0 I2 \0
+			memmove(undo_node_inserted(dst) + dst->inserted, undo_node_inserted(src), src->inserted + 1);
+		} else {
+			// dst: D1 \0 \0, src: D2 \0 I2 \0
+			memmove(dst->text + dst->deleted, src->text, srcsize);
+		}
+
+		chunk->live -= 2;
+		if (last) chunk->used -= 2;
+		src->chunk = NULL;
+		src->text = NULL;
+
+		dst->deleted = deleted;
+		dst->inserted = inserted;
+		return;
+	}
 
-	strcpy(newtext, dst->text);
-	strcat(newtext, src->text);
+	undo_node_t merged = *dst;
+	merged.deleted = deleted;
+	merged.inserted = inserted;
+	undo_block_alloc(undo, &merged);
 
-	free(dst->text);
-	dst->text = newtext;
+	memcpy(merged.text, dst->text, dst->deleted);
+	memcpy(merged.text + dst->deleted, src->text, src->deleted);
+	memcpy(undo_node_inserted(&merged), undo_node_inserted(dst), dst->inserted);
+	memcpy(undo_node_inserted(&merged) + dst->inserted, undo_node_inserted(src), src->inserted);
+
+	undo_block_release(undo, src);
+	undo_block_release(undo, dst);
+
+	dst->text = merged.text;
+	dst->chunk = merged.chunk;
+	dst->deleted = deleted;
+	dst->inserted = inserted;
 }
 
 static void undo_drop_redo_info(undo_t *undo) {
@@ -89,15 +237,42 @@ static void undo_drop_redo_info(undo_t *undo) {
 	undo_node_t *node = undo->head->next;
 	while (node != NULL) {
 		undo_node_t *next = node->next;
-		undo_node_free(node);
+		undo_node_free(undo, node);
 		node = next;
 	}
 	undo->head->next = NULL;
 }
 
-void undo_push(undo_t *undo, undo_node_t *new_node) {
-	time_t now = time(NULL);
+// drops the oldest changes until the memory used is within budget, the last change is always kept
+static void undo_enforce_budget(undo_t *undo) {
+	if (undo->budget == 0) return;
+
+	while ((undo->memory > undo->budget) && (undo->root->next != NULL) && (undo->root->next != undo->head)) {
+		undo_node_t *oldest = undo->root->next;
+		undo->root->next = oldest->next;
+		oldest->next->prev = undo->root;
+		// the root now stands for the text after the oldest change
+		undo->root->saved = oldest->saved;
+		undo_node_free(undo, oldest);
+	}
+}
 
+bool undo_fusable(undo_t *undo, undo_node_t *new_node) {
+	if ((undo->head == NULL) || undo->head->fake) return false;
+	if (!node_is_whole(undo->head) || !node_is_whole(new_node)) return false;
+	if (!nodes_are_adjacent(undo->head, new_node)) return false;
+
+	// when appropriate we fuse the new undo node with the last one so you don't have to undo typing one character at a time
+	if (undo->please_fuse) return true;
+
+	return (undo->head->deleted == 0)
+		&& (new_node->deleted == 0)
+		&& (new_node->after_end - new_node->start == 1)
+		&& (undo_node_inserted(new_node)[0] != ' ')
+		&& ((new_node->time - undo->head->time) < TYPING_FUSION_INTERVAL);
+}
+
+void undo_push(undo_t *undo, undo_node_t *new_node, bool fuse) {
 	undo_drop_redo_info(undo);
 
 	new_node->fake = false;
@@ -106,43 +281,18 @@ void undo_push(undo_t *undo, undo_node_t *new_node) {
 #ifdef UNDO_DEBUGGING
 	printf("PUSHING (pre):\n");
 	debug_print_undo(undo->head);
-	printf("\tundo->head->before_selection isempty: %d\n", selection_is_empty(&(undo->head->before_selection)));
-	printf("\tnew_node->before_selection isempty: %d\n", selection_is_empty(&(new_node->before_selection)));
-	printf("\tnew_node->after_selection length: %d\n", selection_len(&(new_node->after_selection)));
-	printf("\tnew_node->after_selection.text[0] = '%c'\n", new_node->after_selection.text[0]);
-	printf("\tselections_are_adjacent: %d\n", selections_are_adjacent(&(undo->head->after_selection), &(new_node->after_selection)));
-	printf("\ttiming: %d %d\n", now - undo->head->time, TYPING_FUSION_INTERVAL);
+	debug_print_undo(new_node);
 #endif
 
-	// when appropriate we fuse the new undo node with the last one so you don't have to undo typing one character at a time
-	if (undo->please_fuse
-	  && (undo->head != NULL)
-	  && !undo->head->fake
-	  && selections_are_adjacent(&(undo->head->after_selection), &(new_node->after_selection))) {
-	    //debug_print_undo(undo->head);
-	    //debug_print_undo(new_node);
-	    selections_cat(&(undo->head->before_selection), &(new_node->before_selection));
-		selections_cat(&(undo->head->after_selection), &(new_node->after_selection));
-		undo->head->time = now;
-		undo_node_free(new_node);
-		//debug_print_undo(undo->head);
-	} else if ((undo->head != NULL)
-	  && !undo->head->fake
-      && selection_is_empty(&(undo->head->before_selection))
-      && selection_is_empty(&(new_node->before_selection))
-      && (selection_len(&(new_node->after_selection)) == 1)
-      && (new_node->after_selection.text[0] != ' ')
-      && selections_are_adjacent(&(undo->head->after_selection), &(new_node->after_selection))
-      && ((now - undo->head->time) < TYPING_FUSION_INTERVAL)) {
-		selections_cat(&(undo->head->after_selection), &(new_node->after_selection));
-		undo->head->time = now;
-		undo_node_free(new_node);
+	if (fuse) {
+		nodes_cat(undo, undo->head, new_node);
+		undo->head->time = new_node->time;
+		undo_node_free(undo, new_node);
 	} else {
 		// normal undo node append code
 		if (undo->head != NULL) undo->head->next = new_node;
 		new_node->prev = undo->head;
 		new_node->next = NULL;
-		new_node->time = now;
 		undo->head = new_node;
 	}
 
@@ -152,15 +302,15 @@ void undo_push(undo_t *undo, undo_node_t *new_node) {
 #endif
 
 	undo->please_fuse = false;
+
+	undo_enforce_budget(undo);
 }
 
 undo_node_t *undo_pop(undo_t *undo) {
 	undo_node_t *r = undo->head;
-	if (r->fake) return NULL;
+	if ((r == NULL) || r->fake) return NULL;
 
-	if (r != NULL) {
-		undo->head = r->prev;
-	}
+	undo->head = r->prev;
 
 #ifdef UNDO_DEBUGGING
 	printf("POPPING\n");
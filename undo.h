@@ -2,19 +2,23 @@
 #define __UNDO_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include <time.h>
 
 #define TYPING_FUSION_INTERVAL 2
 
-typedef struct _selection_t {
-	int start, end;
-	char *text;
-} selection_t;
+struct undo_chunk;
 
+/* An undo node records that the text between start and before_end was replaced with the text now between start and after_end.
+   Only the part of the two texts that differs is stored: the first prefix points and the last suffix points of the region were the same before and after the change. The deleted and inserted bytes live in a single block of the arena of the undo_t */
 typedef struct _undo_node_t {
-	selection_t before_selection;
-	selection_t after_selection;
+	int start, before_end, after_end;
+	int prefix, suffix;
+
+	char *text; // deleted bytes, '\0', inserted bytes, '\0'
+	size_t deleted, inserted;
+	struct undo_chunk *chunk;
 
 	struct _undo_node_t *prev;
 	struct _undo_node_t *next;
@@ -30,15 +34,31 @@ typedef struct _undo_node_t {
 typedef struct _undo_t {
 	/* head of the undo stack, in other words, the very last undo node added to the list */
 	undo_node_t *head;
+	/* fake node before the oldest change */
+	undo_node_t *root;
 
 	bool please_fuse;
+
+	// memory used by the nodes and the arena, when it goes over budget (if not 0) the oldest nodes are dropped
+	size_t memory, budget;
+	int nodes;
+
+	struct undo_chunk *chunks, *current;
 } undo_t;
 
 void undo_init(undo_t *undo);
 void undo_free(undo_t *undo);
 
-/* adds node to undo list */
-void undo_push(undo_t *undo, undo_node_t *new_node);
+/* creates a node with room for deleted and inserted bytes of text (to be filled by the caller at undo_node_deleted and undo_node_inserted) */
+undo_node_t *undo_node_new(undo_t *undo, size_t deleted, size_t inserted);
+
+char *undo_node_deleted(undo_node_t *node);
+char *undo_node_inserted(undo_node_t *node);
+
+/* true if new_node (created at new_node->time) would be fused with the head of the undo list instead of being added after it */
+bool undo_fusable(undo_t *undo, undo_node_t *new_node);
+/* adds node to undo list, or fuses it with the head (freeing it) if fuse is set */
+void undo_push(undo_t *undo, undo_node_t *new_node, bool fuse);
 
 /* returns a node from the undo list, moves the undo list head backwards */
 undo_node_t *undo_pop(undo_t *undo);